@@ -1,6 +1,11 @@
 #include "bytecode.h"
 
+#include <string.h>
+
 #include "memory.h"
+#include "native.h"
+#include "object.h"
+#include "trace.h"
 #include "value.h"
 #include "vm.h"
 
@@ -9,7 +14,24 @@ void init_bsequence(ByteSequence *seq) {
   seq->capacity = 0;
   seq->code = NULL;
   seq->lines = NULL;
+  seq->line_runs = NULL;
+  seq->frozen_size = 0;
   init_valarr(&seq->consts);
+  seq->prop_cache_cnt = 0;
+  seq->prop_cache_capacity = 0;
+  seq->prop_caches = NULL;
+  seq->invoke_cache_cnt = 0;
+  seq->invoke_cache_capacity = 0;
+  seq->invoke_caches = NULL;
+  seq->loop_cache_cnt = 0;
+  seq->loop_cache_capacity = 0;
+  seq->loop_caches = NULL;
+  seq->handler_cnt = 0;
+  seq->handler_capacity = 0;
+  seq->handlers = NULL;
+  seq->far_jump_cnt = 0;
+  seq->far_jump_capacity = 0;
+  seq->far_jumps = NULL;
 }
 
 void write_bsequence(ByteSequence *seq, uint8_t byte, int line) {
@@ -26,16 +48,566 @@ void write_bsequence(ByteSequence *seq, uint8_t byte, int line) {
   ++(seq->size);
 }
 
-void free_bsequence(ByteSequence *seq) {
+/** Frees the growable arrays of a sequence that is not frozen. */
+static void free_arrays(ByteSequence *seq) {
   FREE_ARR(uint8_t, seq->code, (size_t)seq->capacity);
   FREE_ARR(int, seq->lines, (size_t)seq->capacity);
   free_valarr(&seq->consts);
+  FREE_ARR(PropertyCache, seq->prop_caches, (size_t)seq->prop_cache_capacity);
+  FREE_ARR(InvokeCache, seq->invoke_caches,
+           (size_t)seq->invoke_cache_capacity);
+  FREE_ARR(LoopCache, seq->loop_caches, (size_t)seq->loop_cache_capacity);
+  FREE_ARR(Handler, seq->handlers, (size_t)seq->handler_capacity);
+  FREE_ARR(int, seq->far_jumps, (size_t)seq->far_jump_capacity);
+}
+
+void free_bsequence(ByteSequence *seq) {
+  for (int i = 0; i < seq->loop_cache_cnt; i++) {
+    if (seq->loop_caches[i].trace != NULL) {
+      free_trace(seq->loop_caches[i].trace);
+    }
+  }
+  if (seq->frozen_size > 0) {
+    // The constants come first, so their array starts the block
+    FREE_ARR(uint8_t, seq->consts.vals, seq->frozen_size);
+  } else {
+    free_arrays(seq);
+  }
   init_bsequence(seq);
 }
 
+/**
+ * Appends the line runs of `seq` to `out`, or only counts their bytes if
+ * `out` is NULL, and returns that count. Each run is the number of bytes it
+ * covers (at most 255) followed by the change from the previous run's line,
+ * zigzag-encoded in 7-bit groups, lowest first, with the top bit set on all
+ * but the last.
+ */
+static size_t encode_lines(ByteSequence *seq, uint8_t *out) {
+  size_t length = 0;
+  int line = 0;
+  for (int offset = 0; offset < seq->size;) {
+    int run = 1;
+    while (run < UINT8_MAX && offset + run < seq->size &&
+           seq->lines[offset + run] == seq->lines[offset]) {
+      run++;
+    }
+    int delta = seq->lines[offset] - line;
+    uint32_t zigzag = delta < 0 ? ((uint32_t)~delta << 1) | 1
+                                : (uint32_t)delta << 1;
+    if (out != NULL) {
+      out[length] = (uint8_t)run;
+    }
+    length++;
+    do {
+      uint8_t byte = zigzag & 0x7f;
+      zigzag >>= 7;
+      if (out != NULL) {
+        out[length] = zigzag != 0 ? byte | 0x80 : byte;
+      }
+      length++;
+    } while (zigzag != 0);
+    line = seq->lines[offset];
+    offset += run;
+  }
+  return length;
+}
+
+/**
+ * Reserves `cnt` elements of `elem_size` bytes at `*size` in a block, and
+ * returns where they start.
+ */
+static size_t place(size_t *size, int cnt, size_t elem_size) {
+  size_t start = *size;
+  *size += (size_t)cnt * elem_size;
+  return start;
+}
+
+/** Copies `size` bytes from `src`, which is NULL if the array is empty. */
+static void copy_arr(uint8_t *dest, const void *src, size_t size) {
+  if (size > 0) {
+    memcpy(dest, src, size);
+  }
+}
+
+void freeze_bsequence(ByteSequence *seq) {
+  // Ordered by alignment, so every array stays aligned
+  size_t size = 0;
+  size_t consts = place(&size, seq->consts.size, sizeof(Value));
+  size_t prop_caches =
+      place(&size, seq->prop_cache_cnt, sizeof(PropertyCache));
+  size_t invoke_caches =
+      place(&size, seq->invoke_cache_cnt, sizeof(InvokeCache));
+  size_t loop_caches = place(&size, seq->loop_cache_cnt, sizeof(LoopCache));
+  size_t handlers = place(&size, seq->handler_cnt, sizeof(Handler));
+  size_t far_jumps = place(&size, seq->far_jump_cnt, sizeof(int));
+  size_t code = place(&size, seq->size, sizeof(uint8_t));
+  size_t line_runs = place(&size, (int)encode_lines(seq, NULL), 1);
+  if (size == 0) {
+    return;
+  }
+
+  // Allocating can collect garbage, which still marks the old constants
+  uint8_t *block = ALLOCATE(uint8_t, size);
+  copy_arr(block + consts, seq->consts.vals,
+           (size_t)seq->consts.size * sizeof(Value));
+  copy_arr(block + prop_caches, seq->prop_caches,
+           (size_t)seq->prop_cache_cnt * sizeof(PropertyCache));
+  copy_arr(block + invoke_caches, seq->invoke_caches,
+           (size_t)seq->invoke_cache_cnt * sizeof(InvokeCache));
+  copy_arr(block + loop_caches, seq->loop_caches,
+           (size_t)seq->loop_cache_cnt * sizeof(LoopCache));
+  copy_arr(block + handlers, seq->handlers,
+           (size_t)seq->handler_cnt * sizeof(Handler));
+  copy_arr(block + far_jumps, seq->far_jumps,
+           (size_t)seq->far_jump_cnt * sizeof(int));
+  copy_arr(block + code, seq->code, (size_t)seq->size);
+  encode_lines(seq, block + line_runs);
+  int const_cnt = seq->consts.size;
+  free_arrays(seq);
+
+  seq->frozen_size = size;
+  seq->capacity = seq->size;
+  seq->code = block + code;
+  seq->lines = NULL;
+  seq->line_runs = block + line_runs;
+  seq->consts.size = const_cnt;
+  seq->consts.capacity = const_cnt;
+  seq->consts.vals = (Value *)(void *)(block + consts);
+  seq->prop_cache_capacity = seq->prop_cache_cnt;
+  seq->prop_caches = (PropertyCache *)(void *)(block + prop_caches);
+  seq->invoke_cache_capacity = seq->invoke_cache_cnt;
+  seq->invoke_caches = (InvokeCache *)(void *)(block + invoke_caches);
+  seq->loop_cache_capacity = seq->loop_cache_cnt;
+  seq->loop_caches = (LoopCache *)(void *)(block + loop_caches);
+  seq->handler_capacity = seq->handler_cnt;
+  seq->handlers = (Handler *)(void *)(block + handlers);
+  seq->far_jump_capacity = seq->far_jump_cnt;
+  seq->far_jumps = (int *)(void *)(block + far_jumps);
+}
+
+int get_line(ByteSequence *seq, int offset) {
+  if (seq->lines != NULL) {
+    return seq->lines[offset];
+  }
+  const uint8_t *run = seq->line_runs;
+  int line = 0;
+  for (int start = 0;;) {
+    int length = *run++;
+    uint32_t zigzag = 0;
+    for (int shift = 0;; shift += 7) {
+      uint8_t byte = *run++;
+      zigzag |= (uint32_t)(byte & 0x7f) << shift;
+      if ((byte & 0x80) == 0) {
+        break;
+      }
+    }
+    line += (zigzag & 1) != 0 ? (int)~(zigzag >> 1) : (int)(zigzag >> 1);
+    start += length;
+    if (offset < start) {
+      return line;
+    }
+  }
+}
+
 int add_const(ByteSequence *seq, Value val) {
   push(val);
   write_valarr(&seq->consts, val);
   pop();
   return seq->consts.size - 1;
 }
+
+/** Returns the length in bytes of the instruction at `offset`. */
+int instr_size(ByteSequence *seq, int offset) {
+  switch (seq->code[offset]) {
+    case OP_CONSTANT:
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_GET_UPVALUE:
+    case OP_SET_UPVALUE:
+    case OP_GET_SUPER:
+    case OP_CALL:
+    case OP_TAIL_CALL:
+    case OP_CLASS:
+    case OP_METHOD:
+    case OP_SET_LOCAL_POP:
+    case OP_INTRINSIC:
+      return 2;
+    case OP_GET_GLOBAL:
+    case OP_DEFINE_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_GET_LOCAL_LOCAL:
+    case OP_GET_LOCAL_CONSTANT:
+    case OP_JUMP_IF_FALSE_POP:
+    case OP_JUMP_IF_TRUE_POP:
+    case OP_GET_LOCAL_LONG:
+    case OP_SET_LOCAL_LONG:
+    case OP_GET_UPVALUE_LONG:
+    case OP_SET_UPVALUE_LONG:
+    case OP_JUMP_FAR:
+    case OP_JUMP_IF_FALSE_FAR:
+    case OP_JUMP_IF_FALSE_POP_FAR:
+      return 3;
+    case OP_GET_PROPERTY:
+    case OP_SET_PROPERTY:
+    case OP_GET_FIELD:
+    case OP_SET_FIELD:
+    case OP_CONSTANT_LONG:
+    case OP_GET_SUPER_LONG:
+    case OP_CLASS_LONG:
+    case OP_METHOD_LONG:
+      return 4;
+    case OP_INVOKE:
+    case OP_SUPER_INVOKE:
+    case OP_TAIL_INVOKE:
+    case OP_TAIL_SUPER_INVOKE:
+    case OP_LOOP:
+    case OP_LOOP_FAR:
+    case OP_GET_LOCAL_PROPERTY:
+    case OP_GET_LOCAL_FIELD:
+      return 5;
+    case OP_INLINE_CALL:
+      return 4;
+    case OP_FOR_PREP:
+    case OP_GET_PROPERTY_LONG:
+    case OP_SET_PROPERTY_LONG:
+    case OP_GET_FIELD_LONG:
+    case OP_SET_FIELD_LONG:
+      return 6;
+    case OP_INLINE_INVOKE:
+    case OP_INVOKE_LONG:
+    case OP_SUPER_INVOKE_LONG:
+    case OP_TAIL_INVOKE_LONG:
+    case OP_TAIL_SUPER_INVOKE_LONG:
+      return 7;
+    case OP_FOR_LOOP:
+      return 9;
+    case OP_ADD_RR:
+    case OP_ADD_RK:
+    case OP_SUBTRACT_RR:
+    case OP_SUBTRACT_RK:
+    case OP_MULTIPLY_RR:
+    case OP_MULTIPLY_RK:
+    case OP_DIVIDE_RR:
+    case OP_DIVIDE_RK:
+    case OP_LESS_RR:
+    case OP_LESS_RK:
+    case OP_GREATER_RR:
+    case OP_GREATER_RK:
+      return 4;
+    case OP_CLOSURE:
+    case OP_CLOSURE_LONG: {
+      uint8_t *ip = &seq->code[offset];
+      int size = 2;
+      int constant = ip[1];
+      if (*ip == OP_CLOSURE_LONG) {
+        size = 4;
+        constant = (ip[1] << 16) | (ip[2] << 8) | ip[3];
+      }
+      ObjFunction *function = AS_FUNCTION(seq->consts.vals[constant]);
+      for (int i = 0; i < function->upvalue_cnt; i++) {
+        size += (seq->code[offset + size] & CAPTURE_WIDE) ? 3 : 2;
+      }
+      return size;
+    }
+    default:
+      return 1;
+  }
+}
+
+int back_edge_target(ByteSequence *seq, int offset) {
+  uint8_t *ip = &seq->code[offset];
+  switch (*ip) {
+    case OP_LOOP:
+      return offset + 5 - ((ip[1] << 8) | ip[2]);
+    case OP_FOR_LOOP:
+      return offset + 9 - ((ip[5] << 8) | ip[6]);
+    case OP_LOOP_FAR:
+      return seq->far_jumps[(ip[1] << 8) | ip[2]];
+    default:
+      return -1;
+  }
+}
+
+int jump_target(ByteSequence *seq, int offset) {
+  uint8_t *ip = &seq->code[offset];
+  switch (*ip) {
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_JUMP_IF_FALSE_POP:
+    case OP_JUMP_IF_TRUE_POP:
+      return offset + 3 + ((ip[1] << 8) | ip[2]);
+    case OP_JUMP_FAR:
+    case OP_JUMP_IF_FALSE_FAR:
+    case OP_JUMP_IF_FALSE_POP_FAR:
+      return seq->far_jumps[(ip[1] << 8) | ip[2]];
+    case OP_FOR_PREP: {
+      int exit = (ip[4] << 8) | ip[5];
+      return (ip[3] & FOR_FAR_EXIT) ? seq->far_jumps[exit] : offset + 6 + exit;
+    }
+    default:
+      return -1;
+  }
+}
+
+int add_prop_cache(ByteSequence *seq) {
+  if (seq->prop_cache_capacity < seq->prop_cache_cnt + 1) {
+    int capacity = seq->prop_cache_capacity;
+    seq->prop_cache_capacity = GROW_CAPACITY(capacity);
+    seq->prop_caches =
+        GROW_ARR(PropertyCache, seq->prop_caches, (size_t)capacity,
+                 (size_t)seq->prop_cache_capacity);
+  }
+  PropertyCache *cache = &seq->prop_caches[seq->prop_cache_cnt];
+  cache->shape = NULL;
+  cache->transition = NULL;
+  cache->slot = 0;
+  return seq->prop_cache_cnt++;
+}
+
+int add_invoke_cache(ByteSequence *seq) {
+  if (seq->invoke_cache_capacity < seq->invoke_cache_cnt + 1) {
+    int capacity = seq->invoke_cache_capacity;
+    seq->invoke_cache_capacity = GROW_CAPACITY(capacity);
+    seq->invoke_caches =
+        GROW_ARR(InvokeCache, seq->invoke_caches, (size_t)capacity,
+                 (size_t)seq->invoke_cache_capacity);
+  }
+  seq->invoke_caches[seq->invoke_cache_cnt].cnt = 0;
+  return seq->invoke_cache_cnt++;
+}
+
+int add_loop_cache(ByteSequence *seq) {
+  if (seq->loop_cache_capacity < seq->loop_cache_cnt + 1) {
+    int capacity = seq->loop_cache_capacity;
+    seq->loop_cache_capacity = GROW_CAPACITY(capacity);
+    seq->loop_caches =
+        GROW_ARR(LoopCache, seq->loop_caches, (size_t)capacity,
+                 (size_t)seq->loop_cache_capacity);
+  }
+  LoopCache *cache = &seq->loop_caches[seq->loop_cache_cnt];
+  cache->hotness = 0;
+  cache->aborts = 0;
+  cache->trace = NULL;
+  return seq->loop_cache_cnt++;
+}
+
+void add_handler(ByteSequence *seq, int start, int end, int handler,
+                 int depth) {
+  if (seq->handler_capacity < seq->handler_cnt + 1) {
+    int capacity = seq->handler_capacity;
+    seq->handler_capacity = GROW_CAPACITY(capacity);
+    seq->handlers = GROW_ARR(Handler, seq->handlers, (size_t)capacity,
+                             (size_t)seq->handler_capacity);
+  }
+  Handler *entry = &seq->handlers[seq->handler_cnt++];
+  entry->start = start;
+  entry->end = end;
+  entry->handler = handler;
+  entry->depth = depth;
+}
+
+int add_far_jump(ByteSequence *seq, int target) {
+  if (seq->far_jump_capacity < seq->far_jump_cnt + 1) {
+    int capacity = seq->far_jump_capacity;
+    seq->far_jump_capacity = GROW_CAPACITY(capacity);
+    seq->far_jumps = GROW_ARR(int, seq->far_jumps, (size_t)capacity,
+                              (size_t)seq->far_jump_capacity);
+  }
+  seq->far_jumps[seq->far_jump_cnt] = target;
+  return seq->far_jump_cnt++;
+}
+
+Handler *find_handler(ByteSequence *seq, int offset) {
+  for (int i = 0; i < seq->handler_cnt; i++) {
+    Handler *entry = &seq->handlers[i];
+    if (offset >= entry->start && offset < entry->end) {
+      return entry;
+    }
+  }
+  return NULL;
+}
+
+/** Returns how much the instruction at `offset` grows the stack. */
+static int stack_effect(ByteSequence *seq, int offset) {
+  uint8_t *ip = &seq->code[offset];
+  switch (*ip) {
+    case OP_CONSTANT:
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_GET_LOCAL:
+    case OP_GET_GLOBAL:
+    case OP_GET_UPVALUE:
+    case OP_CLOSURE:
+    case OP_CLOSURE_LONG:
+    case OP_CLASS:
+    case OP_CLASS_LONG:
+    case OP_GET_LOCAL_PROPERTY:
+    case OP_GET_LOCAL_FIELD:
+    case OP_CONSTANT_LONG:
+    case OP_GET_LOCAL_LONG:
+    case OP_GET_UPVALUE_LONG:
+      return 1;
+    case OP_GET_LOCAL_LOCAL:
+    case OP_GET_LOCAL_CONSTANT:
+      return 2;
+    case OP_POP:
+    case OP_THROW:
+    case OP_DEFINE_GLOBAL:
+    case OP_SET_PROPERTY:
+    case OP_SET_FIELD:
+    case OP_SET_PROPERTY_LONG:
+    case OP_SET_FIELD_LONG:
+    case OP_GET_SUPER:
+    case OP_GET_SUPER_LONG:
+    case OP_EQUAL:
+    case OP_GREATER:
+    case OP_GREATER_NUM:
+    case OP_LESS:
+    case OP_LESS_NUM:
+    case OP_ADD:
+    case OP_ADD_NUM:
+    case OP_ADD_STR:
+    case OP_SUBTRACT:
+    case OP_SUBTRACT_NUM:
+    case OP_MULTIPLY:
+    case OP_MULTIPLY_NUM:
+    case OP_DIVIDE:
+    case OP_DIVIDE_NUM:
+    case OP_PRINT:
+    case OP_CLOSE_UPVALUE:
+    case OP_METHOD:
+    case OP_METHOD_LONG:
+    case OP_INHERIT:
+    case OP_SET_LOCAL_POP:
+    case OP_JUMP_IF_FALSE_POP:
+    case OP_JUMP_IF_TRUE_POP:
+    case OP_JUMP_IF_FALSE_POP_FAR:
+      return -1;
+    case OP_CALL:
+    case OP_TAIL_CALL:
+      return -ip[1];
+    case OP_INTRINSIC:
+      return -intrinsics[ip[1]].arity;
+    case OP_INVOKE:
+    case OP_TAIL_INVOKE:
+      return -ip[2];
+    case OP_SUPER_INVOKE:
+    case OP_TAIL_SUPER_INVOKE:
+      return -ip[2] - 1;
+    case OP_INVOKE_LONG:
+    case OP_TAIL_INVOKE_LONG:
+      return -ip[4];
+    case OP_SUPER_INVOKE_LONG:
+    case OP_TAIL_SUPER_INVOKE_LONG:
+      return -ip[4] - 1;
+    default:
+      if (IS_REGISTER_OP(*ip)) {
+        return ip[1] == REG_PUSH ? 1 : 0;
+      }
+      return 0;
+  }
+}
+
+int successors(ByteSequence *seq, int offset, int targets[2]) {
+  uint8_t *ip = &seq->code[offset];
+  int size = instr_size(seq, offset);
+  switch (*ip) {
+    case OP_RETURN:
+    case OP_THROW:
+    case OP_INLINE_RETURN:
+      return 0;
+    case OP_INLINE_CALL:
+    case OP_INLINE_INVOKE:
+      targets[0] = offset + size;
+      targets[1] = offset + size + ((ip[size - 2] << 8) | ip[size - 1]);
+      return 2;
+    case OP_JUMP:
+    case OP_JUMP_FAR:
+      targets[0] = jump_target(seq, offset);
+      return 1;
+    case OP_JUMP_IF_FALSE:
+    case OP_JUMP_IF_FALSE_POP:
+    case OP_JUMP_IF_TRUE_POP:
+    case OP_JUMP_IF_FALSE_FAR:
+    case OP_JUMP_IF_FALSE_POP_FAR:
+    case OP_FOR_PREP:
+      targets[0] = offset + size;
+      targets[1] = jump_target(seq, offset);
+      return 2;
+    case OP_LOOP:
+    case OP_LOOP_FAR:
+      targets[0] = back_edge_target(seq, offset);
+      return 1;
+    case OP_FOR_LOOP:
+      targets[0] = offset + size;
+      targets[1] = back_edge_target(seq, offset);
+      return 2;
+    default:
+      targets[0] = offset + size;
+      return 1;
+  }
+}
+
+int max_stack_size(ByteSequence *seq, int base) {
+  if (seq->size == 0) {
+    return base;
+  }
+  int *depths = ALLOCATE(int, (size_t)seq->size);
+  int *pending = ALLOCATE(int, (size_t)seq->size);
+  for (int i = 0; i < seq->size; i++) {
+    depths[i] = -1;
+  }
+  int pending_cnt = 0;
+  int max = base;
+  depths[0] = base;
+  pending[pending_cnt++] = 0;
+  // Handlers are only reached by unwinding, with the exception pushed
+  for (int i = 0; i < seq->handler_cnt; i++) {
+    Handler *entry = &seq->handlers[i];
+    depths[entry->handler] = entry->depth + 1;
+    pending[pending_cnt++] = entry->handler;
+    if (entry->depth + 1 > max) {
+      max = entry->depth + 1;
+    }
+  }
+
+  // Every instruction is reached with the same depth on all paths, so each
+  // one needs to be visited only once
+  while (pending_cnt > 0) {
+    int offset = pending[--pending_cnt];
+    int depth = depths[offset] + stack_effect(seq, offset);
+    if (depth > max) {
+      max = depth;
+    }
+    int targets[2];
+    int target_cnt = successors(seq, offset, targets);
+    // A failed inline guard calls the function, leaving its result in the
+    // callee's slot. OP_INLINE_RETURN reaches the same code with that depth.
+    uint8_t op = seq->code[offset];
+    if (op == OP_INLINE_CALL || op == OP_INLINE_INVOKE) {
+      int size = instr_size(seq, offset);
+      int constant = seq->code[offset + size - 3];
+      ObjFunction *function = AS_FUNCTION(seq->consts.vals[constant]);
+      int target = targets[--target_cnt];
+      if (target < seq->size && depths[target] == -1) {
+        depths[target] = depth - function->arity;
+        pending[pending_cnt++] = target;
+      }
+    }
+    for (int i = 0; i < target_cnt; i++) {
+      int target = targets[i];
+      if (target >= 0 && target < seq->size && depths[target] == -1) {
+        depths[target] = depth;
+        pending[pending_cnt++] = target;
+      }
+    }
+  }
+
+  FREE_ARR(int, depths, (size_t)seq->size);
+  FREE_ARR(int, pending, (size_t)seq->size);
+  return max;
+}
@@ -32,26 +32,275 @@ typedef enum {
   OP_JUMP,
   OP_JUMP_IF_FALSE,
   OP_LOOP,
+  OP_FOR_PREP,
+  OP_FOR_LOOP,
   OP_CALL,
+  OP_TAIL_CALL,
+  OP_INTRINSIC,  // id; calls the math global `id` with its arity, see native.h
   OP_INVOKE,
   OP_SUPER_INVOKE,
+  OP_TAIL_INVOKE,
+  OP_TAIL_SUPER_INVOKE,
+  OP_INLINE_CALL,    // fn skip(2); see below
+  OP_INLINE_INVOKE,  // name cache(2) fn skip(2)
+  OP_INLINE_RETURN,
   OP_CLOSURE,
   OP_CLOSE_UPVALUE,
   OP_RETURN,
+  OP_THROW,
   OP_CLASS,
   OP_METHOD,
   OP_INHERIT,
+  // Wide forms, emitted only where the compact operand doesn't fit: a 24-bit
+  // constant or name, a 16-bit slot or upvalue index, or a jump too long for
+  // 16 bits. A _FAR jump's operand indexes the far jump table in place of an
+  // offset. The other operands are those of the compact form.
+  OP_CONSTANT_LONG,
+  OP_GET_LOCAL_LONG,
+  OP_SET_LOCAL_LONG,
+  OP_GET_UPVALUE_LONG,
+  OP_SET_UPVALUE_LONG,
+  OP_JUMP_FAR,
+  OP_JUMP_IF_FALSE_FAR,
+  OP_JUMP_IF_FALSE_POP_FAR,
+  OP_LOOP_FAR,  // far(2) cache(2)
+  OP_CLOSURE_LONG,
+  OP_GET_PROPERTY_LONG,
+  OP_SET_PROPERTY_LONG,
+  OP_GET_SUPER_LONG,
+  OP_INVOKE_LONG,
+  OP_SUPER_INVOKE_LONG,
+  OP_TAIL_INVOKE_LONG,
+  OP_TAIL_SUPER_INVOKE_LONG,
+  OP_CLASS_LONG,
+  OP_METHOD_LONG,
+  // Superinstructions, each doing the work of the sequence in its name. The
+  // compiler emits them in place of that sequence when no jump lands inside
+  // it. Operands are those of the fused instructions, in order.
+  OP_GET_LOCAL_LOCAL,
+  OP_GET_LOCAL_CONSTANT,
+  OP_GET_LOCAL_PROPERTY,
+  OP_SET_LOCAL_POP,
+  OP_JUMP_IF_FALSE_POP,
+  OP_JUMP_IF_TRUE_POP,  // NOT then JUMP_IF_FALSE_POP
+  // Register instructions, three-address forms of the arithmetic above.
+  // Operands are the destination slot, the slot of the left operand and the
+  // slot (_RR) or constant (_RK) of the right one. A destination of REG_PUSH
+  // pushes the result instead.
+  OP_ADD_RR,
+  OP_ADD_RK,
+  OP_SUBTRACT_RR,
+  OP_SUBTRACT_RK,
+  OP_MULTIPLY_RR,
+  OP_MULTIPLY_RK,
+  OP_DIVIDE_RR,
+  OP_DIVIDE_RK,
+  OP_LESS_RR,
+  OP_LESS_RK,
+  OP_GREATER_RR,
+  OP_GREATER_RK,
+  // Quickened forms. The compiler never emits these: run() rewrites a
+  // generic instruction in place once it has seen its operand types, and
+  // rewrites it back when a guard fails. Operands match the generic form.
+  OP_GET_FIELD,
+  OP_SET_FIELD,
+  OP_GET_LOCAL_FIELD,
+  OP_GET_FIELD_LONG,
+  OP_SET_FIELD_LONG,
+  OP_GREATER_NUM,
+  OP_LESS_NUM,
+  OP_ADD_NUM,
+  OP_ADD_STR,
+  OP_SUBTRACT_NUM,
+  OP_MULTIPLY_NUM,
+  OP_DIVIDE_NUM,
 } OpCode;
 
+/**
+ * Mode operand of the counted loop instructions. OP_FOR_PREP counter limit
+ * mode exit(2) tests `counter cmp limit` once before the first iteration,
+ * checking that both are numbers. OP_FOR_LOOP counter limit mode step(const)
+ * back(2) cache(2) adds the step to the counter and jumps back while the
+ * test holds. The compiler only emits them when the loop body can't change
+ * the counter or a limit slot.
+ */
+#define FOR_LESS 0           // counter < limit
+#define FOR_LESS_EQUAL 1     // counter <= limit, that is !(counter > limit)
+#define FOR_GREATER 2        // counter > limit
+#define FOR_GREATER_EQUAL 3  // counter >= limit, that is !(counter < limit)
+#define FOR_CMP_MASK 3
+#define FOR_CONST_LIMIT 4  // limit is a constant rather than a slot
+#define FOR_FAR_EXIT 8     // OP_FOR_PREP's exit indexes the far jump table
+
+/** Tests the condition of a counted loop with the given mode. */
+static inline bool for_test(uint8_t mode, double counter, double limit) {
+  switch (mode & FOR_CMP_MASK) {
+    case FOR_LESS:
+      return counter < limit;
+    case FOR_LESS_EQUAL:
+      return !(counter > limit);
+    case FOR_GREATER:
+      return counter > limit;
+    default:
+      return !(counter < limit);
+  }
+}
+
+/**
+ * Inlined calls. The compiler copies the body of a small function or method
+ * to its call site, between an OP_INLINE_CALL or OP_INLINE_INVOKE guard and
+ * an OP_INLINE_RETURN. The guard checks that the callee, or the method the
+ * receiver resolves to, is still the closure of `fn`. If so, the frame's
+ * slots move up to the callee for the body, so that its slot operands need
+ * no rewriting, and OP_INLINE_RETURN moves them back. Otherwise the guard
+ * jumps `skip` bytes past the body and makes the call it replaced.
+ */
+
+/**
+ * OP_CLOSURE fn, or OP_CLOSURE_LONG with a 24-bit fn, is followed by a flags
+ * byte and an index for each upvalue of the closure it creates. The index
+ * takes two bytes with CAPTURE_WIDE. A local captured with CAPTURE_VALUE is
+ * never assigned, so the closure keeps a copy of it in a cell of its own
+ * instead of sharing an upvalue; so does a closure capturing such a cell
+ * from the enclosing one. A closure capturing a local with CAPTURE_FRAME is
+ * only ever called while the local is in scope, so its cell points at the
+ * slot and needs no closing.
+ */
+#define CAPTURE_LOCAL 1  // index is a slot of the frame, else an upvalue
+#define CAPTURE_WIDE 2
+#define CAPTURE_VALUE 4
+#define CAPTURE_FRAME 8
+
+#define REG_PUSH UINT8_MAX
+#define IS_REGISTER_OP(op) ((op) >= OP_ADD_RR && (op) <= OP_GREATER_RK)
+
+/**
+ * Monomorphic inline cache of one property access site. A hit means the
+ * receiver has `shape`, so the field is at `slot`. For stores that add a
+ * field, `transition` is the shape the instance moves to.
+ */
+typedef struct {
+  ObjShape *shape;
+  ObjShape *transition;
+  int slot;
+} PropertyCache;
+
+#define INVOKE_CACHE_SIZE 4
+
+typedef struct {
+  ObjShape *shape;
+  ObjClass *cls;
+  uint32_t version;  // of cls when the entry was made
+  ObjClosure *method;
+} InvokeCacheEntry;
+
+/**
+ * Polymorphic inline cache of one method call site, mapping the receiver's
+ * class (and shape, which proves no field shadows the method) to the closure
+ * to call. An entry only holds while its class keeps the version it had, so
+ * changing a class's methods invalidates every entry for it at once. Once
+ * more than INVOKE_CACHE_SIZE receivers have been seen, the site is
+ * megamorphic and always takes the method table lookup.
+ */
+typedef struct {
+  int cnt;  // -1 once the site is megamorphic
+  InvokeCacheEntry entries[INVOKE_CACHE_SIZE];
+} InvokeCache;
+
+typedef struct Trace Trace;
+
+/**
+ * Per-loop state of one OP_LOOP site: how often its back-edge was taken and
+ * the trace recorded for its body once it got hot.
+ */
+typedef struct {
+  int hotness;  // -1 once recording failed too often
+  int aborts;
+  Trace *trace;
+} LoopCache;
+
+/**
+ * Handler of one try block. An exception thrown by an instruction in
+ * [start, end) resumes at `handler`, with the stack cut back to `depth`
+ * slots above the frame's base and the exception pushed. Entering the block
+ * runs nothing: the handler is only looked up while unwinding.
+ */
+typedef struct {
+  int start;
+  int end;
+  int handler;
+  int depth;
+} Handler;
+
+/**
+ * Code of one function. The arrays grow while the compiler writes it; once
+ * done, freeze_bsequence() moves them into one right-sized block and
+ * replaces the per-byte lines by a run-length table.
+ */
 typedef struct {
   int size;
   int capacity;
   uint8_t *code;
-  int *lines;
+  int *lines;          // line of each byte, until frozen
+  uint8_t *line_runs;  // once frozen, see get_line()
+  size_t frozen_size;  // bytes in the block that holds every array, or 0
   ValueArray consts;
+  int prop_cache_cnt;
+  int prop_cache_capacity;
+  PropertyCache *prop_caches;
+  int invoke_cache_cnt;
+  int invoke_cache_capacity;
+  InvokeCache *invoke_caches;
+  int loop_cache_cnt;
+  int loop_cache_capacity;
+  LoopCache *loop_caches;
+  int handler_cnt;  // innermost try blocks first
+  int handler_capacity;
+  Handler *handlers;
+  int far_jump_cnt;
+  int far_jump_capacity;
+  int *far_jumps;  // target offsets of the _FAR jumps
 } ByteSequence;
 
 void init_bsequence(ByteSequence *seq);
 void write_bsequence(ByteSequence *seq, uint8_t byte, int line);
 void free_bsequence(ByteSequence *seq);
+/** Moves `seq` into one block. Nothing may be added to it afterwards. */
+void freeze_bsequence(ByteSequence *seq);
+/** Returns the source line of the byte at `offset`. */
+int get_line(ByteSequence *seq, int offset);
 int add_const(ByteSequence *seq, Value val);
+int instr_size(ByteSequence *seq, int offset);
+/**
+ * Returns the offset the instruction at `offset` jumps back to if it is a
+ * loop back-edge, -1 otherwise.
+ */
+int back_edge_target(ByteSequence *seq, int offset);
+/**
+ * Returns the offset the forward jump at `offset` lands on when taken: the
+ * target of OP_JUMP and its conditional forms, or the exit of OP_FOR_PREP.
+ */
+int jump_target(ByteSequence *seq, int offset);
+/**
+ * Stores the offsets control can move to from the instruction at `offset`
+ * in `targets` and returns how many there are. A branch lists its fall
+ * through first; an inline guard lists the inlined body, then the code after
+ * it.
+ */
+int successors(ByteSequence *seq, int offset, int targets[2]);
+/**
+ * Returns the most stack slots a frame running `seq` can use, given the
+ * `base` slots its callee and arguments take.
+ */
+int max_stack_size(ByteSequence *seq, int base);
+int add_prop_cache(ByteSequence *seq);
+int add_invoke_cache(ByteSequence *seq);
+int add_loop_cache(ByteSequence *seq);
+int add_far_jump(ByteSequence *seq, int target);
+void add_handler(ByteSequence *seq, int start, int end, int handler,
+                 int depth);
+/**
+ * Returns the innermost handler whose try block contains the instruction at
+ * `offset`, or NULL if there is none.
+ */
+Handler *find_handler(ByteSequence *seq, int offset);
@@ -5,6 +5,24 @@
 #include <stdint.h>
 
 #define NAN_BOXING
+
+// Threaded dispatch in run() relies on the labels-as-values extension
+#if defined(__GNUC__) && !defined(NO_COMPUTED_GOTO)
+#define COMPUTED_GOTO
+#endif
+
+// The compiler emits register instructions unless the build turns them off
+#ifndef NO_REGISTER_OPS
+#define REGISTER_OPS
+#endif
+
+// The baseline JIT emits x86-64 code for the System V ABI and reads values
+// as NaN-boxed words
+#if defined(ENABLE_JIT) && defined(__x86_64__) && defined(__linux__) && \
+    defined(NAN_BOXING)
+#define JIT
+#endif
+
 #define DEBUG_PRINT_CODE
 
 #define DEBUG_TRACE_EXECUTION
@@ -13,3 +31,4 @@
 // #define DEBUG_LOG_GC
 
 #define UINT8_COUNT (UINT8_MAX + 1)
+#define UINT16_COUNT (UINT16_MAX + 1)
@@ -9,9 +9,12 @@
 #include "bytecode.h"
 #include "common.h"
 #include "memory.h"
+#include "native.h"
 #include "object.h"
+#include "peephole.h"
 #include "scanner.h"
 #include "value.h"
+#include "vm.h"
 
 #ifdef DEBUG_PRINT_CODE
 #include "debug.h"
@@ -50,13 +53,33 @@ typedef struct {
   Token name;
   int depth;
   bool is_captured;
+  bool is_assigned;   // stored to after its declaration
+  bool escapes;       // read other than to be called, or called in a tail call
+  int captures;       // latest of its captures in capture_sites, -1 if none
+  int closure_sites;  // first capture site of the function it declares
 } Local;
 
 typedef struct {
-  uint8_t index;
+  uint16_t index;
   bool is_local;
+  bool is_passed;  // captured in turn by a nested function
 } Upvalue;
 
+/**
+ * The flags byte of a closure capturing a local. Once the local goes out of
+ * scope without having been assigned, its captures are marked to copy it.
+ * An assigned one is still reached without an upvalue of its own by
+ * closures that stay in their frame: those a local function declaration
+ * stores in `holder` and that are only ever called from there.
+ */
+typedef struct {
+  int offset;
+  uint16_t slot;
+  int next;       // earlier capture of the same local, -1 if none
+  int holder;     // slot of the declared function holding the closure, or -1
+  bool in_frame;  // the holder turned out to keep the closure in the frame
+} CaptureSite;
+
 typedef enum {
   TYPE_FUNCTION,
   TYPE_INITIALIZER,
@@ -64,15 +87,44 @@ typedef enum {
   TYPE_SCRIPT
 } FunctionType;
 
+/**
+ * Open-addressed hash index from string and number constants to their
+ * lowest index in the pool, so each value is stored once per function.
+ */
+typedef struct {
+  int cnt;
+  int capacity;  // a power of two
+  int* slots;    // constant indexes, -1 if free
+} ConstIndex;
+
 typedef struct Compiler {
   struct Compiler* enclosing;
   ObjFunction* function;
   FunctionType type;
 
-  Local locals[UINT8_COUNT];
+  Local* locals;  // grown on demand, up to UINT16_COUNT
   int local_cnt;
-  Upvalue upvalues[UINT8_COUNT];
+  int local_capacity;
+  Upvalue* upvalues;  // function->upvalue_cnt of them
+  int upvalue_capacity;
+  CaptureSite* capture_sites;
+  int capture_cnt;
+  int capture_capacity;
   int scope_depth;
+  int last_call;    // offset of the latest call or invoke, -1 if none
+  int last_callee;  // slot of the local that call called, -1 if none
+  int callee;       // slot of a local just read to be called, -1 if none
+  int last_global;  // offset of the latest OP_GET_GLOBAL, -1 if none
+  int last_local;   // offset of the latest OP_GET/SET_LOCAL, -1 if none
+                    // (it may since have been fused into a longer form)
+  int jump_target;  // latest offset a jump lands on, -1 if none
+  int last_const;   // offset of the latest constant push, which may be fused
+                    // into an OP_GET_LOCAL_CONSTANT, -1 if none
+  bool unreachable;  // no jump lands past the latest return or throw
+  int try_depth;    // try blocks around the code being compiled
+  int low_const;    // next constant left for byte operands once literals
+                    // have moved past them, -1 before
+  ConstIndex const_index;
 } Compiler;
 
 typedef struct ClassCompiler {
@@ -149,14 +201,121 @@ static void emit_bytes(uint8_t byte1, uint8_t byte2) {
   emit_byte(byte2);
 }
 
+static void emit_short(uint16_t value) {
+  emit_bytes((uint8_t)((value >> 8) & 0xff), (uint8_t)(value & 0xff));
+}
+
+/** Returns the current offset, which a jump emitted later will land on. */
+static int mark_jump_target(void) {
+  current->unreachable = false;
+  current->jump_target = current_bseq()->size;
+  return current->jump_target;
+}
+
+/**
+ * Returns the offset of the last instruction if named_variable() emitted it
+ * and the next instruction can be fused into it. That is only safe if no
+ * jump lands on the next instruction. Returns -1 otherwise.
+ */
+static int last_fusable(void) {
+  ByteSequence* bseq = current_bseq();
+  int offset = current->last_local;
+  if (offset == -1 || offset + instr_size(bseq, offset) != bseq->size ||
+      current->jump_target == bseq->size) {
+    return -1;
+  }
+  return offset;
+}
+
+/** Like last_fusable(), but only if the last instruction is `op`. */
+static int fusable_local(uint8_t op) {
+  int offset = last_fusable();
+  if (offset == -1 || current_bseq()->code[offset] != op) {
+    return -1;
+  }
+  return offset;
+}
+
+static void emit_pop(void) {
+  ByteSequence* bseq = current_bseq();
+  int set_local = fusable_local(OP_SET_LOCAL);
+  if (set_local != -1) {
+    bseq->code[set_local] = OP_SET_LOCAL_POP;
+    return;
+  }
+  // The reload after a register instruction stored an assigned value
+  int get_local = fusable_local(OP_GET_LOCAL);
+  if (get_local != -1) {
+    bseq->size = get_local;
+    current->last_local = -1;
+    return;
+  }
+  emit_byte(OP_POP);
+}
+
+/**
+ * Returns the register instruction that computes the stack instruction `op`
+ * from two slots, or from a slot and a constant. Returns `op` itself if there
+ * is none.
+ */
+static uint8_t register_op(uint8_t op, bool constant) {
+  switch (op) {
+    case OP_ADD:
+      return constant ? OP_ADD_RK : OP_ADD_RR;
+    case OP_SUBTRACT:
+      return constant ? OP_SUBTRACT_RK : OP_SUBTRACT_RR;
+    case OP_MULTIPLY:
+      return constant ? OP_MULTIPLY_RK : OP_MULTIPLY_RR;
+    case OP_DIVIDE:
+      return constant ? OP_DIVIDE_RK : OP_DIVIDE_RR;
+    case OP_LESS:
+      return constant ? OP_LESS_RK : OP_LESS_RR;
+    case OP_GREATER:
+      return constant ? OP_GREATER_RK : OP_GREATER_RR;
+    default:
+      return op;
+  }
+}
+
+/**
+ * Emits the arithmetic or comparison `op`. With register instructions
+ * enabled, an OP_GET_LOCAL_LOCAL or OP_GET_LOCAL_CONSTANT right before it is
+ * turned into a register instruction that pushes the result instead.
+ */
+static void emit_arith(uint8_t op) {
+  ByteSequence* bseq = current_bseq();
+  int operands = last_fusable();
+  if (!vm.register_ops || operands == -1 ||
+      (bseq->code[operands] != OP_GET_LOCAL_LOCAL &&
+       bseq->code[operands] != OP_GET_LOCAL_CONSTANT)) {
+    emit_byte(op);
+    return;
+  }
+  bool constant = bseq->code[operands] == OP_GET_LOCAL_CONSTANT;
+  emit_byte(bseq->code[operands + 2]);
+  bseq->code[operands + 2] = bseq->code[operands + 1];
+  bseq->code[operands + 1] = REG_PUSH;
+  bseq->code[operands] = register_op(op, constant);
+}
+
 static void emit_loop(int loopStart) {
-  emit_byte(OP_LOOP);
-  int offset = current_bseq()->size - loopStart + 2;
+  ByteSequence* bseq = current_bseq();
+  int offset = bseq->size - loopStart + 5;
   if (offset > UINT16_MAX) {
-    error("Loop body too large");
+    emit_byte(OP_LOOP_FAR);
+    offset = add_far_jump(bseq, loopStart);
+    if (offset > UINT16_MAX) {
+      error("Too many long jumps in one byte sequence");
+    }
+  } else {
+    emit_byte(OP_LOOP);
   }
-  emit_byte((offset >> 8) & 0xff);
-  emit_byte(offset & 0xff);
+  emit_short((uint16_t)offset);
+  int cache = add_loop_cache(current_bseq());
+  if (cache > UINT16_MAX) {
+    error("Too many loops in one byte sequence");
+  }
+  emit_bytes((uint8_t)((cache >> 8) & 0xff), (uint8_t)(cache & 0xff));
 }
 
 static int emit_jump(uint8_t instruction) {
@@ -175,34 +334,448 @@ static void emit_return(void) {
   emit_byte(OP_RETURN);
 }
 
+// Byte operands reach the first UINT8_COUNT constants, OP_CONSTANT_LONG all
+// of them. Once literals have taken LOW_LITERALS of the byte range, the rest
+// of it is kept for names and functions, and later literals go after it.
+#define LOW_LITERALS 192
+#define CONSTANTS_MAX (1 << 24)
+
+#define CONST_INDEX_MAX_LOAD 0.75
+
+static uint32_t hash_constant(Value val) {
+  if (IS_STR(val)) {
+    return AS_STR(val)->hash;
+  }
+  double number = AS_NUMBER(val);
+  uint64_t bits;
+  memcpy(&bits, &number, sizeof(bits));
+  return (uint32_t)(bits ^ (bits >> 32)) * 2654435761U;
+}
+
+/**
+ * Strings are interned, so they match by identity. Numbers match by their
+ * bits, which keeps -0 apart from 0.
+ */
+static bool same_constant(Value a, Value b) {
+  if (IS_NUMBER(a) && IS_NUMBER(b)) {
+    double x = AS_NUMBER(a);
+    double y = AS_NUMBER(b);
+    return memcmp(&x, &y, sizeof(x)) == 0;
+  }
+  return IS_STR(a) && IS_STR(b) && AS_STR(a) == AS_STR(b);
+}
+
+/** Returns the slot holding `val`, or the free one where it would go. */
+static int* find_const_slot(int* slots, int capacity, Value val) {
+  ValueArray* consts = &current_bseq()->consts;
+  uint32_t i = hash_constant(val) & (uint32_t)(capacity - 1);
+  for (;;) {
+    int* slot = &slots[i];
+    if (*slot == -1 || same_constant(consts->vals[*slot], val)) {
+      return slot;
+    }
+    i = (i + 1) & (uint32_t)(capacity - 1);
+  }
+}
+
+/** Returns the lowest index `val` already has in the pool, -1 if none. */
+static int find_constant(Value val) {
+  ConstIndex* index = &current->const_index;
+  if (index->cnt == 0 || !(IS_STR(val) || IS_NUMBER(val))) {
+    return -1;
+  }
+  return *find_const_slot(index->slots, index->capacity, val);
+}
+
+static void index_constant(Value val, int constant) {
+  if (!(IS_STR(val) || IS_NUMBER(val))) {
+    return;
+  }
+  ConstIndex* index = &current->const_index;
+  if (index->cnt + 1 > index->capacity * CONST_INDEX_MAX_LOAD) {
+    int capacity = GROW_CAPACITY(index->capacity);
+    int* slots = ALLOCATE(int, (size_t)capacity);
+    for (int i = 0; i < capacity; i++) {
+      slots[i] = -1;
+    }
+    ValueArray* consts = &current_bseq()->consts;
+    for (int i = 0; i < index->capacity; i++) {
+      if (index->slots[i] != -1) {
+        Value key = consts->vals[index->slots[i]];
+        *find_const_slot(slots, capacity, key) = index->slots[i];
+      }
+    }
+    FREE_ARR(int, index->slots, (size_t)index->capacity);
+    index->slots = slots;
+    index->capacity = capacity;
+  }
+  int* slot = find_const_slot(index->slots, index->capacity, val);
+  if (*slot == -1) {
+    index->cnt++;
+    *slot = constant;
+  } else if (constant < *slot) {
+    *slot = constant;
+  }
+}
+
+/** Adds `val` as a constant that a byte operand refers to. */
 static uint8_t make_constant(Value val) {
-  int constant = add_const(current_bseq(), val);
+  int found = find_constant(val);
+  if (found != -1 && found <= UINT8_MAX) {
+    return (uint8_t)found;
+  }
+  ByteSequence* bseq = current_bseq();
+  int constant = current->low_const;
+  if (constant == -1) {
+    constant = add_const(bseq, val);
+  } else if (constant < UINT8_COUNT) {
+    bseq->consts.vals[current->low_const++] = val;
+  }
   if (constant > UINT8_MAX) {
     error("Too many constants in one byte sequence");
     return 0;
   }
+  index_constant(val, constant);
   return (uint8_t)constant;
 }
 
+/** Adds `val` as a constant that only OP_CONSTANT and long operands load. */
+static int make_literal(Value val) {
+  int found = find_constant(val);
+  if (found != -1) {
+    return found;
+  }
+  ByteSequence* bseq = current_bseq();
+  if (current->low_const == -1 && bseq->consts.size >= LOW_LITERALS) {
+    current->low_const = bseq->consts.size;
+    while (bseq->consts.size < UINT8_COUNT) {
+      add_const(bseq, NIL_VAL);
+    }
+  }
+  int constant = add_const(bseq, val);
+  if (constant >= CONSTANTS_MAX) {
+    error("Too many constants in one byte sequence");
+    return 0;
+  }
+  index_constant(val, constant);
+  return constant;
+}
+
+/** Returns how many more constants byte operands can refer to. */
+static int byte_constants_left(void) {
+  int used = current->low_const != -1 ? current->low_const
+                                      : current_bseq()->consts.size;
+  return used < UINT8_COUNT ? UINT8_COUNT - used : 0;
+}
+
+static void emit_prop_cache(void) {
+  int cache = add_prop_cache(current_bseq());
+  if (cache > UINT16_MAX) {
+    error("Too many property accesses in one byte sequence");
+  }
+  emit_bytes((uint8_t)((cache >> 8) & 0xff), (uint8_t)(cache & 0xff));
+}
+
+static void emit_invoke_cache(void) {
+  int cache = add_invoke_cache(current_bseq());
+  if (cache > UINT16_MAX) {
+    error("Too many method calls in one byte sequence");
+  }
+  emit_bytes((uint8_t)((cache >> 8) & 0xff), (uint8_t)(cache & 0xff));
+}
+
 static void emit_constant(Value val) {
-  emit_bytes(OP_CONSTANT, make_constant(val));
+  int constant = make_literal(val);
+  current->last_const = current_bseq()->size;
+  if (constant > UINT8_MAX) {
+    emit_bytes(OP_CONSTANT_LONG, (uint8_t)((constant >> 16) & 0xff));
+    emit_short((uint16_t)constant);
+    return;
+  }
+  int get_local = fusable_local(OP_GET_LOCAL);
+  if (get_local != -1) {
+    current_bseq()->code[get_local] = OP_GET_LOCAL_CONSTANT;
+    current->last_const = get_local;
+    emit_byte((uint8_t)constant);
+    return;
+  }
+  emit_bytes(OP_CONSTANT, (uint8_t)constant);
 }
 
-static void patch_jump(int offset) {
-  int jump = current_bseq()->size - offset - 2;
+/** Emits the instruction that pushes `value`. */
+static void emit_value(Value value) {
+  if (IS_NIL(value)) {
+    current->last_const = current_bseq()->size;
+    emit_byte(OP_NIL);
+  } else if (IS_BOOL(value)) {
+    current->last_const = current_bseq()->size;
+    emit_byte(AS_BOOL(value) ? OP_TRUE : OP_FALSE);
+  } else {
+    emit_constant(value);
+  }
+}
+
+static bool is_falsey(Value value) {
+  return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+/**
+ * Optimizations. With vm.opt_level above 0, the compiler folds operators
+ * whose operands are constants, and drops code that can't run: branches
+ * behind a constant condition, expression statements that only push a
+ * constant and statements after a return or throw. It works on the code
+ * just emitted, which it truncates and re-emits, so it needs no tree.
+ */
+
+/**
+ * Returns the offset where the push of a constant that ends the code so far
+ * starts, and stores the constant in `value`. That is after the slot of an
+ * OP_GET_LOCAL_CONSTANT the push was fused into. Returns -1 if the code
+ * doesn't end in such a push, or a jump lands after its start.
+ */
+static int trailing_constant(Value* value) {
+  ByteSequence* bseq = current_bseq();
+  int offset = current->last_const;
+  if (vm.opt_level == 0 || offset == -1 ||
+      offset + instr_size(bseq, offset) != bseq->size) {
+    return -1;
+  }
+  uint8_t* ip = &bseq->code[offset];
+  int start = offset;
+  switch (*ip) {
+    case OP_NIL:
+      *value = NIL_VAL;
+      break;
+    case OP_TRUE:
+      *value = BOOL_VAL(true);
+      break;
+    case OP_FALSE:
+      *value = BOOL_VAL(false);
+      break;
+    case OP_CONSTANT:
+      *value = bseq->consts.vals[ip[1]];
+      break;
+    case OP_CONSTANT_LONG:
+      *value = bseq->consts.vals[(ip[1] << 16) | (ip[2] << 8) | ip[3]];
+      break;
+    case OP_GET_LOCAL_CONSTANT:
+      *value = bseq->consts.vals[ip[2]];
+      start = offset + 2;
+      break;
+    default:
+      return -1;
+  }
+  return current->jump_target > start ? -1 : start;
+}
+
+/**
+ * Removes the trailing constant push that trailing_constant() found at
+ * `start`, with `push` the offset current->last_const had then.
+ */
+static void remove_constant(int push, int start) {
+  if (push < start) {
+    current_bseq()->code[push] = OP_GET_LOCAL;
+  }
+  current_bseq()->size = start;
+  current->last_const = -1;
+}
+
+/** Emission state to go back to once the code after it turns out dead. */
+typedef struct {
+  int size;
+  int handler_cnt;
+  int capture_cnt;
+  int last_call;
+  int last_callee;
+  int last_global;
+  int last_local;
+  int last_const;
+  int jump_target;
+  bool unreachable;
+} CodeMark;
+
+static CodeMark mark_code(void) {
+  CodeMark mark;
+  mark.size = current_bseq()->size;
+  mark.handler_cnt = current_bseq()->handler_cnt;
+  mark.capture_cnt = current->capture_cnt;
+  mark.last_call = current->last_call;
+  mark.last_callee = current->last_callee;
+  mark.last_global = current->last_global;
+  mark.last_local = current->last_local;
+  mark.last_const = current->last_const;
+  mark.jump_target = current->jump_target;
+  mark.unreachable = current->unreachable;
+  return mark;
+}
+
+/**
+ * Drops the code emitted since `mark`. Constants and caches it added stay
+ * unused, but handlers and capture sites have to go: their offsets would
+ * point into later code.
+ */
+static void discard_code(CodeMark* mark) {
+  current_bseq()->size = mark->size;
+  current_bseq()->handler_cnt = mark->handler_cnt;
+  while (current->capture_cnt > mark->capture_cnt) {
+    CaptureSite* site = &current->capture_sites[--current->capture_cnt];
+    if (site->slot < current->local_cnt &&
+        current->locals[site->slot].captures == current->capture_cnt) {
+      current->locals[site->slot].captures = site->next;
+    }
+  }
+  current->last_call = mark->last_call;
+  current->last_callee = mark->last_callee;
+  current->last_global = mark->last_global;
+  current->last_local = mark->last_local;
+  current->last_const = mark->last_const;
+  current->jump_target = mark->jump_target;
+  current->unreachable = mark->unreachable;
+}
+
+/**
+ * Computes `a op b` into `result` the way the VM would. Returns false if
+ * that isn't certain to succeed, leaving the error to run time.
+ */
+static bool fold_binary(TokenType op, Value a, Value b, Value* result) {
+  switch (op) {
+    case TOKEN_BANG_EQUAL:
+      *result = BOOL_VAL(!are_equal(a, b));
+      return true;
+    case TOKEN_EQUAL_EQUAL:
+      *result = BOOL_VAL(are_equal(a, b));
+      return true;
+    default:
+      break;
+  }
+  if (!IS_NUMBER(a) || !IS_NUMBER(b)) {
+    return false;
+  }
+  double x = AS_NUMBER(a);
+  double y = AS_NUMBER(b);
+  switch (op) {
+    // `>=` and `<=` run as the negated opposite, which differs for NaN
+    case TOKEN_GREATER:
+      *result = BOOL_VAL(x > y);
+      return true;
+    case TOKEN_GREATER_EQUAL:
+      *result = BOOL_VAL(!(x < y));
+      return true;
+    case TOKEN_LESS:
+      *result = BOOL_VAL(x < y);
+      return true;
+    case TOKEN_LESS_EQUAL:
+      *result = BOOL_VAL(!(x > y));
+      return true;
+    case TOKEN_PLUS:
+      *result = NUMBER_VAL(x + y);
+      return true;
+    case TOKEN_MINUS:
+      *result = NUMBER_VAL(x - y);
+      return true;
+    case TOKEN_STAR:
+      *result = NUMBER_VAL(x * y);
+      return true;
+    case TOKEN_SLASH:
+      *result = NUMBER_VAL(x / y);
+      return true;
+    default:
+      return false;
+  }
+}
+
+/** Returns the form of the jump `op` that goes through the far jump table. */
+static uint8_t far_jump_op(uint8_t op) {
+  switch (op) {
+    case OP_JUMP:
+      return OP_JUMP_FAR;
+    case OP_JUMP_IF_FALSE:
+      return OP_JUMP_IF_FALSE_FAR;
+    case OP_JUMP_IF_FALSE_POP:
+      return OP_JUMP_IF_FALSE_POP_FAR;
+    default:
+      return op;
+  }
+}
+
+/**
+ * Stores the distance from `from` to the current offset in the 16-bit jump
+ * operand at `offset`. Returns false if it doesn't fit.
+ */
+static bool set_jump_operand(int offset, int from) {
+  int jump = current_bseq()->size - from;
   if (jump > UINT16_MAX) {
-    error("Too much code to jump over");
+    return false;
   }
   current_bseq()->code[offset] = (jump >> 8) & 0xff;
   current_bseq()->code[offset + 1] = jump & 0xff;
+  return true;
+}
+
+/** Adds the current offset to the far jump table and returns its index. */
+static uint16_t far_jump_here(void) {
+  int index = add_far_jump(current_bseq(), current_bseq()->size);
+  if (index > UINT16_MAX) {
+    error("Too many long jumps in one byte sequence");
+  }
+  return (uint16_t)index;
+}
+
+/**
+ * Points the jump emitted by emit_jump() at the current offset. A jump too
+ * long for its operand is switched to its far form.
+ */
+static void patch_jump(int offset) {
+  if (!set_jump_operand(offset, offset + 2)) {
+    uint8_t* op = &current_bseq()->code[offset - 1];
+    if (far_jump_op(*op) == *op) {
+      error("Too much code to jump over");
+    }
+    *op = far_jump_op(*op);
+    uint16_t index = far_jump_here();
+    current_bseq()->code[offset] = (uint8_t)((index >> 8) & 0xff);
+    current_bseq()->code[offset + 1] = (uint8_t)(index & 0xff);
+  }
+  mark_jump_target();
+}
+
+/** Adds a slot for a local to the current function and returns it. */
+static Local* push_local(void) {
+  if (current->local_capacity < current->local_cnt + 1) {
+    int capacity = current->local_capacity;
+    current->local_capacity = GROW_CAPACITY(capacity);
+    current->locals = GROW_ARR(Local, current->locals, (size_t)capacity,
+                               (size_t)current->local_capacity);
+  }
+  return &current->locals[current->local_cnt++];
 }
 
 static void init_compiler(Compiler* compiler, FunctionType type) {
   compiler->enclosing = current;
   compiler->function = NULL;
   compiler->type = type;
+  compiler->locals = NULL;
   compiler->local_cnt = 0;
+  compiler->local_capacity = 0;
+  compiler->upvalues = NULL;
+  compiler->upvalue_capacity = 0;
+  compiler->capture_sites = NULL;
+  compiler->capture_cnt = 0;
+  compiler->capture_capacity = 0;
   compiler->scope_depth = 0;
+  compiler->last_call = -1;
+  compiler->last_callee = -1;
+  compiler->callee = -1;
+  compiler->last_global = -1;
+  compiler->last_local = -1;
+  compiler->jump_target = -1;
+  compiler->last_const = -1;
+  compiler->unreachable = false;
+  compiler->try_depth = 0;
+  compiler->low_const = -1;
+  compiler->const_index.cnt = 0;
+  compiler->const_index.capacity = 0;
+  compiler->const_index.slots = NULL;
   compiler->function = new_function();
   current = compiler;
   if (type != TYPE_SCRIPT) {
@@ -210,9 +783,13 @@ static void init_compiler(Compiler* compiler, FunctionType type) {
         copy_str(parser.previous.start, parser.previous.length);
   }
 
-  Local* local = &current->locals[current->local_cnt++];
+  Local* local = push_local();
   local->depth = 0;
   local->is_captured = false;
+  local->is_assigned = false;
+  local->escapes = false;
+  local->captures = -1;
+  local->closure_sites = -1;
   if (type != TYPE_FUNCTION) {
     local->name.start = "this";
     local->name.length = 4;
@@ -222,11 +799,72 @@ static void init_compiler(Compiler* compiler, FunctionType type) {
   }
 }
 
+/** Records that the flags byte at `offset` captures the local in `slot`. */
+static void add_capture_site(int offset, uint16_t slot, int holder) {
+  if (current->capture_capacity < current->capture_cnt + 1) {
+    int capacity = current->capture_capacity;
+    current->capture_capacity = GROW_CAPACITY(capacity);
+    current->capture_sites =
+        GROW_ARR(CaptureSite, current->capture_sites, (size_t)capacity,
+                 (size_t)current->capture_capacity);
+  }
+  CaptureSite* site = &current->capture_sites[current->capture_cnt];
+  site->offset = offset;
+  site->slot = slot;
+  site->holder = holder;
+  site->in_frame = false;
+  site->next = current->locals[slot].captures;
+  current->locals[slot].captures = current->capture_cnt++;
+}
+
+/**
+ * Settles how closures hold `local` as it goes out of scope: by value if
+ * nothing assigned it, since no one can tell the copy apart, and through
+ * the frame for closures that stay in it. Those are retired first, as they
+ * were declared later. Returns whether some closure holds it by reference,
+ * leaving an open upvalue to close.
+ */
+static bool retire_local(Local* local) {
+  int slot = (int)(local - current->locals);
+  if (local->closure_sites != -1 && !local->escapes && !local->is_captured) {
+    for (int i = local->closure_sites; i < current->capture_cnt; i++) {
+      if (current->capture_sites[i].holder == slot) {
+        current->capture_sites[i].in_frame = true;
+      }
+    }
+  }
+  if (!local->is_captured) {
+    return false;
+  }
+  bool by_reference = false;
+  for (int i = local->captures; i != -1; i = current->capture_sites[i].next) {
+    CaptureSite* site = &current->capture_sites[i];
+    if (!local->is_assigned) {
+      current_bseq()->code[site->offset] |= CAPTURE_VALUE;
+    } else if (site->in_frame) {
+      current_bseq()->code[site->offset] |= CAPTURE_FRAME;
+    } else {
+      by_reference = true;
+    }
+  }
+  return by_reference;
+}
+
 static ObjFunction* end_compiler(void) {
   emit_return();
+  for (int i = current->local_cnt - 1; i >= 0; i--) {
+    retire_local(&current->locals[i]);
+  }
   ObjFunction* function = current->function;
-#ifdef DEBUG_PRINT_CODE
   if (!parser.had_err) {
+    if (vm.opt_level > 0) {
+      optimize_bsequence(current_bseq());
+    }
+    function->stack_size = max_stack_size(current_bseq(), function->arity + 1);
+  }
+  freeze_bsequence(current_bseq());
+#ifdef DEBUG_PRINT_CODE
+  if (!parser.had_err && vm.debug_output) {
     disassemble_bseq(current_bseq(), function->name != NULL
                                          ? function->name->chars
                                          : "<script>");
@@ -237,12 +875,21 @@ static ObjFunction* end_compiler(void) {
   return function;
 }
 
+static void free_compiler(Compiler* compiler) {
+  FREE_ARR(Local, compiler->locals, (size_t)compiler->local_capacity);
+  FREE_ARR(Upvalue, compiler->upvalues, (size_t)compiler->upvalue_capacity);
+  FREE_ARR(CaptureSite, compiler->capture_sites,
+           (size_t)compiler->capture_capacity);
+  FREE_ARR(int, compiler->const_index.slots,
+           (size_t)compiler->const_index.capacity);
+}
+
 static void begin_scope(void) { current->scope_depth++; }
 static void end_scope(void) {
   current->scope_depth--;
   while (current->local_cnt > 0 &&
          current->locals[current->local_cnt - 1].depth > current->scope_depth) {
-    if (current->locals[current->local_cnt - 1].is_captured) {
+    if (retire_local(&current->locals[current->local_cnt - 1])) {
       emit_byte(OP_CLOSE_UPVALUE);
     } else {
       emit_byte(OP_POP);
@@ -261,8 +908,20 @@ static void binary(bool can_assign) {
   (void)can_assign;
   TokenType op_type = parser.previous.type;
   ParseRule* rule = get_rule(op_type);
+  Value left;
+  int left_start = trailing_constant(&left);
+  int left_push = current->last_const;
+  int right_start = current_bseq()->size;
   parse_precedence((Precedence)(rule->precedence + 1));
 
+  Value right;
+  Value result;
+  if (left_start != -1 && trailing_constant(&right) == right_start &&
+      fold_binary(op_type, left, right, &result)) {
+    remove_constant(left_push, left_start);
+    emit_value(result);
+    return;
+  }
   switch (op_type) {
     case TOKEN_BANG_EQUAL:
       emit_bytes(OP_EQUAL, OP_NOT);
@@ -271,28 +930,30 @@ static void binary(bool can_assign) {
       emit_byte(OP_EQUAL);
       break;
     case TOKEN_GREATER:
-      emit_byte(OP_GREATER);
+      emit_arith(OP_GREATER);
       break;
     case TOKEN_GREATER_EQUAL:
-      emit_bytes(OP_LESS, OP_NOT);
+      emit_arith(OP_LESS);
+      emit_byte(OP_NOT);
       break;
     case TOKEN_LESS:
-      emit_byte(OP_LESS);
+      emit_arith(OP_LESS);
       break;
     case TOKEN_LESS_EQUAL:
-      emit_bytes(OP_GREATER, OP_NOT);
+      emit_arith(OP_GREATER);
+      emit_byte(OP_NOT);
       break;
     case TOKEN_PLUS:
-      emit_byte(OP_ADD);
+      emit_arith(OP_ADD);
       break;
     case TOKEN_MINUS:
-      emit_byte(OP_SUBTRACT);
+      emit_arith(OP_SUBTRACT);
       break;
     case TOKEN_STAR:
-      emit_byte(OP_MULTIPLY);
+      emit_arith(OP_MULTIPLY);
       break;
     case TOKEN_SLASH:
-      emit_byte(OP_DIVIDE);
+      emit_arith(OP_DIVIDE);
       break;
     default:
       return;
@@ -314,28 +975,305 @@ static uint8_t argument_list(void) {
   return arg_count;
 }
 
-static uint8_t identifier_constant(Token* name) {
-  return make_constant(OBJ_VAL(copy_str(name->start, name->length)));
+/**
+ * Adds the name `name` as a constant, in the byte range while it has room.
+ * Past it, the name needs the _LONG form of its instruction.
+ */
+static int identifier_constant(Token* name) {
+  Value val = OBJ_VAL(copy_str(name->start, name->length));
+  return byte_constants_left() > 0 ? make_constant(val) : make_literal(val);
+}
+
+/** Emits `op` with the name constant `name`, or `long_op` if it's wide. */
+static void emit_name_op(uint8_t op, uint8_t long_op, int name) {
+  if (name > UINT8_MAX) {
+    emit_bytes(long_op, (uint8_t)((name >> 16) & 0xff));
+    emit_short((uint16_t)name);
+  } else {
+    emit_bytes(op, (uint8_t)name);
+  }
+}
+
+static uint16_t global_variable(Token* name) {
+  int slot = global_slot(copy_str(name->start, name->length));
+  if (slot > UINT16_MAX) {
+    error("Too many global variables");
+    return 0;
+  }
+  return (uint16_t)slot;
+}
+
+// Longest function body, in bytes, that calls get a copy of
+#define INLINE_MAX_BYTES 48
+
+/**
+ * Returns how many bytes of `func`'s code an inlined copy takes, or -1 if it
+ * can't be inlined. The body has to be short, return only at its end, and
+ * must neither loop, create closures nor call `name`, the name it is called
+ * by. A `return nil` left after a final return statement is dropped.
+ */
+static int inline_size(ObjFunction* func, ObjStr* name) {
+  ByteSequence* bseq = &func->bseq;
+  if (func->upvalue_cnt > 0 || bseq->handler_cnt > 0 ||
+      bseq->size > INLINE_MAX_BYTES + 2) {
+    return -1;
+  }
+  int returns = 0;
+  int last_return = -1;
+  bool return_before_tail = false;
+  bool jump_to_tail = false;
+  for (int offset = 0; offset < bseq->size;
+       offset += instr_size(bseq, offset)) {
+    uint8_t* ip = &bseq->code[offset];
+    switch (*ip) {
+      case OP_RETURN:
+        returns++;
+        last_return = offset;
+        return_before_tail |= offset == bseq->size - 3;
+        break;
+      case OP_JUMP:
+      case OP_JUMP_IF_FALSE:
+      case OP_JUMP_IF_FALSE_POP:
+      case OP_JUMP_IF_TRUE_POP:
+        jump_to_tail |= offset + 3 + ((ip[1] << 8) | ip[2]) == bseq->size - 2;
+        break;
+      case OP_GET_GLOBAL:
+        if (AS_STR(vm.global_names.vals[(ip[1] << 8) | ip[2]]) == name) {
+          return -1;
+        }
+        break;
+      case OP_INVOKE:
+      case OP_TAIL_INVOKE:
+        if (AS_STR(bseq->consts.vals[ip[1]]) == name) {
+          return -1;
+        }
+        break;
+      case OP_LOOP:
+      case OP_FOR_PREP:
+      case OP_FOR_LOOP:
+      case OP_CONSTANT_LONG:
+      case OP_GET_LOCAL_LONG:
+      case OP_SET_LOCAL_LONG:
+      case OP_JUMP_FAR:
+      case OP_JUMP_IF_FALSE_FAR:
+      case OP_JUMP_IF_FALSE_POP_FAR:
+      case OP_INLINE_CALL:
+      case OP_INLINE_INVOKE:
+      case OP_CLOSURE:
+      case OP_CLOSURE_LONG:
+      case OP_CLASS:
+      case OP_GET_PROPERTY_LONG:
+      case OP_SET_PROPERTY_LONG:
+      case OP_GET_SUPER_LONG:
+      case OP_INVOKE_LONG:
+      case OP_SUPER_INVOKE_LONG:
+      case OP_TAIL_INVOKE_LONG:
+      case OP_TAIL_SUPER_INVOKE_LONG:
+      case OP_CLASS_LONG:
+      case OP_METHOD_LONG:
+        return -1;
+      default:
+        break;
+    }
+  }
+  // The OP_NIL OP_RETURN every body ends in is dead after a return statement,
+  // unless the peephole pass already dropped it
+  int size = bseq->size;
+  if (returns == 2 && return_before_tail && !jump_to_tail) {
+    size -= 2;
+    returns--;
+    last_return = size - 1;
+  }
+  return returns == 1 && last_return == size - 1 && size <= INLINE_MAX_BYTES
+             ? size
+             : -1;
+}
+
+/**
+ * Returns whether `candidate`, the function a call by `name` with `arg_cnt`
+ * arguments expects, can be inlined into the current function. If so, sets
+ * `func` to it and `size` to the bytes of it to copy.
+ */
+static bool can_inline(Value candidate, ObjStr* name, int arg_cnt,
+                       ObjFunction** func, int* size) {
+  if (!IS_OBJ(candidate)) {
+    return false;
+  }
+  *func = AS_FUNCTION(candidate);
+  *size = inline_size(*func, name);
+  return *size != -1 && (*func)->arity == arg_cnt &&
+         (*func)->bseq.consts.size < byte_constants_left();
+}
+
+/** Returns the index of `func`'s constant `index` in the current function. */
+static uint8_t inline_constant(ObjFunction* func, uint8_t index,
+                               int* constants) {
+  if (constants[index] == -1) {
+    constants[index] = make_constant(func->bseq.consts.vals[index]);
+  }
+  return (uint8_t)constants[index];
+}
+
+static void set_cache_operand(uint8_t* operand, int cache) {
+  operand[0] = (uint8_t)((cache >> 8) & 0xff);
+  operand[1] = (uint8_t)(cache & 0xff);
+}
+
+/**
+ * Emits the skip operand of the inline guard just emitted, followed by a
+ * copy of the first `size` bytes of `func`'s code. The copy gets its own
+ * constants and caches, and ends in OP_INLINE_RETURN.
+ */
+static void emit_inlined_body(ObjFunction* func, int size) {
+  emit_short(UINT16_MAX);
+  ByteSequence* bseq = current_bseq();
+  int skip = bseq->size - 2;
+  int start = bseq->size;
+  for (int i = 0; i < size; i++) {
+    write_bsequence(bseq, func->bseq.code[i], get_line(&func->bseq, i));
+  }
+
+  int constants[UINT8_COUNT];
+  for (int i = 0; i < UINT8_COUNT; i++) {
+    constants[i] = -1;
+  }
+  for (int offset = 0; offset < size;
+       offset += instr_size(&func->bseq, offset)) {
+    uint8_t* ip = &bseq->code[start + offset];
+    switch (*ip) {
+      case OP_CONSTANT:
+        ip[1] = inline_constant(func, ip[1], constants);
+        break;
+      case OP_GET_LOCAL_CONSTANT:
+        ip[2] = inline_constant(func, ip[2], constants);
+        break;
+      case OP_ADD_RK:
+      case OP_SUBTRACT_RK:
+      case OP_MULTIPLY_RK:
+      case OP_DIVIDE_RK:
+      case OP_LESS_RK:
+      case OP_GREATER_RK:
+        ip[3] = inline_constant(func, ip[3], constants);
+        break;
+      case OP_GET_PROPERTY:
+      case OP_SET_PROPERTY:
+      case OP_GET_FIELD:
+      case OP_SET_FIELD:
+        ip[1] = inline_constant(func, ip[1], constants);
+        set_cache_operand(&ip[2], add_prop_cache(bseq));
+        break;
+      case OP_GET_LOCAL_PROPERTY:
+      case OP_GET_LOCAL_FIELD:
+        ip[2] = inline_constant(func, ip[2], constants);
+        set_cache_operand(&ip[3], add_prop_cache(bseq));
+        break;
+      case OP_INVOKE:
+      case OP_TAIL_INVOKE:
+        *ip = OP_INVOKE;
+        ip[1] = inline_constant(func, ip[1], constants);
+        set_cache_operand(&ip[3], add_invoke_cache(bseq));
+        break;
+      case OP_TAIL_CALL:
+        *ip = OP_CALL;
+        break;
+      case OP_RETURN:
+        *ip = OP_INLINE_RETURN;
+        // A failed guard resumes after it, so errors in the call it makes
+        // report the line of the call
+        bseq->lines[start + offset] = parser.previous.line;
+        break;
+      default:
+        break;
+    }
+  }
+  if (bseq->prop_cache_cnt > UINT16_MAX + 1) {
+    error("Too many property accesses in one byte sequence");
+  }
+  if (bseq->invoke_cache_cnt > UINT16_MAX + 1) {
+    error("Too many method calls in one byte sequence");
+  }
+  patch_jump(skip);
+}
+
+/**
+ * Returns the name of the global the callee just read, or NULL if the
+ * callee is anything else. The name only selects the instruction for the
+ * call: OP_INTRINSIC and the inline guards check at run time that the
+ * global still holds what it did at compile time.
+ */
+static ObjStr* callee_global(void) {
+  ByteSequence* bseq = current_bseq();
+  int get = current->last_global;
+  if (get == -1 || get + 3 != bseq->size) {
+    return NULL;
+  }
+  int slot = (bseq->code[get + 1] << 8) | bseq->code[get + 2];
+  return AS_STR(vm.global_names.vals[slot]);
 }
 
 static void call(bool can_assign) {
+  ObjStr* global = callee_global();
+  int callee = current->callee;
+  current->callee = -1;
   uint8_t arg_count = argument_list();
+  int intrinsic = global != NULL ? find_intrinsic(global) : -1;
+  if (intrinsic != -1 && intrinsics[intrinsic].arity == arg_count) {
+    emit_bytes(OP_INTRINSIC, (uint8_t)intrinsic);
+    return;
+  }
+  Value candidate = NIL_VAL;
+  ObjFunction* func;
+  int size;
+  if (global != NULL &&
+      table_get(&vm.inline_functions, global, &candidate) &&
+      can_inline(candidate, global, arg_count, &func, &size)) {
+    emit_bytes(OP_INLINE_CALL, make_constant(candidate));
+    emit_inlined_body(func, size);
+    return;
+  }
+  current->last_call = current_bseq()->size;
+  current->last_callee = callee;
   emit_bytes(OP_CALL, arg_count);
 }
 
 static void dot(bool can_assign) {
   consume(TOKEN_IDENTIFIER, "Expected property name after '.'");
-  uint8_t name = identifier_constant(&parser.previous);
+  int name = identifier_constant(&parser.previous);
 
   if (can_assign && match(TOKEN_EQUAL)) {
     expression();
-    emit_bytes(OP_SET_PROPERTY, name);
+    emit_name_op(OP_SET_PROPERTY, OP_SET_PROPERTY_LONG, name);
+    emit_prop_cache();
   } else if (match(TOKEN_LEFT_PAREN)) {
     uint8_t arg_cnt = argument_list();
-    emit_bytes(OP_INVOKE, name);
+    ObjStr* method = AS_STR(current_bseq()->consts.vals[name]);
+    Value candidate = NIL_VAL;
+    ObjFunction* func;
+    int size;
+    if (name <= UINT8_MAX &&
+        table_get(&vm.inline_methods, method, &candidate) &&
+        can_inline(candidate, method, arg_cnt, &func, &size)) {
+      emit_bytes(OP_INLINE_INVOKE, (uint8_t)name);
+      emit_invoke_cache();
+      emit_byte(make_constant(candidate));
+      emit_inlined_body(func, size);
+      return;
+    }
+    current->last_call = current_bseq()->size;
+    current->last_callee = -1;
+    emit_name_op(OP_INVOKE, OP_INVOKE_LONG, name);
     emit_byte(arg_cnt);
+    emit_invoke_cache();
   } else {
-    emit_bytes(OP_GET_PROPERTY, name);
+    // `this.x` and the like read a local receiver
+    int get_local = name <= UINT8_MAX ? fusable_local(OP_GET_LOCAL) : -1;
+    if (get_local != -1) {
+      current_bseq()->code[get_local] = OP_GET_LOCAL_PROPERTY;
+      emit_byte((uint8_t)name);
+    } else {
+      emit_name_op(OP_GET_PROPERTY, OP_GET_PROPERTY_LONG, name);
+    }
+    emit_prop_cache();
   }
 }
 
@@ -343,13 +1281,13 @@ static void literal(bool can_assign) {
   (void)can_assign;
   switch (parser.previous.type) {
     case TOKEN_FALSE:
-      emit_byte(OP_FALSE);
+      emit_value(BOOL_VAL(false));
       break;
     case TOKEN_NIL:
-      emit_byte(OP_NIL);
+      emit_value(NIL_VAL);
       break;
     case TOKEN_TRUE:
-      emit_byte(OP_TRUE);
+      emit_value(BOOL_VAL(true));
       break;
     default:
       return;
@@ -397,7 +1335,7 @@ static int resolve_local(Compiler* compiler, Token* name) {
   return -1;
 }
 
-static int add_upvalue(Compiler* compiler, uint8_t index, bool is_local) {
+static int add_upvalue(Compiler* compiler, uint16_t index, bool is_local) {
   int upvalue_cnt = compiler->function->upvalue_cnt;
   for (int i = 0; i < upvalue_cnt; i++) {
     Upvalue* upvalue = &compiler->upvalues[i];
@@ -405,15 +1343,33 @@ static int add_upvalue(Compiler* compiler, uint8_t index, bool is_local) {
       return i;
     }
   }
-  if (upvalue_cnt == UINT8_COUNT) {
+  if (upvalue_cnt == UINT16_COUNT) {
     error("Too many closure variables in a function");
     return 0;
   }
+  if (compiler->upvalue_capacity < upvalue_cnt + 1) {
+    int capacity = compiler->upvalue_capacity;
+    compiler->upvalue_capacity = GROW_CAPACITY(capacity);
+    compiler->upvalues =
+        GROW_ARR(Upvalue, compiler->upvalues, (size_t)capacity,
+                 (size_t)compiler->upvalue_capacity);
+  }
   compiler->upvalues[upvalue_cnt].is_local = is_local;
   compiler->upvalues[upvalue_cnt].index = index;
+  compiler->upvalues[upvalue_cnt].is_passed = false;
   return compiler->function->upvalue_cnt++;
 }
 
+/** Marks the local that upvalue `index` of `compiler` refers to as assigned. */
+static void assign_upvalue(Compiler* compiler, int index) {
+  Upvalue* upvalue = &compiler->upvalues[index];
+  if (upvalue->is_local) {
+    compiler->enclosing->locals[upvalue->index].is_assigned = true;
+  } else {
+    assign_upvalue(compiler->enclosing, upvalue->index);
+  }
+}
+
 static int resolve_upvalue(Compiler* compiler, Token* name) {
   if (compiler->enclosing == NULL) {
     return -1;
@@ -421,24 +1377,29 @@ static int resolve_upvalue(Compiler* compiler, Token* name) {
   int local = resolve_local(compiler->enclosing, name);
   if (local != -1) {
     compiler->enclosing->locals[local].is_captured = true;
-    return add_upvalue(compiler, (uint8_t)local, true);
+    return add_upvalue(compiler, (uint16_t)local, true);
   }
   int upvalue = resolve_upvalue(compiler->enclosing, name);
   if (upvalue != -1) {
-    return add_upvalue(compiler, (uint8_t)upvalue, false);
+    compiler->enclosing->upvalues[upvalue].is_passed = true;
+    return add_upvalue(compiler, (uint16_t)upvalue, false);
   }
   return -1;
 }
 
 static void add_local(Token name) {
-  if (current->local_cnt == UINT8_COUNT) {
+  if (current->local_cnt == UINT16_COUNT) {
     error("Too many local variables in function");
     return;
   }
-  Local* local = &current->locals[current->local_cnt++];
+  Local* local = push_local();
   local->name = name;
   local->depth = -1;
   local->is_captured = false;
+  local->is_assigned = false;
+  local->escapes = false;
+  local->captures = -1;
+  local->closure_sites = -1;
 }
 
 static void declare_variable(void) {
@@ -460,7 +1421,13 @@ static void declare_variable(void) {
   add_local(*name);
 }
 
-static uint8_t parse_variable(const char* errorMessage) {
+/** Looks up a top-level const named `name`. */
+static bool resolve_const(Token* name, Value* value) {
+  ObjStr* str = copy_str(name->start, name->length);
+  return table_get(&vm.global_consts, str, value);
+}
+
+static uint16_t parse_variable(const char* errorMessage) {
   consume(TOKEN_IDENTIFIER, errorMessage);
 
   declare_variable();
@@ -468,7 +1435,14 @@ static uint8_t parse_variable(const char* errorMessage) {
     return 0;
   }
 
-  return identifier_constant(&parser.previous);
+  Value value;
+  if (resolve_const(&parser.previous, &value)) {
+    error("A constant with this name already exists");
+  }
+  uint16_t global = global_variable(&parser.previous);
+  // Calls compiled from now on can't expect the function it held
+  table_delete(&vm.inline_functions, AS_STR(vm.global_names.vals[global]));
+  return global;
 }
 
 static void mark_initialized(void) {
@@ -478,15 +1452,48 @@ static void mark_initialized(void) {
   current->locals[current->local_cnt - 1].depth = current->scope_depth;
 }
 
-static void define_variable(uint8_t global) {
+/** Records that compiled code stores to `global`, so it can't become a const. */
+static void mark_assigned(uint16_t global) {
+  // The name is reachable through vm.global_names while the table grows
+  table_set(&vm.assigned_globals, AS_STR(vm.global_names.vals[global]),
+            BOOL_VAL(true));
+}
+
+static void define_variable(uint16_t global) {
   if (current->scope_depth > 0) {
     mark_initialized();
     return;
   }
-  emit_bytes(OP_DEFINE_GLOBAL, global);
+  mark_assigned(global);
+  emit_byte(OP_DEFINE_GLOBAL);
+  emit_short(global);
+}
+
+/**
+ * Compiles the right operand of `and` or `or` after a constant left one:
+ * as the result if `left` lets it run, else as dead code.
+ */
+static void constant_logical(Value left, int push, int start,
+                             Precedence precedence) {
+  bool right_runs = is_falsey(left) == (precedence == PREC_OR);
+  if (right_runs) {
+    remove_constant(push, start);
+    parse_precedence(precedence);
+  } else {
+    CodeMark mark = mark_code();
+    parse_precedence(precedence);
+    discard_code(&mark);
+  }
 }
 
 static void and_(bool can_assign) {
+  (void)can_assign;
+  Value left;
+  int start = trailing_constant(&left);
+  if (start != -1) {
+    constant_logical(left, current->last_const, start, PREC_AND);
+    return;
+  }
   int endJump = emit_jump(OP_JUMP_IF_FALSE);
   emit_byte(OP_POP);
   parse_precedence(PREC_AND);
@@ -497,12 +1504,23 @@ static void expression(void) { parse_precedence(PREC_ASSIGNMENT); }
 
 static void block(void) {
   while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF)) {
-    declaration();
+    if (current->unreachable && vm.opt_level > 0) {
+      // Still compiled for its errors
+      CodeMark mark = mark_code();
+      declaration();
+      discard_code(&mark);
+    } else {
+      declaration();
+    }
   }
   consume(TOKEN_RIGHT_BRACE, "Expected '}' after block");
 }
 
-static void function(FunctionType type) {
+/**
+ * Compiles a function and emits its closure. The closure's captures of
+ * locals record `holder`, the slot of the local function it declares, or -1.
+ */
+static ObjFunction* function(FunctionType type, int holder) {
   Compiler compiler;
   init_compiler(&compiler, type);
   begin_scope();
@@ -514,7 +1532,7 @@ static void function(FunctionType type) {
       if (current->function->arity > 255) {
         error_at_current("Can't have more than 255 parameters");
       }
-      uint8_t constant = parse_variable("Expected parameter name");
+      uint16_t constant = parse_variable("Expected parameter name");
       define_variable(constant);
     } while (match(TOKEN_COMMA));
   }
@@ -524,23 +1542,54 @@ static void function(FunctionType type) {
   block();
 
   ObjFunction* func = end_compiler();
-  emit_bytes(OP_CLOSURE, make_constant(OBJ_VAL(func)));
+  if (byte_constants_left() > 0) {
+    emit_bytes(OP_CLOSURE, make_constant(OBJ_VAL(func)));
+  } else {
+    int constant = make_literal(OBJ_VAL(func));
+    emit_bytes(OP_CLOSURE_LONG, (uint8_t)((constant >> 16) & 0xff));
+    emit_bytes((uint8_t)((constant >> 8) & 0xff), (uint8_t)(constant & 0xff));
+  }
   for (int i = 0; i < func->upvalue_cnt; i++) {
-    emit_byte(compiler.upvalues[i].is_local ? 1 : 0);
-    emit_byte(compiler.upvalues[i].index);
+    Upvalue* upvalue = &compiler.upvalues[i];
+    uint8_t flags = upvalue->is_local ? CAPTURE_LOCAL : 0;
+    if (upvalue->is_local) {
+      // A nested function reaching the local through this closure could
+      // outlive the frame
+      add_capture_site(current_bseq()->size, upvalue->index,
+                       upvalue->is_passed ? -1 : holder);
+    }
+    if (upvalue->index > UINT8_MAX) {
+      emit_byte(flags | CAPTURE_WIDE);
+      emit_short(upvalue->index);
+    } else {
+      emit_bytes(flags, (uint8_t)upvalue->index);
+    }
   }
+  free_compiler(&compiler);
+  return func;
 }
 
 static void method() {
   consume(TOKEN_IDENTIFIER, "Expected method name");
-  uint8_t constant = identifier_constant(&parser.previous);
+  int constant = identifier_constant(&parser.previous);
   FunctionType type = TYPE_METHOD;
   if (parser.previous.length == 4 &&
       memcmp(parser.previous.start, "init", 4) == 0) {
     type = TYPE_INITIALIZER;
   }
-  function(type);
-  emit_bytes(OP_METHOD, constant);
+  ObjFunction* func = function(type, -1);
+  emit_name_op(OP_METHOD, OP_METHOD_LONG, constant);
+  if (type == TYPE_INITIALIZER) {
+    return;
+  }
+  // Calls only inline a method name that one class defines
+  ObjStr* name = AS_STR(current_bseq()->consts.vals[constant]);
+  Value other;
+  if (table_get(&vm.inline_methods, name, &other)) {
+    table_set(&vm.inline_methods, name, NIL_VAL);
+  } else {
+    table_set(&vm.inline_methods, name, OBJ_VAL(func));
+  }
 }
 
 static Token synthetic_token(const char* text) {
@@ -561,28 +1610,39 @@ static void super_(bool can_assign) {
   }
   consume(TOKEN_DOT, "Expected '.' after 'super'");
   consume(TOKEN_IDENTIFIER, "Expected superclass method name");
-  uint8_t name = identifier_constant(&parser.previous);
+  int name = identifier_constant(&parser.previous);
 
   named_variable(synthetic_token("this"), false);
   if (match(TOKEN_LEFT_PAREN)) {
     uint8_t arg_cnt = argument_list();
     named_variable(synthetic_token("super"), false);
-    emit_bytes(OP_SUPER_INVOKE, name);
+    current->last_call = current_bseq()->size;
+    current->last_callee = -1;
+    emit_name_op(OP_SUPER_INVOKE, OP_SUPER_INVOKE_LONG, name);
     emit_byte(arg_cnt);
+    emit_invoke_cache();
   } else {
     named_variable(synthetic_token("super"), false);
-    emit_bytes(OP_GET_SUPER, name);
+    emit_name_op(OP_GET_SUPER, OP_GET_SUPER_LONG, name);
   }
 }
 
 static void class_declaration() {
   consume(TOKEN_IDENTIFIER, "Expected class name");
   Token class_name = parser.previous;
-  uint8_t name_constant = identifier_constant(&parser.previous);
+  int name_constant = identifier_constant(&parser.previous);
   declare_variable();
+  uint16_t global = 0;
+  if (current->scope_depth == 0) {
+    Value value;
+    if (resolve_const(&class_name, &value)) {
+      error("A constant with this name already exists");
+    }
+    global = global_variable(&class_name);
+  }
 
-  emit_bytes(OP_CLASS, name_constant);
-  define_variable(name_constant);
+  emit_name_op(OP_CLASS, OP_CLASS_LONG, name_constant);
+  define_variable(global);
 
   ClassCompiler class_compiler;
   class_compiler.has_superclass = false;
@@ -623,14 +1683,209 @@ static void class_declaration() {
 }
 
 static void fun_declaration() {
-  uint8_t global = parse_variable("Expected function name");
+  uint16_t global = parse_variable("Expected function name");
   mark_initialized();
-  function(TYPE_FUNCTION);
+  int holder = current->scope_depth > 0 ? current->local_cnt - 1 : -1;
+  if (holder != -1) {
+    current->locals[holder].closure_sites = current->capture_cnt;
+  }
+  ObjFunction* func = function(TYPE_FUNCTION, holder);
+  if (holder != -1) {
+    // A function that calls itself captures its slot before the closure is
+    // stored there
+    Local* local = &current->locals[holder];
+    local->is_assigned |= local->is_captured;
+  }
+  define_variable(global);
+  if (current->scope_depth == 0) {
+    table_set(&vm.inline_functions, AS_STR(vm.global_names.vals[global]),
+              OBJ_VAL(func));
+  }
+}
+
+// Values a constant expression may have pending at once
+#define MAX_FOLD_STACK 16
+
+/**
+ * Joins the strings `a` and `b`. The result stays on the VM stack, since the
+ * fold stack isn't a GC root, until fold_constant() drops it.
+ */
+static Value fold_concat(ObjStr* a, ObjStr* b) {
+  int length = a->length + b->length;
+  char* chars = ALLOCATE(char, length + 1);
+  memcpy(chars, a->chars, (size_t)a->length);
+  memcpy(chars + a->length, b->chars, (size_t)b->length);
+  chars[length] = '\0';
+  Value result = OBJ_VAL(take_str(chars, length));
+  push(result);
+  return result;
+}
+
+/**
+ * Evaluates the code emitted since `start` into `result`. Returns false
+ * unless the code only combines literals and other constants with the
+ * arithmetic, comparison and logical operators, where `+` also joins
+ * strings. A string it makes is only reachable from `result`.
+ */
+static bool evaluate_constant(int start, Value* result) {
+  ByteSequence* bseq = current_bseq();
+  Value stack[MAX_FOLD_STACK];
+  int cnt = 0;
+  // `and` and `or` only jump forward, so this always ends
+  for (int offset = start; offset < bseq->size;
+       offset += instr_size(bseq, offset)) {
+    uint8_t op = bseq->code[offset];
+    if (cnt == MAX_FOLD_STACK) {
+      return false;
+    }
+    switch (op) {
+      case OP_JUMP:
+        offset += (bseq->code[offset + 1] << 8) | bseq->code[offset + 2];
+        continue;
+      case OP_JUMP_IF_FALSE:
+        if (cnt < 1) {
+          return false;
+        }
+        if (is_falsey(stack[cnt - 1])) {
+          offset += (bseq->code[offset + 1] << 8) | bseq->code[offset + 2];
+        }
+        continue;
+      case OP_POP:
+        if (cnt < 1) {
+          return false;
+        }
+        cnt--;
+        continue;
+      case OP_CONSTANT:
+        stack[cnt++] = bseq->consts.vals[bseq->code[offset + 1]];
+        continue;
+      case OP_CONSTANT_LONG: {
+        uint8_t* ip = &bseq->code[offset];
+        stack[cnt++] = bseq->consts.vals[(ip[1] << 16) | (ip[2] << 8) | ip[3]];
+        continue;
+      }
+      case OP_NIL:
+        stack[cnt++] = NIL_VAL;
+        continue;
+      case OP_TRUE:
+        stack[cnt++] = BOOL_VAL(true);
+        continue;
+      case OP_FALSE:
+        stack[cnt++] = BOOL_VAL(false);
+        continue;
+      case OP_NOT:
+        if (cnt < 1) {
+          return false;
+        }
+        stack[cnt - 1] = BOOL_VAL(is_falsey(stack[cnt - 1]));
+        continue;
+      case OP_NEGATE:
+        if (cnt < 1 || !IS_NUMBER(stack[cnt - 1])) {
+          return false;
+        }
+        stack[cnt - 1] = NUMBER_VAL(-AS_NUMBER(stack[cnt - 1]));
+        continue;
+      case OP_EQUAL:
+        if (cnt < 2) {
+          return false;
+        }
+        cnt--;
+        stack[cnt - 1] = BOOL_VAL(are_equal(stack[cnt - 1], stack[cnt]));
+        continue;
+      case OP_GREATER:
+      case OP_LESS:
+      case OP_ADD:
+      case OP_SUBTRACT:
+      case OP_MULTIPLY:
+      case OP_DIVIDE:
+        break;
+      default:
+        return false;
+    }
+    if (cnt >= 2 && op == OP_ADD && IS_STR(stack[cnt - 2]) &&
+        IS_STR(stack[cnt - 1])) {
+      cnt--;
+      stack[cnt - 1] = fold_concat(AS_STR(stack[cnt - 1]), AS_STR(stack[cnt]));
+      continue;
+    }
+    if (cnt < 2 || !IS_NUMBER(stack[cnt - 2]) || !IS_NUMBER(stack[cnt - 1])) {
+      return false;
+    }
+    double b = AS_NUMBER(stack[--cnt]);
+    double a = AS_NUMBER(stack[cnt - 1]);
+    switch (op) {
+      case OP_GREATER:
+        stack[cnt - 1] = BOOL_VAL(a > b);
+        break;
+      case OP_LESS:
+        stack[cnt - 1] = BOOL_VAL(a < b);
+        break;
+      case OP_ADD:
+        stack[cnt - 1] = NUMBER_VAL(a + b);
+        break;
+      case OP_SUBTRACT:
+        stack[cnt - 1] = NUMBER_VAL(a - b);
+        break;
+      case OP_MULTIPLY:
+        stack[cnt - 1] = NUMBER_VAL(a * b);
+        break;
+      default:
+        stack[cnt - 1] = NUMBER_VAL(a / b);
+        break;
+    }
+  }
+  if (cnt != 1) {
+    return false;
+  }
+  *result = stack[0];
+  return true;
+}
+
+static bool fold_constant(int start, Value* result) {
+  Value* roots = vm.top;
+  bool folded = evaluate_constant(start, result);
+  vm.top = roots;
+  return folded;
+}
+
+/**
+ * Compiles `const name = expression;`, where the expression has to fold to
+ * a value at compile time. Later references compile to that value, and the
+ * global is also defined for code compiled before the declaration, which can
+ * only read it: a global that code already stores to can't become a const.
+ */
+static void const_declaration(void) {
+  if (current->scope_depth > 0 || current->type != TYPE_SCRIPT) {
+    error("Constants can only be declared at the top level");
+  }
+  uint16_t global = parse_variable("Expected constant name");
+  Token name = parser.previous;
+  Value assigned;
+  if (table_get(&vm.assigned_globals, AS_STR(vm.global_names.vals[global]),
+                &assigned)) {
+    error("Can't declare a constant over an assigned global");
+  }
+  consume(TOKEN_EQUAL, "Expected '=' after constant name");
+  int start = current_bseq()->size;
+  expression();
+  consume(TOKEN_SEMICOLON, "Expected ';' after constant declaration");
+
+  Value value;
+  if (!fold_constant(start, &value)) {
+    error_at(&name, "Constant initializer must be a constant expression");
+    return;
+  }
+  current_bseq()->size = start;
+  push(value);
+  emit_value(value);
   define_variable(global);
+  // The name is reachable through vm.global_names while the table grows
+  table_set(&vm.global_consts, AS_STR(vm.global_names.vals[global]), value);
+  pop();
 }
 
 static void var_declaration(void) {
-  uint8_t global = parse_variable("Expected variable name");
+  uint16_t global = parse_variable("Expected variable name");
   if (match(TOKEN_EQUAL)) {
     expression();
   } else {
@@ -641,9 +1896,206 @@ static void var_declaration(void) {
 }
 
 static void expr_statement(void) {
+  int start = current_bseq()->size;
   expression();
   consume(TOKEN_SEMICOLON, "Expected ';' after expression");
-  emit_byte(OP_POP);
+  Value value;
+  if (trailing_constant(&value) == start) {
+    remove_constant(current->last_const, start);
+    return;
+  }
+  emit_pop();
+}
+
+/** Operands of a counted loop, see OP_FOR_PREP. */
+typedef struct {
+  uint8_t counter;
+  uint8_t limit;
+  uint8_t mode;
+  uint8_t step;
+} CountedLoop;
+
+// Longest loop clause counted_for() keeps to fall back on
+#define MAX_CLAUSE 8
+
+static bool is_number_constant(uint8_t constant) {
+  return IS_NUMBER(current_bseq()->consts.vals[constant]);
+}
+
+/**
+ * Matches the condition between `start` and `end` against `counter < limit`
+ * and its variants, where the limit is a local or a number constant.
+ */
+static bool match_loop_condition(int start, int end, CountedLoop* loop) {
+  uint8_t* code = current_bseq()->code;
+  uint8_t op;
+  bool constant;
+  if (IS_REGISTER_OP(code[start]) && code[start + 1] == REG_PUSH) {
+    op = code[start];
+    constant = op == OP_LESS_RK || op == OP_GREATER_RK;
+    loop->counter = code[start + 2];
+    loop->limit = code[start + 3];
+  } else if (code[start] == OP_GET_LOCAL_LOCAL ||
+             code[start] == OP_GET_LOCAL_CONSTANT) {
+    op = code[start + 3];
+    constant = code[start] == OP_GET_LOCAL_CONSTANT;
+    loop->counter = code[start + 1];
+    loop->limit = code[start + 2];
+  } else {
+    return false;
+  }
+  bool less = op == OP_LESS || op == OP_LESS_RR || op == OP_LESS_RK;
+  bool greater = op == OP_GREATER || op == OP_GREATER_RR || op == OP_GREATER_RK;
+  int at = start + 4;
+  bool negated = at < end && code[at] == OP_NOT;
+  if (negated) {
+    at++;
+  }
+  if ((!less && !greater) || at != end ||
+      (constant && !is_number_constant(loop->limit))) {
+    return false;
+  }
+  if (less) {
+    loop->mode = negated ? FOR_GREATER_EQUAL : FOR_LESS;
+  } else {
+    loop->mode = negated ? FOR_LESS_EQUAL : FOR_GREATER;
+  }
+  if (constant) {
+    loop->mode |= FOR_CONST_LIMIT;
+  }
+  return true;
+}
+
+/**
+ * Matches the increment between `start` and `end` against
+ * `counter = counter + step` or `counter = counter - step`, where the step is
+ * a number constant.
+ */
+static bool match_loop_increment(int start, int end, CountedLoop* loop) {
+  uint8_t* code = current_bseq()->code;
+  uint8_t op;
+  uint8_t step;
+  if (end - start == 4 &&
+      (code[start] == OP_ADD_RK || code[start] == OP_SUBTRACT_RK) &&
+      code[start + 1] == loop->counter && code[start + 2] == loop->counter) {
+    op = code[start] == OP_ADD_RK ? OP_ADD : OP_SUBTRACT;
+    step = code[start + 3];
+  } else if (end - start == 6 && code[start] == OP_GET_LOCAL_CONSTANT &&
+             code[start + 1] == loop->counter &&
+             (code[start + 3] == OP_ADD || code[start + 3] == OP_SUBTRACT) &&
+             code[start + 4] == OP_SET_LOCAL_POP &&
+             code[start + 5] == loop->counter) {
+    op = code[start + 3];
+    step = code[start + 2];
+  } else {
+    return false;
+  }
+  if (!is_number_constant(step)) {
+    return false;
+  }
+  if (op == OP_SUBTRACT) {
+    // Reuse the negated step if it's already a constant, and only add it
+    // while the byte operand range has room
+    Value negated = NUMBER_VAL(-AS_NUMBER(current_bseq()->consts.vals[step]));
+    int found = find_constant(negated);
+    if ((found == -1 || found > UINT8_MAX) && byte_constants_left() == 0) {
+      return false;
+    }
+    step = make_constant(negated);
+  }
+  loop->step = step;
+  return true;
+}
+
+/** Returns true if code from `start` on may store to the local `slot`. */
+static bool writes_local(int start, uint8_t slot) {
+  if (current->locals[slot].is_captured) {
+    return true;
+  }
+  ByteSequence* bseq = current_bseq();
+  for (int offset = start; offset < bseq->size;
+       offset += instr_size(bseq, offset)) {
+    uint8_t* ip = &bseq->code[offset];
+    if ((*ip == OP_SET_LOCAL || *ip == OP_SET_LOCAL_POP ||
+         *ip == OP_FOR_LOOP || IS_REGISTER_OP(*ip)) &&
+        ip[1] == slot) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * Compiles the rest of a for loop whose clauses were just compiled, starting
+ * with the condition at `cond_start`, as a counted loop if they have its
+ * shape. Returns false, leaving the clauses alone, if they don't.
+ */
+static bool counted_for(int cond_start, int exit_jump, int increment_start) {
+  ByteSequence* bseq = current_bseq();
+  int cond_end = exit_jump - 1;
+  CountedLoop loop;
+  if (cond_end - cond_start > MAX_CLAUSE ||
+      bseq->size - increment_start > MAX_CLAUSE ||
+      !match_loop_condition(cond_start, cond_end, &loop) ||
+      !match_loop_increment(increment_start, bseq->size, &loop)) {
+    return false;
+  }
+
+  // Keep both clauses in case the body can change the counter or the limit
+  uint8_t clauses[2 * MAX_CLAUSE];
+  int lines[2 * MAX_CLAUSE];
+  int clause_len = 0;
+  for (int i = increment_start; i < bseq->size; i++) {
+    clauses[clause_len] = bseq->code[i];
+    lines[clause_len++] = bseq->lines[i];
+  }
+  for (int i = cond_start; i < cond_end; i++) {
+    clauses[clause_len] = bseq->code[i];
+    lines[clause_len++] = bseq->lines[i];
+  }
+  bseq->size = cond_start;
+  current->last_local = -1;
+  current->last_const = -1;
+
+  int prep = current_bseq()->size;
+  emit_bytes(OP_FOR_PREP, loop.counter);
+  emit_bytes(loop.limit, loop.mode);
+  emit_bytes(0xff, 0xff);
+  int body_start = mark_jump_target();
+  statement();
+
+  // A body too long for OP_FOR_LOOP's jump back takes the general form
+  bool fixed_limit = (loop.mode & FOR_CONST_LIMIT) != 0 ||
+                     !writes_local(body_start, loop.limit);
+  int back = current_bseq()->size + 9 - body_start;
+  if (!writes_local(body_start, loop.counter) && fixed_limit &&
+      back <= UINT16_MAX) {
+    emit_bytes(OP_FOR_LOOP, loop.counter);
+    emit_bytes(loop.limit, loop.mode);
+    emit_byte(loop.step);
+    emit_short((uint16_t)back);
+    int cache = add_loop_cache(current_bseq());
+    if (cache > UINT16_MAX) {
+      error("Too many loops in one byte sequence");
+    }
+    emit_bytes((uint8_t)((cache >> 8) & 0xff), (uint8_t)(cache & 0xff));
+  } else {
+    for (int i = 0; i < clause_len; i++) {
+      write_bsequence(current_bseq(), clauses[i], lines[i]);
+    }
+    current->last_local = -1;
+    int loop_exit = emit_jump(OP_JUMP_IF_FALSE_POP);
+    emit_loop(body_start);
+    patch_jump(loop_exit);
+  }
+  if (!set_jump_operand(prep + 4, prep + 6)) {
+    current_bseq()->code[prep + 3] |= FOR_FAR_EXIT;
+    uint16_t index = far_jump_here();
+    current_bseq()->code[prep + 4] = (uint8_t)((index >> 8) & 0xff);
+    current_bseq()->code[prep + 5] = (uint8_t)(index & 0xff);
+  }
+  mark_jump_target();
+  return true;
 }
 
 static void for_statement(void) {
@@ -657,22 +2109,26 @@ static void for_statement(void) {
     expr_statement();
   }
 
-  int loop_start = current_bseq()->size;
+  int loop_start = mark_jump_target();
   int exit_jump = -1;
   if (!match(TOKEN_SEMICOLON)) {
     expression();
     consume(TOKEN_SEMICOLON, "Expected ';' after loop condition");
 
-    exit_jump = emit_jump(OP_JUMP_IF_FALSE);
-    emit_byte(OP_POP);
+    exit_jump = emit_jump(OP_JUMP_IF_FALSE_POP);
   }
 
   if (!match(TOKEN_RIGHT_PAREN)) {
     int body_jump = emit_jump(OP_JUMP);
-    int increment_start = current_bseq()->size;
+    int increment_start = mark_jump_target();
     expression();
-    emit_byte(OP_POP);
+    emit_pop();
     consume(TOKEN_RIGHT_PAREN, "Expected ')' after for clauses");
+    if (exit_jump != -1 &&
+        counted_for(loop_start, exit_jump, increment_start)) {
+      end_scope();
+      return;
+    }
     emit_loop(loop_start);
     loop_start = increment_start;
     patch_jump(body_jump);
@@ -683,28 +2139,53 @@ static void for_statement(void) {
 
   if (exit_jump != -1) {
     patch_jump(exit_jump);
-    emit_byte(OP_POP);
   }
 
   end_scope();
 }
 
+/** Compiles a statement that can't run and drops its code. */
+static void dead_statement(void) {
+  CodeMark mark = mark_code();
+  statement();
+  discard_code(&mark);
+}
+
 static void if_statement(void) {
   consume(TOKEN_LEFT_PAREN, "Expected '(' after 'if'");
+  int start = current_bseq()->size;
   expression();
   consume(TOKEN_RIGHT_PAREN, "Expected ')' after condition");
 
-  int then_jump = emit_jump(OP_JUMP_IF_FALSE);
-  emit_byte(OP_POP);
-  statement();
-  int elseJump = emit_jump(OP_JUMP);
+  Value condition;
+  if (trailing_constant(&condition) == start) {
+    remove_constant(current->last_const, start);
+    bool taken = !is_falsey(condition);
+    if (taken) {
+      statement();
+    } else {
+      dead_statement();
+    }
+    if (match(TOKEN_ELSE)) {
+      if (taken) {
+        dead_statement();
+      } else {
+        statement();
+      }
+    }
+    return;
+  }
 
-  patch_jump(then_jump);
-  emit_byte(OP_POP);
+  int then_jump = emit_jump(OP_JUMP_IF_FALSE_POP);
+  statement();
   if (match(TOKEN_ELSE)) {
+    int else_jump = emit_jump(OP_JUMP);
+    patch_jump(then_jump);
     statement();
+    patch_jump(else_jump);
+  } else {
+    patch_jump(then_jump);
   }
-  patch_jump(elseJump);
 }
 
 static void print_statement(void) {
@@ -713,6 +2194,24 @@ static void print_statement(void) {
   emit_byte(OP_PRINT);
 }
 
+/** Returns the form of call instruction `op` that reuses the frame, or -1. */
+static int tail_form(uint8_t op) {
+  switch (op) {
+    case OP_CALL:
+      return OP_TAIL_CALL;
+    case OP_INVOKE:
+      return OP_TAIL_INVOKE;
+    case OP_SUPER_INVOKE:
+      return OP_TAIL_SUPER_INVOKE;
+    case OP_INVOKE_LONG:
+      return OP_TAIL_INVOKE_LONG;
+    case OP_SUPER_INVOKE_LONG:
+      return OP_TAIL_SUPER_INVOKE_LONG;
+    default:
+      return -1;
+  }
+}
+
 static void return_statement(void) {
   if (current->type == TYPE_SCRIPT) {
     error("Can't return from top-level code");
@@ -727,23 +2226,95 @@ static void return_statement(void) {
 
     expression();
     consume(TOKEN_SEMICOLON, "Expected ';' after return value");
+    // A call that ends the returned expression can reuse this frame, unless
+    // a try block in it has to catch what the call throws. The OP_RETURN
+    // stays for branches that jump past it and for native callees.
+    ByteSequence* bseq = current_bseq();
+    int call = current->last_call;
+    if (call != -1 && call < bseq->size && current->try_depth == 0) {
+      int tail = tail_form(bseq->code[call]);
+      if (tail != -1 && call + instr_size(bseq, call) == bseq->size) {
+        bseq->code[call] = (uint8_t)tail;
+        // The callee would run after the frame is gone
+        if (current->last_callee != -1) {
+          current->locals[current->last_callee].escapes = true;
+        }
+      }
+    }
     emit_byte(OP_RETURN);
   }
+  current->unreachable = true;
+}
+
+/**
+ * Compiles `try { ... } catch (name) { ... }`. The try block's code is
+ * emitted as is and only recorded in the handler table, so entering it
+ * costs nothing. The catch block follows it, behind a jump.
+ */
+static void try_statement(void) {
+  ByteSequence* bseq = current_bseq();
+  int depth = current->local_cnt;
+  int start = mark_jump_target();
+  consume(TOKEN_LEFT_BRACE, "Expected '{' after 'try'");
+  current->try_depth++;
+  begin_scope();
+  block();
+  end_scope();
+  current->try_depth--;
+  int end = bseq->size;
+  int exit_jump = emit_jump(OP_JUMP);
+
+  int handler = mark_jump_target();
+  if (end > start) {
+    add_handler(bseq, start, end, handler, depth);
+  }
+  if (!match(TOKEN_CATCH)) {
+    error_at_current("Expected 'catch' after try block");
+    return;
+  }
+  consume(TOKEN_LEFT_PAREN, "Expected '(' after 'catch'");
+  begin_scope();
+  // The unwinder pushes the exception into the variable's slot
+  consume(TOKEN_IDENTIFIER, "Expected exception variable name");
+  declare_variable();
+  mark_initialized();
+  consume(TOKEN_RIGHT_PAREN, "Expected ')' after exception variable");
+  consume(TOKEN_LEFT_BRACE, "Expected '{' before catch block");
+  block();
+  end_scope();
+  patch_jump(exit_jump);
+}
+
+static void throw_statement(void) {
+  expression();
+  consume(TOKEN_SEMICOLON, "Expected ';' after thrown value");
+  emit_byte(OP_THROW);
+  current->unreachable = true;
 }
 
 static void while_statement(void) {
-  int loop_start = current_bseq()->size;
+  int loop_start = mark_jump_target();
   consume(TOKEN_LEFT_PAREN, "Expected '(' after 'while'");
   expression();
   consume(TOKEN_RIGHT_PAREN, "Expected ')' after condition");
 
-  int exit_jump = emit_jump(OP_JUMP_IF_FALSE);
-  emit_byte(OP_POP);
+  Value condition;
+  if (trailing_constant(&condition) == loop_start) {
+    remove_constant(current->last_const, loop_start);
+    if (is_falsey(condition)) {
+      dead_statement();
+    } else {
+      statement();
+      emit_loop(loop_start);
+    }
+    return;
+  }
+
+  int exit_jump = emit_jump(OP_JUMP_IF_FALSE_POP);
   statement();
   emit_loop(loop_start);
 
   patch_jump(exit_jump);
-  emit_byte(OP_POP);
 }
 
 static void synchronize(void) {
@@ -755,6 +2326,7 @@ static void synchronize(void) {
     }
     switch (parser.current.type) {
       case TOKEN_CLASS:
+      case TOKEN_CONST:
       case TOKEN_FUN:
       case TOKEN_VAR:
       case TOKEN_FOR:
@@ -762,6 +2334,8 @@ static void synchronize(void) {
       case TOKEN_WHILE:
       case TOKEN_PRINT:
       case TOKEN_RETURN:
+      case TOKEN_TRY:
+      case TOKEN_THROW:
         return;
       default:;
     }
@@ -780,6 +2354,10 @@ static void statement(void) {
     return_statement();
   } else if (match(TOKEN_WHILE)) {
     while_statement();
+  } else if (match(TOKEN_TRY)) {
+    try_statement();
+  } else if (match(TOKEN_THROW)) {
+    throw_statement();
   } else if (match(TOKEN_LEFT_BRACE)) {
     begin_scope();
     block();
@@ -796,6 +2374,8 @@ static void declaration(void) {
     fun_declaration();
   } else if (match(TOKEN_VAR)) {
     var_declaration();
+  } else if (match(TOKEN_CONST)) {
+    const_declaration();
   } else {
     statement();
   }
@@ -817,6 +2397,13 @@ static void number(bool can_assign) {
 }
 
 static void or_(bool can_assign) {
+  (void)can_assign;
+  Value left;
+  int start = trailing_constant(&left);
+  if (start != -1) {
+    constant_logical(left, current->last_const, start, PREC_OR);
+    return;
+  }
   int else_jump = emit_jump(OP_JUMP_IF_FALSE);
   int end_jump = emit_jump(OP_JUMP);
   patch_jump(else_jump);
@@ -831,9 +2418,24 @@ static void string(bool can_assign) {
       OBJ_VAL(copy_str(parser.previous.start + 1, parser.previous.length - 2)));
 }
 
+/** Returns the wide form of a local or upvalue access. */
+static uint8_t wide_variable_op(uint8_t op) {
+  switch (op) {
+    case OP_GET_LOCAL:
+      return OP_GET_LOCAL_LONG;
+    case OP_SET_LOCAL:
+      return OP_SET_LOCAL_LONG;
+    case OP_GET_UPVALUE:
+      return OP_GET_UPVALUE_LONG;
+    default:
+      return OP_SET_UPVALUE_LONG;
+  }
+}
+
 static void named_variable(Token name, bool can_assign) {
   uint8_t get_op;
   uint8_t set_op;
+  Value value;
   int arg = resolve_local(current, &name);
   if (arg != -1) {
     get_op = OP_GET_LOCAL;
@@ -841,18 +2443,76 @@ static void named_variable(Token name, bool can_assign) {
   } else if ((arg = resolve_upvalue(current, &name)) != -1) {
     get_op = OP_GET_UPVALUE;
     set_op = OP_SET_UPVALUE;
+  } else if (resolve_const(&name, &value)) {
+    if (can_assign && match(TOKEN_EQUAL)) {
+      error("Can't assign to a constant");
+      expression();
+      return;
+    }
+    emit_value(value);
+    return;
   } else {
-    arg = identifier_constant(&name);
+    arg = global_variable(&name);
     get_op = OP_GET_GLOBAL;
     set_op = OP_SET_GLOBAL;
   }
 
+  uint8_t op = get_op;
+  if (op == OP_GET_LOCAL && !(can_assign && check(TOKEN_EQUAL))) {
+    if (check(TOKEN_LEFT_PAREN)) {
+      current->callee = arg;
+    } else {
+      current->locals[arg].escapes = true;
+    }
+  }
   if (can_assign && match(TOKEN_EQUAL)) {
     expression();
-    emit_bytes(set_op, (uint8_t)arg);
-  } else {
-    emit_bytes(get_op, (uint8_t)arg);
+    op = set_op;
+    if (op == OP_SET_LOCAL) {
+      current->locals[arg].is_assigned = true;
+    } else if (op == OP_SET_UPVALUE) {
+      assign_upvalue(current, arg);
+    } else {
+      mark_assigned((uint16_t)arg);
+    }
   }
+  if (op == OP_GET_GLOBAL || op == OP_SET_GLOBAL) {
+    if (op == OP_GET_GLOBAL) {
+      current->last_global = current_bseq()->size;
+    }
+    emit_byte(op);
+    emit_short((uint16_t)arg);
+    return;
+  }
+  if (arg > UINT8_MAX) {
+    // Nothing fuses with the wide forms
+    emit_byte(wide_variable_op(op));
+    emit_short((uint16_t)arg);
+    return;
+  }
+  if (op == OP_GET_LOCAL) {
+    int get_local = fusable_local(OP_GET_LOCAL);
+    if (get_local != -1) {
+      current_bseq()->code[get_local] = OP_GET_LOCAL_LOCAL;
+      emit_byte((uint8_t)arg);
+      return;
+    }
+  }
+  if (op == OP_SET_LOCAL && arg != REG_PUSH) {
+    // Let the register instruction that computed the value store it, and
+    // reload it as the value of the assignment
+    int reg = last_fusable();
+    ByteSequence* bseq = current_bseq();
+    if (reg != -1 && IS_REGISTER_OP(bseq->code[reg]) &&
+        bseq->code[reg + 1] == REG_PUSH) {
+      bseq->code[reg + 1] = (uint8_t)arg;
+      op = OP_GET_LOCAL;
+    }
+  }
+  if (op == OP_GET_LOCAL || op == OP_SET_LOCAL) {
+    current->last_local = current_bseq()->size;
+  }
+  emit_bytes(op, (uint8_t)arg);
 }
 
 static void variable(bool can_assign) {
@@ -870,9 +2530,17 @@ static void this_(bool can_assign) {
 static void unary(bool can_assign) {
   (void)can_assign;
   TokenType op_type = parser.previous.type;
-
+  int start = current_bseq()->size;
   parse_precedence(PREC_UNARY);
 
+  Value operand = NIL_VAL;
+  if (trailing_constant(&operand) == start &&
+      (op_type == TOKEN_BANG || IS_NUMBER(operand))) {
+    remove_constant(current->last_const, start);
+    emit_value(op_type == TOKEN_BANG ? BOOL_VAL(is_falsey(operand))
+                                     : NUMBER_VAL(-AS_NUMBER(operand)));
+    return;
+  }
   switch (op_type) {
     case TOKEN_BANG:
       emit_byte(OP_NOT);
@@ -909,7 +2577,9 @@ ParseRule rules[] = {
     [TOKEN_STRING] = {string, NULL, PREC_NONE},
     [TOKEN_NUMBER] = {number, NULL, PREC_NONE},
     [TOKEN_AND] = {NULL, and_, PREC_AND},
+    [TOKEN_CATCH] = {NULL, NULL, PREC_NONE},
     [TOKEN_CLASS] = {NULL, NULL, PREC_NONE},
+    [TOKEN_CONST] = {NULL, NULL, PREC_NONE},
     [TOKEN_ELSE] = {NULL, NULL, PREC_NONE},
     [TOKEN_FALSE] = {literal, NULL, PREC_NONE},
     [TOKEN_FOR] = {NULL, NULL, PREC_NONE},
@@ -921,7 +2591,9 @@ ParseRule rules[] = {
     [TOKEN_RETURN] = {NULL, NULL, PREC_NONE},
     [TOKEN_SUPER] = {super_, NULL, PREC_NONE},
     [TOKEN_THIS] = {this_, NULL, PREC_NONE},
+    [TOKEN_THROW] = {NULL, NULL, PREC_NONE},
     [TOKEN_TRUE] = {literal, NULL, PREC_NONE},
+    [TOKEN_TRY] = {NULL, NULL, PREC_NONE},
     [TOKEN_VAR] = {NULL, NULL, PREC_NONE},
     [TOKEN_WHILE] = {NULL, NULL, PREC_NONE},
     [TOKEN_ERROR] = {NULL, NULL, PREC_NONE},
@@ -944,6 +2616,7 @@ ObjFunction* compile(const char* src) {
   }
 
   ObjFunction* function = end_compiler();
+  free_compiler(&compiler);
   return parser.had_err ? NULL : function;
 }
 
@@ -3,8 +3,10 @@
 #include <stdio.h>
 
 #include "bytecode.h"
+#include "native.h"
 #include "object.h"
 #include "value.h"
+#include "vm.h"
 
 void disassemble_bseq(ByteSequence *seq, const char *name) {
   printf("--- %s ---\n", name);
@@ -12,6 +14,11 @@ void disassemble_bseq(ByteSequence *seq, const char *name) {
   for (int offset = 0; offset < seq->size;) {
     offset = disassemble_instr(seq, offset);
   }
+  for (int i = 0; i < seq->handler_cnt; i++) {
+    Handler *entry = &seq->handlers[i];
+    printf("try %04d-%04d catch -> %04d (depth %d)\n", entry->start,
+           entry->end, entry->handler, entry->depth);
+  }
 }
 
 static int simple_instr(const char *name, int offset) {
@@ -25,14 +32,48 @@ static int byte_instr(const char *name, ByteSequence *seq, int offset) {
   return offset + 2;
 }
 
-static int jump_instr(const char *name, int sign, ByteSequence *bseq,
-                      int offset) {
-  uint16_t jump = (uint16_t)(bseq->code[offset + 1] << 8);
-  jump |= bseq->code[offset + 2];
-  printf("%-16s %4d -> %d\n", name, offset, offset + 3 + sign * jump);
+static int short_instr(const char *name, ByteSequence *seq, int offset) {
+  uint16_t index = (uint16_t)(seq->code[offset + 1] << 8);
+  index |= seq->code[offset + 2];
+  printf("%-16s %4d\n", name, index);
+  return offset + 3;
+}
+
+static int jump_instr(const char *name, ByteSequence *seq, int offset) {
+  printf("%-16s %4d -> %d\n", name, offset, jump_target(seq, offset));
   return offset + 3;
 }
 
+static int loop_instr(const char *name, ByteSequence *seq, int offset) {
+  uint16_t cache = (uint16_t)(seq->code[offset + 3] << 8);
+  cache |= seq->code[offset + 4];
+  printf("%-16s %4d -> %d (cache %d)\n", name, offset,
+         back_edge_target(seq, offset), cache);
+  return offset + 5;
+}
+
+static int for_prep_instr(const char *name, ByteSequence *seq, int offset) {
+  uint8_t *ip = &seq->code[offset];
+  printf("%-16s %4d %d mode %d -> %d\n", name, ip[1], ip[2], ip[3],
+         jump_target(seq, offset));
+  return offset + 6;
+}
+
+static int for_loop_instr(const char *name, ByteSequence *seq, int offset) {
+  uint8_t *ip = &seq->code[offset];
+  uint16_t cache = (uint16_t)((ip[7] << 8) | ip[8]);
+  printf("%-16s %4d %d mode %d step '", name, ip[1], ip[2], ip[3]);
+  print_val(seq->consts.vals[ip[4]]);
+  printf("' -> %d (cache %d)\n", back_edge_target(seq, offset), cache);
+  return offset + 9;
+}
+
+static int intrinsic_instr(const char *name, ByteSequence *seq, int offset) {
+  uint8_t id = seq->code[offset + 1];
+  printf("%-16s %4d '%s'\n", name, id, intrinsics[id].name);
+  return offset + 2;
+}
+
 static int const_instr(const char *name, ByteSequence *seq, int offset) {
   uint8_t const_offset = seq->code[offset + 1];
   printf("%-16s %4d '", name, const_offset);
@@ -41,21 +82,142 @@ static int const_instr(const char *name, ByteSequence *seq, int offset) {
   return offset + 2;
 }
 
+static int const_long_instr(const char *name, ByteSequence *seq, int offset) {
+  uint8_t *ip = &seq->code[offset];
+  int constant = (ip[1] << 16) | (ip[2] << 8) | ip[3];
+  printf("%-16s %4d '", name, constant);
+  print_val(seq->consts.vals[constant]);
+  printf("'\n");
+  return offset + 4;
+}
+
+static int property_instr(const char *name, ByteSequence *seq, int offset) {
+  uint8_t constant = seq->code[offset + 1];
+  uint16_t cache = (uint16_t)(seq->code[offset + 2] << 8);
+  cache |= seq->code[offset + 3];
+  printf("%-16s %4d '", name, constant);
+  print_val(seq->consts.vals[constant]);
+  printf("' (cache %d)\n", cache);
+  return offset + 4;
+}
+
+static int property_long_instr(const char *name, ByteSequence *seq,
+                               int offset) {
+  uint8_t *ip = &seq->code[offset];
+  int constant = (ip[1] << 16) | (ip[2] << 8) | ip[3];
+  uint16_t cache = (uint16_t)((ip[4] << 8) | ip[5]);
+  printf("%-16s %4d '", name, constant);
+  print_val(seq->consts.vals[constant]);
+  printf("' (cache %d)\n", cache);
+  return offset + 6;
+}
+
+static int local_local_instr(const char *name, ByteSequence *seq,
+                             int offset) {
+  uint8_t first = seq->code[offset + 1];
+  uint8_t second = seq->code[offset + 2];
+  printf("%-16s %4d %d\n", name, first, second);
+  return offset + 3;
+}
+
+static int local_const_instr(const char *name, ByteSequence *seq,
+                             int offset) {
+  uint8_t slot = seq->code[offset + 1];
+  uint8_t constant = seq->code[offset + 2];
+  printf("%-16s %4d %d '", name, slot, constant);
+  print_val(seq->consts.vals[constant]);
+  printf("'\n");
+  return offset + 3;
+}
+
+static int local_property_instr(const char *name, ByteSequence *seq,
+                                int offset) {
+  uint8_t slot = seq->code[offset + 1];
+  uint8_t constant = seq->code[offset + 2];
+  uint16_t cache = (uint16_t)(seq->code[offset + 3] << 8);
+  cache |= seq->code[offset + 4];
+  printf("%-16s %4d %d '", name, slot, constant);
+  print_val(seq->consts.vals[constant]);
+  printf("' (cache %d)\n", cache);
+  return offset + 5;
+}
+
+static int register_instr(const char *name, bool constant, ByteSequence *seq,
+                          int offset) {
+  uint8_t dst = seq->code[offset + 1];
+  uint8_t left = seq->code[offset + 2];
+  uint8_t right = seq->code[offset + 3];
+  if (dst == REG_PUSH) {
+    printf("%-16s push <- %d, ", name, left);
+  } else {
+    printf("%-16s %4d <- %d, ", name, dst, left);
+  }
+  if (constant) {
+    printf("%d '", right);
+    print_val(seq->consts.vals[right]);
+    printf("'\n");
+  } else {
+    printf("%d\n", right);
+  }
+  return offset + 4;
+}
+
+static int global_instr(const char *name, ByteSequence *seq, int offset) {
+  uint16_t slot = (uint16_t)(seq->code[offset + 1] << 8);
+  slot |= seq->code[offset + 2];
+  printf("%-16s %4d '", name, slot);
+  print_val(vm.global_names.vals[slot]);
+  printf("'\n");
+  return offset + 3;
+}
+
 static int invoke_instr(const char *name, ByteSequence *seq, int offset) {
   uint8_t constant = seq->code[offset + 1];
   uint8_t arg_cnt = seq->code[offset + 2];
+  uint16_t cache = (uint16_t)(seq->code[offset + 3] << 8);
+  cache |= seq->code[offset + 4];
   printf("%-16s (%d args) %4d '", name, arg_cnt, constant);
   print_val(seq->consts.vals[constant]);
-  printf("'\n");
-  return offset + 3;
+  printf("' (cache %d)\n", cache);
+  return offset + 5;
+}
+
+static int invoke_long_instr(const char *name, ByteSequence *seq,
+                             int offset) {
+  uint8_t *ip = &seq->code[offset];
+  int constant = (ip[1] << 16) | (ip[2] << 8) | ip[3];
+  uint16_t cache = (uint16_t)((ip[5] << 8) | ip[6]);
+  printf("%-16s (%d args) %4d '", name, ip[4], constant);
+  print_val(seq->consts.vals[constant]);
+  printf("' (cache %d)\n", cache);
+  return offset + 7;
+}
+
+static int inline_instr(const char *name, ByteSequence *seq, int offset) {
+  uint8_t *ip = &seq->code[offset];
+  int size = instr_size(seq, offset);
+  if (*ip == OP_INLINE_INVOKE) {
+    uint16_t cache = (uint16_t)((ip[2] << 8) | ip[3]);
+    printf("%-16s %4d '", name, ip[1]);
+    print_val(seq->consts.vals[ip[1]]);
+    printf("' (cache %d) ", cache);
+  } else {
+    printf("%-16s ", name);
+  }
+  uint16_t skip = (uint16_t)((ip[size - 2] << 8) | ip[size - 1]);
+  printf("%4d ", ip[size - 3]);
+  print_val(seq->consts.vals[ip[size - 3]]);
+  printf(" else -> %d\n", offset + size + skip);
+  return offset + size;
 }
 
 int disassemble_instr(ByteSequence *seq, int offset) {
   printf("%04d ", offset);
-  if (offset > 0 && seq->lines[offset] == seq->lines[offset - 1]) {
+  int line = get_line(seq, offset);
+  if (offset > 0 && line == get_line(seq, offset - 1)) {
     printf("   | ");
   } else {
-    printf("%4d ", seq->lines[offset]);
+    printf("%4d ", line);
   }
 
   uint8_t instr = seq->code[offset];
@@ -63,30 +225,62 @@ int disassemble_instr(ByteSequence *seq, int offset) {
     case OP_PRINT:
       return simple_instr("OP_PRINT", offset);
     case OP_JUMP:
-      return jump_instr("OP_JUMP", 1, seq, offset);
+      return jump_instr("OP_JUMP", seq, offset);
     case OP_JUMP_IF_FALSE:
-      return jump_instr("OP_JUMP_IF_FALSE", 1, seq, offset);
+      return jump_instr("OP_JUMP_IF_FALSE", seq, offset);
     case OP_LOOP:
-      return jump_instr("OP_LOOP", -1, seq, offset);
+      return loop_instr("OP_LOOP", seq, offset);
+    case OP_FOR_PREP:
+      return for_prep_instr("OP_FOR_PREP", seq, offset);
+    case OP_FOR_LOOP:
+      return for_loop_instr("OP_FOR_LOOP", seq, offset);
     case OP_CALL:
       return byte_instr("OP_CALL", seq, offset);
+    case OP_TAIL_CALL:
+      return byte_instr("OP_TAIL_CALL", seq, offset);
+    case OP_INTRINSIC:
+      return intrinsic_instr("OP_INTRINSIC", seq, offset);
     case OP_INVOKE:
       return invoke_instr("OP_INVOKE", seq, offset);
     case OP_SUPER_INVOKE:
       return invoke_instr("OP_SUPER_INVOKE", seq, offset);
-    case OP_CLOSURE: {
+    case OP_TAIL_INVOKE:
+      return invoke_instr("OP_TAIL_INVOKE", seq, offset);
+    case OP_TAIL_SUPER_INVOKE:
+      return invoke_instr("OP_TAIL_SUPER_INVOKE", seq, offset);
+    case OP_INLINE_CALL:
+      return inline_instr("OP_INLINE_CALL", seq, offset);
+    case OP_INLINE_INVOKE:
+      return inline_instr("OP_INLINE_INVOKE", seq, offset);
+    case OP_INLINE_RETURN:
+      return simple_instr("OP_INLINE_RETURN", offset);
+    case OP_CLOSURE:
+    case OP_CLOSURE_LONG: {
       offset++;
-      uint8_t constant = seq->code[offset++];
-      printf("%-16s %4d ", "OP_CLOSURE", constant);
+      int constant = seq->code[offset++];
+      if (instr == OP_CLOSURE_LONG) {
+        constant = (constant << 16) | (seq->code[offset] << 8) |
+                   seq->code[offset + 1];
+        offset += 2;
+      }
+      printf("%-16s %4d ",
+             instr == OP_CLOSURE ? "OP_CLOSURE" : "OP_CLOSURE_LONG", constant);
       print_val(seq->consts.vals[constant]);
       printf("\n");
 
       ObjFunction *func = AS_FUNCTION(seq->consts.vals[constant]);
       for (int j = 0; j < func->upvalue_cnt; j++) {
-        int is_local = seq->code[offset++];
+        int at = offset;
+        uint8_t flags = seq->code[offset++];
         int index = seq->code[offset++];
-        printf("%04d      |                     %s %d\n", offset - 2,
-               is_local ? "local" : "upvalue", index);
+        if (flags & CAPTURE_WIDE) {
+          index = (index << 8) | seq->code[offset++];
+        }
+        printf("%04d      |                     %s %d%s\n", at,
+               (flags & CAPTURE_LOCAL) ? "local" : "upvalue", index,
+               (flags & CAPTURE_VALUE)   ? " (value)"
+               : (flags & CAPTURE_FRAME) ? " (frame)"
+                                         : "");
       }
 
       return offset;
@@ -95,6 +289,8 @@ int disassemble_instr(ByteSequence *seq, int offset) {
       return simple_instr("OP_CLOSE_UPVALUE", offset);
     case OP_RETURN:
       return simple_instr("OP_RETURN", offset);
+    case OP_THROW:
+      return simple_instr("OP_THROW", offset);
     case OP_ADD:
       return simple_instr("OP_ADD", offset);
     case OP_SUBTRACT:
@@ -122,19 +318,19 @@ int disassemble_instr(ByteSequence *seq, int offset) {
     case OP_SET_LOCAL:
       return byte_instr("OP_SET_LOCAL", seq, offset);
     case OP_GET_GLOBAL:
-      return const_instr("OP_GET_GLOBAL", seq, offset);
+      return global_instr("OP_GET_GLOBAL", seq, offset);
     case OP_DEFINE_GLOBAL:
-      return const_instr("OP_DEFINE_GLOBAL", seq, offset);
+      return global_instr("OP_DEFINE_GLOBAL", seq, offset);
     case OP_SET_GLOBAL:
-      return const_instr("OP_SET_GLOBAL", seq, offset);
+      return global_instr("OP_SET_GLOBAL", seq, offset);
     case OP_GET_UPVALUE:
       return byte_instr("OP_GET_UPVALUE", seq, offset);
     case OP_SET_UPVALUE:
       return byte_instr("OP_SET_UPVALUE", seq, offset);
     case OP_GET_PROPERTY:
-      return const_instr("OP_GET_PROPERTY", seq, offset);
+      return property_instr("OP_GET_PROPERTY", seq, offset);
     case OP_SET_PROPERTY:
-      return const_instr("OP_SET_PROPERTY", seq, offset);
+      return property_instr("OP_SET_PROPERTY", seq, offset);
     case OP_GET_SUPER:
       return const_instr("OP_GET_SUPER", seq, offset);
     case OP_EQUAL:
@@ -149,6 +345,102 @@ int disassemble_instr(ByteSequence *seq, int offset) {
       return simple_instr("OP_INHERIT", offset);
     case OP_METHOD:
       return const_instr("OP_METHOD", seq, offset);
+    case OP_CONSTANT_LONG:
+      return const_long_instr("OP_CONSTANT_LONG", seq, offset);
+    case OP_GET_LOCAL_LONG:
+      return short_instr("OP_GET_LOCAL_LONG", seq, offset);
+    case OP_SET_LOCAL_LONG:
+      return short_instr("OP_SET_LOCAL_LONG", seq, offset);
+    case OP_GET_UPVALUE_LONG:
+      return short_instr("OP_GET_UPVALUE_LONG", seq, offset);
+    case OP_SET_UPVALUE_LONG:
+      return short_instr("OP_SET_UPVALUE_LONG", seq, offset);
+    case OP_JUMP_FAR:
+      return jump_instr("OP_JUMP_FAR", seq, offset);
+    case OP_JUMP_IF_FALSE_FAR:
+      return jump_instr("OP_JUMP_IF_FALSE_FAR", seq, offset);
+    case OP_JUMP_IF_FALSE_POP_FAR:
+      return jump_instr("OP_JUMP_IF_FALSE_POP_FAR", seq, offset);
+    case OP_LOOP_FAR:
+      return loop_instr("OP_LOOP_FAR", seq, offset);
+    case OP_GET_PROPERTY_LONG:
+      return property_long_instr("OP_GET_PROPERTY_LONG", seq, offset);
+    case OP_SET_PROPERTY_LONG:
+      return property_long_instr("OP_SET_PROPERTY_LONG", seq, offset);
+    case OP_GET_SUPER_LONG:
+      return const_long_instr("OP_GET_SUPER_LONG", seq, offset);
+    case OP_INVOKE_LONG:
+      return invoke_long_instr("OP_INVOKE_LONG", seq, offset);
+    case OP_SUPER_INVOKE_LONG:
+      return invoke_long_instr("OP_SUPER_INVOKE_LONG", seq, offset);
+    case OP_TAIL_INVOKE_LONG:
+      return invoke_long_instr("OP_TAIL_INVOKE_LONG", seq, offset);
+    case OP_TAIL_SUPER_INVOKE_LONG:
+      return invoke_long_instr("OP_TAIL_SUPER_INVOKE_LONG", seq, offset);
+    case OP_CLASS_LONG:
+      return const_long_instr("OP_CLASS_LONG", seq, offset);
+    case OP_METHOD_LONG:
+      return const_long_instr("OP_METHOD_LONG", seq, offset);
+    case OP_GET_LOCAL_LOCAL:
+      return local_local_instr("OP_GET_LOCAL_LOCAL", seq, offset);
+    case OP_GET_LOCAL_CONSTANT:
+      return local_const_instr("OP_GET_LOCAL_CONSTANT", seq, offset);
+    case OP_GET_LOCAL_PROPERTY:
+      return local_property_instr("OP_GET_LOCAL_PROPERTY", seq, offset);
+    case OP_SET_LOCAL_POP:
+      return byte_instr("OP_SET_LOCAL_POP", seq, offset);
+    case OP_JUMP_IF_FALSE_POP:
+      return jump_instr("OP_JUMP_IF_FALSE_POP", seq, offset);
+    case OP_JUMP_IF_TRUE_POP:
+      return jump_instr("OP_JUMP_IF_TRUE_POP", seq, offset);
+    case OP_ADD_RR:
+      return register_instr("OP_ADD_RR", false, seq, offset);
+    case OP_ADD_RK:
+      return register_instr("OP_ADD_RK", true, seq, offset);
+    case OP_SUBTRACT_RR:
+      return register_instr("OP_SUBTRACT_RR", false, seq, offset);
+    case OP_SUBTRACT_RK:
+      return register_instr("OP_SUBTRACT_RK", true, seq, offset);
+    case OP_MULTIPLY_RR:
+      return register_instr("OP_MULTIPLY_RR", false, seq, offset);
+    case OP_MULTIPLY_RK:
+      return register_instr("OP_MULTIPLY_RK", true, seq, offset);
+    case OP_DIVIDE_RR:
+      return register_instr("OP_DIVIDE_RR", false, seq, offset);
+    case OP_DIVIDE_RK:
+      return register_instr("OP_DIVIDE_RK", true, seq, offset);
+    case OP_LESS_RR:
+      return register_instr("OP_LESS_RR", false, seq, offset);
+    case OP_LESS_RK:
+      return register_instr("OP_LESS_RK", true, seq, offset);
+    case OP_GREATER_RR:
+      return register_instr("OP_GREATER_RR", false, seq, offset);
+    case OP_GREATER_RK:
+      return register_instr("OP_GREATER_RK", true, seq, offset);
+    case OP_GET_FIELD:
+      return property_instr("OP_GET_FIELD", seq, offset);
+    case OP_SET_FIELD:
+      return property_instr("OP_SET_FIELD", seq, offset);
+    case OP_GET_LOCAL_FIELD:
+      return local_property_instr("OP_GET_LOCAL_FIELD", seq, offset);
+    case OP_GET_FIELD_LONG:
+      return property_long_instr("OP_GET_FIELD_LONG", seq, offset);
+    case OP_SET_FIELD_LONG:
+      return property_long_instr("OP_SET_FIELD_LONG", seq, offset);
+    case OP_GREATER_NUM:
+      return simple_instr("OP_GREATER_NUM", offset);
+    case OP_LESS_NUM:
+      return simple_instr("OP_LESS_NUM", offset);
+    case OP_ADD_NUM:
+      return simple_instr("OP_ADD_NUM", offset);
+    case OP_ADD_STR:
+      return simple_instr("OP_ADD_STR", offset);
+    case OP_SUBTRACT_NUM:
+      return simple_instr("OP_SUBTRACT_NUM", offset);
+    case OP_MULTIPLY_NUM:
+      return simple_instr("OP_MULTIPLY_NUM", offset);
+    case OP_DIVIDE_NUM:
+      return simple_instr("OP_DIVIDE_NUM", offset);
     default:
       printf("Unknown opcode %d\n", instr);
       return offset + 1;
@@ -0,0 +1,709 @@
+#define _DEFAULT_SOURCE
+
+#include "jit.h"
+
+#ifdef JIT
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "bytecode.h"
+#include "object.h"
+#include "value.h"
+#include "vm.h"
+
+// Register assignment inside compiled code:
+//   rbx  the CallFrame being executed
+//   r12  &vm.top
+//   r13  frame->slots
+// Values only live on the VM stack between instructions, so the collector
+// finds every root without knowing about native code. A call that pushes a
+// frame may move both stacks, so native code leaves right after one.
+
+#define PROLOGUE_BYTES 64
+#define MAX_BYTES_PER_CODE_BYTE 128
+
+#define EMIT(as, ...)                            \
+  emit_seq((as), (const uint8_t[]){__VA_ARGS__}, \
+           sizeof((const uint8_t[]){__VA_ARGS__}))
+
+typedef int (*JitFn)(CallFrame* frame, uint8_t* target);
+
+typedef struct {
+  size_t at;   // position of a rel32 operand
+  int target;  // bytecode offset it jumps to
+} JumpFixup;
+
+typedef struct {
+  uint8_t* code;
+  size_t size;
+  size_t capacity;
+  bool overflow;  // set once an emit didn't fit, the result is then discarded
+  size_t epilogue;
+  JumpFixup* fixups;
+  int fixup_cnt;
+  int fixup_capacity;
+} Assembler;
+
+static void emit_seq(Assembler* as, const uint8_t* bytes, size_t cnt) {
+  if (cnt > as->capacity - as->size) {
+    as->overflow = true;
+    return;
+  }
+  memcpy(as->code + as->size, bytes, cnt);
+  as->size += cnt;
+}
+
+static void emit32(Assembler* as, uint32_t value) {
+  emit_seq(as, (const uint8_t*)&value, sizeof(value));
+}
+
+static void emit64(Assembler* as, uint64_t value) {
+  emit_seq(as, (const uint8_t*)&value, sizeof(value));
+}
+
+static void emit_rel32_to(Assembler* as, size_t target) {
+  emit32(as, (uint32_t)(int32_t)((ptrdiff_t)target -
+                                 (ptrdiff_t)(as->size + sizeof(uint32_t))));
+}
+
+/** Emits the opcode of a short conditional jump and returns its patch site. */
+static size_t emit_jcc8(Assembler* as, uint8_t opcode) {
+  EMIT(as, opcode, 0x00);
+  return as->size - 1;
+}
+
+static void patch_jcc8(Assembler* as, size_t at) {
+  as->code[at] = (uint8_t)(as->size - at - 1);
+}
+
+static void emit_jump_fixup(Assembler* as, int target) {
+  if (as->fixup_cnt == as->fixup_capacity) {
+    as->overflow = true;
+    return;
+  }
+  as->fixups[as->fixup_cnt].at = as->size;
+  as->fixups[as->fixup_cnt].target = target;
+  as->fixup_cnt++;
+  emit32(as, 0);
+}
+
+static void emit_load_slots(Assembler* as) {
+  EMIT(as, 0x4c, 0x8b, 0x6b,  // mov r13, [rbx + slots]
+       (uint8_t)offsetof(CallFrame, slots));
+}
+
+static void emit_prologue(Assembler* as) {
+  EMIT(as, 0x53);              // push rbx
+  EMIT(as, 0x41, 0x54);        // push r12
+  EMIT(as, 0x41, 0x55);        // push r13
+  EMIT(as, 0x48, 0x89, 0xfb);  // mov rbx, rdi
+  EMIT(as, 0x49, 0xbc);        // mov r12, &vm.top
+  emit64(as, (uint64_t)(uintptr_t)&vm.top);
+  emit_load_slots(as);
+  EMIT(as, 0xff, 0xe6);  // jmp rsi
+
+  as->epilogue = as->size;
+  EMIT(as, 0x41, 0x5d);  // pop r13
+  EMIT(as, 0x41, 0x5c);  // pop r12
+  EMIT(as, 0x5b);        // pop rbx
+  EMIT(as, 0xc3);        // ret
+}
+
+static void emit_store_ip(Assembler* as, uint8_t* ip) {
+  EMIT(as, 0x48, 0xb8);  // mov rax, ip
+  emit64(as, (uint64_t)(uintptr_t)ip);
+  EMIT(as, 0x48, 0x89, 0x43,  // mov [rbx + ip], rax
+       (uint8_t)offsetof(CallFrame, ip));
+}
+
+/**
+ * Calls a runtime helper for the instruction whose operands start at
+ * `operands` and leaves the native code with its status unless it is
+ * JIT_CONTINUE.
+ */
+static void emit_helper(Assembler* as, uint8_t* operands, void (*helper)(void),
+                        bool has_arg, int arg) {
+  emit_store_ip(as, operands);
+  EMIT(as, 0x48, 0x89, 0xdf);  // mov rdi, rbx
+  if (has_arg) {
+    EMIT(as, 0xbe);  // mov esi, arg
+    emit32(as, (uint32_t)arg);
+  }
+  EMIT(as, 0x48, 0xb8);  // mov rax, helper
+  emit64(as, (uint64_t)(uintptr_t)helper);
+  EMIT(as, 0xff, 0xd0);        // call rax
+  EMIT(as, 0x85, 0xc0);        // test eax, eax
+  EMIT(as, 0x0f, 0x85);        // jnz epilogue
+  emit_rel32_to(as, as->epilogue);
+}
+
+#define HELPER(fn) ((void (*)(void))(fn))
+
+static void emit_exit(Assembler* as, uint8_t* ip) {
+  emit_store_ip(as, ip);
+  EMIT(as, 0xb8);  // mov eax, JIT_INTERPRET
+  emit32(as, JIT_INTERPRET);
+  EMIT(as, 0xe9);  // jmp epilogue
+  emit_rel32_to(as, as->epilogue);
+}
+
+static void emit_push_imm(Assembler* as, Value value) {
+  EMIT(as, 0x49, 0x8b, 0x04, 0x24);  // mov rax, [r12]
+  EMIT(as, 0x48, 0xb9);              // mov rcx, value
+  emit64(as, (uint64_t)value);
+  EMIT(as, 0x48, 0x89, 0x08);              // mov [rax], rcx
+  EMIT(as, 0x49, 0x83, 0x04, 0x24, 0x08);  // add qword [r12], 8
+}
+
+/**
+ * Loads the two topmost values into rdx (a) and rcx (b) and jumps to the
+ * returned patch site unless both are numbers.
+ */
+static void emit_number_guard(Assembler* as, size_t* not_a, size_t* not_b) {
+  EMIT(as, 0x49, 0x8b, 0x04, 0x24);  // mov rax, [r12]
+  EMIT(as, 0x48, 0x8b, 0x48, 0xf8);  // mov rcx, [rax - 8]
+  EMIT(as, 0x48, 0x8b, 0x50, 0xf0);  // mov rdx, [rax - 16]
+  EMIT(as, 0x48, 0xbe);              // mov rsi, QNAN
+  emit64(as, QNAN);
+  EMIT(as, 0x48, 0x89, 0xcf);  // mov rdi, rcx
+  EMIT(as, 0x48, 0x21, 0xf7);  // and rdi, rsi
+  EMIT(as, 0x48, 0x39, 0xf7);  // cmp rdi, rsi
+  *not_b = emit_jcc8(as, 0x74);
+  EMIT(as, 0x48, 0x89, 0xd7);  // mov rdi, rdx
+  EMIT(as, 0x48, 0x21, 0xf7);  // and rdi, rsi
+  EMIT(as, 0x48, 0x39, 0xf7);  // cmp rdi, rsi
+  *not_a = emit_jcc8(as, 0x74);
+  EMIT(as, 0x66, 0x48, 0x0f, 0x6e, 0xc2);  // movq xmm0, rdx
+  EMIT(as, 0x66, 0x48, 0x0f, 0x6e, 0xc9);  // movq xmm1, rcx
+}
+
+static void emit_binary(Assembler* as, uint8_t* ip, int op) {
+  size_t not_a;
+  size_t not_b;
+  emit_number_guard(as, &not_a, &not_b);
+  switch (op) {
+    case OP_ADD:
+      EMIT(as, 0xf2, 0x0f, 0x58, 0xc1);  // addsd xmm0, xmm1
+      break;
+    case OP_SUBTRACT:
+      EMIT(as, 0xf2, 0x0f, 0x5c, 0xc1);  // subsd xmm0, xmm1
+      break;
+    case OP_MULTIPLY:
+      EMIT(as, 0xf2, 0x0f, 0x59, 0xc1);  // mulsd xmm0, xmm1
+      break;
+    case OP_DIVIDE:
+      EMIT(as, 0xf2, 0x0f, 0x5e, 0xc1);  // divsd xmm0, xmm1
+      break;
+    case OP_LESS:
+    case OP_GREATER:
+      if (op == OP_LESS) {
+        EMIT(as, 0x66, 0x0f, 0x2e, 0xc8);  // ucomisd xmm1, xmm0
+      } else {
+        EMIT(as, 0x66, 0x0f, 0x2e, 0xc1);  // ucomisd xmm0, xmm1
+      }
+      EMIT(as, 0x40, 0x0f, 0x97, 0xc7);  // seta dil
+      EMIT(as, 0x40, 0x0f, 0xb6, 0xff);  // movzx edi, dil
+      EMIT(as, 0x48, 0xbe);              // mov rsi, FALSE_VAL
+      emit64(as, FALSE_VAL);
+      EMIT(as, 0x48, 0x09, 0xf7);  // or rdi, rsi (false | 1 is true)
+      break;
+    default:
+      break;
+  }
+  if (op != OP_LESS && op != OP_GREATER) {
+    EMIT(as, 0x66, 0x48, 0x0f, 0x7e, 0xc7);  // movq rdi, xmm0
+  }
+  EMIT(as, 0x48, 0x89, 0x78, 0xf0);        // mov [rax - 16], rdi
+  EMIT(as, 0x49, 0x83, 0x2c, 0x24, 0x08);  // sub qword [r12], 8
+  size_t done = emit_jcc8(as, 0xeb);
+
+  patch_jcc8(as, not_a);
+  patch_jcc8(as, not_b);
+  emit_helper(as, ip + 1, HELPER(jit_binary), true, op);
+  patch_jcc8(as, done);
+}
+
+static void emit_get_global(Assembler* as, uint8_t* ip, uint16_t slot) {
+  EMIT(as, 0x48, 0xb8);  // mov rax, &vm.global_vals.vals
+  emit64(as, (uint64_t)(uintptr_t)&vm.global_vals.vals);
+  EMIT(as, 0x48, 0x8b, 0x00);  // mov rax, [rax]
+  EMIT(as, 0x48, 0x8b, 0x88);  // mov rcx, [rax + slot * 8]
+  emit32(as, (uint32_t)slot * sizeof(Value));
+  EMIT(as, 0x48, 0xba);  // mov rdx, EMPTY_VAL
+  emit64(as, EMPTY_VAL);
+  EMIT(as, 0x48, 0x39, 0xd1);  // cmp rcx, rdx
+  size_t undefined = emit_jcc8(as, 0x74);
+  EMIT(as, 0x49, 0x8b, 0x04, 0x24);        // mov rax, [r12]
+  EMIT(as, 0x48, 0x89, 0x08);              // mov [rax], rcx
+  EMIT(as, 0x49, 0x83, 0x04, 0x24, 0x08);  // add qword [r12], 8
+  size_t done = emit_jcc8(as, 0xeb);
+
+  patch_jcc8(as, undefined);
+  emit_helper(as, ip + 1, HELPER(jit_get_global), false, 0);
+  patch_jcc8(as, done);
+}
+
+static void emit_get_local(Assembler* as, int slot) {
+  EMIT(as, 0x49, 0x8b, 0x04, 0x24);  // mov rax, [r12]
+  EMIT(as, 0x49, 0x8b, 0x8d);        // mov rcx, [r13 + slot * 8]
+  emit32(as, (uint32_t)slot * sizeof(Value));
+  EMIT(as, 0x48, 0x89, 0x08);              // mov [rax], rcx
+  EMIT(as, 0x49, 0x83, 0x04, 0x24, 0x08);  // add qword [r12], 8
+}
+
+static void emit_set_local(Assembler* as, int slot) {
+  EMIT(as, 0x49, 0x8b, 0x04, 0x24);  // mov rax, [r12]
+  EMIT(as, 0x48, 0x8b, 0x48, 0xf8);  // mov rcx, [rax - 8]
+  EMIT(as, 0x49, 0x89, 0x8d);        // mov [r13 + slot * 8], rcx
+  emit32(as, (uint32_t)slot * sizeof(Value));
+}
+
+/** Loads the value on top of the stack into rcx, popping it if `pop`. */
+static void emit_load_condition(Assembler* as, bool pop) {
+  EMIT(as, 0x49, 0x8b, 0x04, 0x24);  // mov rax, [r12]
+  EMIT(as, 0x48, 0x8b, 0x48, 0xf8);  // mov rcx, [rax - 8]
+  if (pop) {
+    EMIT(as, 0x49, 0x83, 0x2c, 0x24, 0x08);  // sub qword [r12], 8
+  }
+}
+
+static void emit_jump_if_false(Assembler* as, int target, bool pop) {
+  emit_load_condition(as, pop);
+  EMIT(as, 0x48, 0xba);  // mov rdx, NIL_VAL
+  emit64(as, NIL_VAL);
+  EMIT(as, 0x48, 0x39, 0xd1);  // cmp rcx, rdx
+  EMIT(as, 0x0f, 0x84);        // je target
+  emit_jump_fixup(as, target);
+  EMIT(as, 0x48, 0xba);  // mov rdx, FALSE_VAL
+  emit64(as, FALSE_VAL);
+  EMIT(as, 0x48, 0x39, 0xd1);  // cmp rcx, rdx
+  EMIT(as, 0x0f, 0x84);        // je target
+  emit_jump_fixup(as, target);
+}
+
+static void emit_jump_if_true_pop(Assembler* as, int target) {
+  emit_load_condition(as, true);
+  EMIT(as, 0x48, 0xba);  // mov rdx, NIL_VAL
+  emit64(as, NIL_VAL);
+  EMIT(as, 0x48, 0x39, 0xd1);  // cmp rcx, rdx
+  EMIT(as, 0x74, 20);          // je done
+  EMIT(as, 0x48, 0xba);        // mov rdx, FALSE_VAL
+  emit64(as, FALSE_VAL);
+  EMIT(as, 0x48, 0x39, 0xd1);  // cmp rcx, rdx
+  EMIT(as, 0x74, 5);           // je done
+  EMIT(as, 0xe9);              // jmp target
+  emit_jump_fixup(as, target);
+  // done:
+}
+
+/** Emits a register instruction as the stack instructions it replaces. */
+static void emit_register_op(Assembler* as, ByteSequence* bseq, uint8_t* ip,
+                             int op) {
+  // The _RK forms follow their _RR forms in OpCode
+  bool constant = (*ip - OP_ADD_RR) % 2 == 1;
+  emit_get_local(as, ip[2]);
+  if (constant) {
+    emit_push_imm(as, bseq->consts.vals[ip[3]]);
+  } else {
+    emit_get_local(as, ip[3]);
+  }
+  emit_binary(as, ip, op);
+  if (ip[1] != REG_PUSH) {
+    emit_set_local(as, ip[1]);
+    EMIT(as, 0x49, 0x83, 0x2c, 0x24, 0x08);  // sub qword [r12], 8
+  }
+}
+
+/**
+ * Loads the counter of a counted loop into rcx and xmm0 and its limit into
+ * rdx and xmm1.
+ */
+static void emit_load_counted(Assembler* as, ByteSequence* bseq, uint8_t* ip) {
+  EMIT(as, 0x49, 0x8b, 0x8d);  // mov rcx, [r13 + counter * 8]
+  emit32(as, (uint32_t)ip[1] * sizeof(Value));
+  if (ip[3] & FOR_CONST_LIMIT) {
+    EMIT(as, 0x48, 0xba);  // mov rdx, limit
+    emit64(as, bseq->consts.vals[ip[2]]);
+  } else {
+    EMIT(as, 0x49, 0x8b, 0x95);  // mov rdx, [r13 + limit * 8]
+    emit32(as, (uint32_t)ip[2] * sizeof(Value));
+  }
+  EMIT(as, 0x66, 0x48, 0x0f, 0x6e, 0xc1);  // movq xmm0, rcx
+  EMIT(as, 0x66, 0x48, 0x0f, 0x6e, 0xca);  // movq xmm1, rdx
+}
+
+/**
+ * Compares the counter in xmm0 with the limit in xmm1 and emits a jump to
+ * `target` taken when the loop test gives `holds`.
+ */
+static void emit_for_jump(Assembler* as, uint8_t mode, bool holds, int target) {
+  bool less = (mode & FOR_CMP_MASK) == FOR_LESS ||
+              (mode & FOR_CMP_MASK) == FOR_GREATER_EQUAL;
+  if (less) {
+    EMIT(as, 0x66, 0x0f, 0x2e, 0xc8);  // ucomisd xmm1, xmm0
+  } else {
+    EMIT(as, 0x66, 0x0f, 0x2e, 0xc1);  // ucomisd xmm0, xmm1
+  }
+  // An unordered compare fails the strict tests and passes the _EQUAL ones
+  bool strict = (mode & FOR_CMP_MASK) == FOR_LESS ||
+                (mode & FOR_CMP_MASK) == FOR_GREATER;
+  if (strict == holds) {
+    EMIT(as, 0x0f, 0x87);  // ja target
+  } else {
+    EMIT(as, 0x0f, 0x86);  // jbe target
+  }
+  emit_jump_fixup(as, target);
+}
+
+static void emit_for_prep(Assembler* as, ByteSequence* bseq, int offset) {
+  uint8_t* ip = bseq->code + offset;
+  emit_load_counted(as, bseq, ip);
+  EMIT(as, 0x48, 0xbe);  // mov rsi, QNAN
+  emit64(as, QNAN);
+  EMIT(as, 0x48, 0x89, 0xcf);  // mov rdi, rcx
+  EMIT(as, 0x48, 0x21, 0xf7);  // and rdi, rsi
+  EMIT(as, 0x48, 0x39, 0xf7);  // cmp rdi, rsi
+  size_t not_counter = emit_jcc8(as, 0x74);
+  EMIT(as, 0x48, 0x89, 0xd7);  // mov rdi, rdx
+  EMIT(as, 0x48, 0x21, 0xf7);  // and rdi, rsi
+  EMIT(as, 0x48, 0x39, 0xf7);  // cmp rdi, rsi
+  size_t not_limit = emit_jcc8(as, 0x74);
+  emit_for_jump(as, ip[3], false, jump_target(bseq, offset));
+  size_t done = emit_jcc8(as, 0xeb);
+
+  // The interpreter reports the error
+  patch_jcc8(as, not_counter);
+  patch_jcc8(as, not_limit);
+  emit_exit(as, ip);
+  patch_jcc8(as, done);
+}
+
+/**
+ * Charges a loop iteration and jumps back to the header of the loop ending at
+ * `offset`, or leaves for the interpreter there once the fuel is used up.
+ */
+static void emit_back_edge(Assembler* as, ByteSequence* bseq, int offset) {
+  int target = back_edge_target(bseq, offset);
+  EMIT(as, 0x48, 0xb8);  // mov rax, &vm.fuel
+  emit64(as, (uint64_t)(uintptr_t)&vm.fuel);
+  EMIT(as, 0x48, 0x83, 0x28, 0x01);  // sub qword [rax], 1
+  EMIT(as, 0x0f, 0x8f);              // jg target
+  emit_jump_fixup(as, target);
+  emit_exit(as, bseq->code + target);
+}
+
+static void emit_for_loop(Assembler* as, ByteSequence* bseq, int offset) {
+  uint8_t* ip = bseq->code + offset;
+  EMIT(as, 0x49, 0x8b, 0x8d);  // mov rcx, [r13 + counter * 8]
+  emit32(as, (uint32_t)ip[1] * sizeof(Value));
+  EMIT(as, 0x66, 0x48, 0x0f, 0x6e, 0xc1);  // movq xmm0, rcx
+  EMIT(as, 0x48, 0xb8);                    // mov rax, step
+  emit64(as, bseq->consts.vals[ip[4]]);
+  EMIT(as, 0x66, 0x48, 0x0f, 0x6e, 0xc8);  // movq xmm1, rax
+  EMIT(as, 0xf2, 0x0f, 0x58, 0xc1);        // addsd xmm0, xmm1
+  EMIT(as, 0x66, 0x48, 0x0f, 0x7e, 0xc1);  // movq rcx, xmm0
+  EMIT(as, 0x49, 0x89, 0x8d);              // mov [r13 + counter * 8], rcx
+  emit32(as, (uint32_t)ip[1] * sizeof(Value));
+  emit_load_counted(as, bseq, ip);
+  emit_for_jump(as, ip[3], false, offset + instr_size(bseq, offset));
+  emit_back_edge(as, bseq, offset);
+}
+
+static void emit_instr(Assembler* as, ByteSequence* bseq, int offset) {
+  uint8_t* ip = bseq->code + offset;
+  switch (*ip) {
+    case OP_CONSTANT:
+      emit_push_imm(as, bseq->consts.vals[ip[1]]);
+      break;
+    case OP_CONSTANT_LONG:
+      emit_push_imm(as,
+                    bseq->consts.vals[(ip[1] << 16) | (ip[2] << 8) | ip[3]]);
+      break;
+    case OP_NIL:
+      emit_push_imm(as, NIL_VAL);
+      break;
+    case OP_TRUE:
+      emit_push_imm(as, TRUE_VAL);
+      break;
+    case OP_FALSE:
+      emit_push_imm(as, FALSE_VAL);
+      break;
+    case OP_POP:
+      EMIT(as, 0x49, 0x83, 0x2c, 0x24, 0x08);  // sub qword [r12], 8
+      break;
+    case OP_GET_LOCAL:
+      emit_get_local(as, ip[1]);
+      break;
+    case OP_SET_LOCAL:
+      emit_set_local(as, ip[1]);
+      break;
+    case OP_GET_LOCAL_LONG:
+      emit_get_local(as, (ip[1] << 8) | ip[2]);
+      break;
+    case OP_SET_LOCAL_LONG:
+      emit_set_local(as, (ip[1] << 8) | ip[2]);
+      break;
+    case OP_GET_LOCAL_LOCAL:
+      emit_get_local(as, ip[1]);
+      emit_get_local(as, ip[2]);
+      break;
+    case OP_GET_LOCAL_CONSTANT:
+      emit_get_local(as, ip[1]);
+      emit_push_imm(as, bseq->consts.vals[ip[2]]);
+      break;
+    case OP_SET_LOCAL_POP:
+      emit_set_local(as, ip[1]);
+      EMIT(as, 0x49, 0x83, 0x2c, 0x24, 0x08);  // sub qword [r12], 8
+      break;
+    case OP_GET_GLOBAL:
+      emit_get_global(as, ip, (uint16_t)((ip[1] << 8) | ip[2]));
+      break;
+    case OP_DEFINE_GLOBAL:
+      emit_helper(as, ip + 1, HELPER(jit_define_global), false, 0);
+      break;
+    case OP_SET_GLOBAL:
+      emit_helper(as, ip + 1, HELPER(jit_set_global), false, 0);
+      break;
+    case OP_GET_UPVALUE:
+      emit_helper(as, ip + 1, HELPER(jit_get_upvalue), false, 0);
+      break;
+    case OP_SET_UPVALUE:
+      emit_helper(as, ip + 1, HELPER(jit_set_upvalue), false, 0);
+      break;
+    case OP_GET_PROPERTY:
+    case OP_GET_FIELD:
+      emit_helper(as, ip + 1, HELPER(jit_get_property), false, 0);
+      break;
+    case OP_GET_LOCAL_PROPERTY:
+    case OP_GET_LOCAL_FIELD:
+      emit_get_local(as, ip[1]);
+      emit_helper(as, ip + 2, HELPER(jit_get_property), false, 0);
+      break;
+    case OP_SET_PROPERTY:
+    case OP_SET_FIELD:
+      emit_helper(as, ip + 1, HELPER(jit_set_property), false, 0);
+      break;
+    case OP_EQUAL:
+      emit_helper(as, ip + 1, HELPER(jit_equal), false, 0);
+      break;
+    case OP_GREATER:
+    case OP_GREATER_NUM:
+      emit_binary(as, ip, OP_GREATER);
+      break;
+    case OP_LESS:
+    case OP_LESS_NUM:
+      emit_binary(as, ip, OP_LESS);
+      break;
+    case OP_ADD:
+    case OP_ADD_NUM:
+    case OP_ADD_STR:
+      emit_binary(as, ip, OP_ADD);
+      break;
+    case OP_SUBTRACT:
+    case OP_SUBTRACT_NUM:
+      emit_binary(as, ip, OP_SUBTRACT);
+      break;
+    case OP_MULTIPLY:
+    case OP_MULTIPLY_NUM:
+      emit_binary(as, ip, OP_MULTIPLY);
+      break;
+    case OP_DIVIDE:
+    case OP_DIVIDE_NUM:
+      emit_binary(as, ip, OP_DIVIDE);
+      break;
+    case OP_ADD_RR:
+    case OP_ADD_RK:
+      emit_register_op(as, bseq, ip, OP_ADD);
+      break;
+    case OP_SUBTRACT_RR:
+    case OP_SUBTRACT_RK:
+      emit_register_op(as, bseq, ip, OP_SUBTRACT);
+      break;
+    case OP_MULTIPLY_RR:
+    case OP_MULTIPLY_RK:
+      emit_register_op(as, bseq, ip, OP_MULTIPLY);
+      break;
+    case OP_DIVIDE_RR:
+    case OP_DIVIDE_RK:
+      emit_register_op(as, bseq, ip, OP_DIVIDE);
+      break;
+    case OP_LESS_RR:
+    case OP_LESS_RK:
+      emit_register_op(as, bseq, ip, OP_LESS);
+      break;
+    case OP_GREATER_RR:
+    case OP_GREATER_RK:
+      emit_register_op(as, bseq, ip, OP_GREATER);
+      break;
+    case OP_NOT:
+      emit_helper(as, ip + 1, HELPER(jit_not), false, 0);
+      break;
+    case OP_NEGATE:
+      emit_helper(as, ip + 1, HELPER(jit_negate), false, 0);
+      break;
+    case OP_PRINT:
+      emit_helper(as, ip + 1, HELPER(jit_print), false, 0);
+      break;
+    case OP_JUMP:
+    case OP_JUMP_FAR:
+      EMIT(as, 0xe9);  // jmp target
+      emit_jump_fixup(as, jump_target(bseq, offset));
+      break;
+    case OP_JUMP_IF_FALSE:
+    case OP_JUMP_IF_FALSE_FAR:
+      emit_jump_if_false(as, jump_target(bseq, offset), false);
+      break;
+    case OP_JUMP_IF_FALSE_POP:
+    case OP_JUMP_IF_FALSE_POP_FAR:
+      emit_jump_if_false(as, jump_target(bseq, offset), true);
+      break;
+    case OP_JUMP_IF_TRUE_POP:
+      emit_jump_if_true_pop(as, jump_target(bseq, offset));
+      break;
+    case OP_LOOP:
+    case OP_LOOP_FAR:
+      emit_back_edge(as, bseq, offset);
+      break;
+    case OP_FOR_PREP:
+      emit_for_prep(as, bseq, offset);
+      break;
+    case OP_FOR_LOOP:
+      emit_for_loop(as, bseq, offset);
+      break;
+    case OP_CALL:
+      emit_helper(as, ip + 1, HELPER(jit_call), false, 0);
+      break;
+    case OP_TAIL_CALL:
+      emit_helper(as, ip + 1, HELPER(jit_tail_call), false, 0);
+      break;
+    case OP_INTRINSIC:
+      emit_helper(as, ip + 1, HELPER(jit_intrinsic), false, 0);
+      break;
+    case OP_INVOKE:
+      emit_helper(as, ip + 1, HELPER(jit_invoke), false, 0);
+      break;
+    case OP_SUPER_INVOKE:
+      emit_helper(as, ip + 1, HELPER(jit_super_invoke), false, 0);
+      break;
+    case OP_TAIL_INVOKE:
+      emit_helper(as, ip + 1, HELPER(jit_tail_invoke), false, 0);
+      break;
+    case OP_TAIL_SUPER_INVOKE:
+      emit_helper(as, ip + 1, HELPER(jit_tail_super_invoke), false, 0);
+      break;
+    // Entering and leaving an inlined body moves frame->slots
+    case OP_INLINE_CALL:
+      emit_helper(as, ip + 1, HELPER(jit_inline_call), false, 0);
+      emit_load_slots(as);
+      break;
+    case OP_INLINE_INVOKE:
+      emit_helper(as, ip + 1, HELPER(jit_inline_invoke), false, 0);
+      emit_load_slots(as);
+      break;
+    case OP_INLINE_RETURN:
+      emit_helper(as, ip + 1, HELPER(jit_inline_return), false, 0);
+      emit_load_slots(as);
+      break;
+    case OP_CLOSURE:
+    case OP_CLOSURE_LONG:
+      emit_helper(as, ip + 1, HELPER(jit_closure), false, 0);
+      break;
+    case OP_CLOSE_UPVALUE:
+      emit_helper(as, ip + 1, HELPER(jit_close_upvalue), false, 0);
+      break;
+    default:
+      // Returns and class definitions go back to the interpreter
+      emit_exit(as, ip);
+      break;
+  }
+}
+
+void jit_compile(ObjFunction* function) {
+  ByteSequence* bseq = &function->bseq;
+  Assembler as;
+  as.size = 0;
+  as.capacity = PROLOGUE_BYTES + (size_t)bseq->size * MAX_BYTES_PER_CODE_BYTE;
+  as.overflow = false;
+  as.fixup_cnt = 0;
+  as.fixup_capacity = 2 * bseq->size;
+  as.code = malloc(as.capacity);
+  as.fixups = malloc(sizeof(JumpFixup) * (size_t)as.fixup_capacity);
+  uint32_t* entries = calloc((size_t)bseq->size, sizeof(uint32_t));
+  if (as.code == NULL || as.fixups == NULL || entries == NULL) {
+    free(as.code);
+    free(as.fixups);
+    free(entries);
+    return;
+  }
+
+  emit_prologue(&as);
+  for (int offset = 0; offset < bseq->size;
+       offset += instr_size(bseq, offset)) {
+    entries[offset] = (uint32_t)as.size;
+    emit_instr(&as, bseq, offset);
+  }
+  // The estimate is per byte of bytecode, so a function made mostly of the
+  // largest instructions can outgrow it and then stays interpreted
+  if (as.overflow) {
+    free(as.code);
+    free(as.fixups);
+    free(entries);
+    return;
+  }
+  for (int i = 0; i < as.fixup_cnt; i++) {
+    size_t end = as.size;
+    as.size = as.fixups[i].at;
+    emit_rel32_to(&as, entries[as.fixups[i].target]);
+    as.size = end;
+  }
+
+  uint8_t* code = mmap(NULL, as.size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (code == MAP_FAILED) {
+    free(as.code);
+    free(as.fixups);
+    free(entries);
+    return;
+  }
+  memcpy(code, as.code, as.size);
+  free(as.code);
+  free(as.fixups);
+  // The function stays interpreted if its code can't be made executable
+  if (mprotect(code, as.size, PROT_READ | PROT_EXEC) != 0) {
+    munmap(code, as.size);
+    free(entries);
+    return;
+  }
+
+  JitCode* jit = malloc(sizeof(JitCode));
+  if (jit == NULL) {
+    munmap(code, as.size);
+    free(entries);
+    return;
+  }
+  jit->code = code;
+  jit->size = as.size;
+  jit->entries = entries;
+  function->jit = jit;
+}
+
+void jit_free(JitCode* jit) {
+  munmap(jit->code, jit->size);
+  free(jit->entries);
+  free(jit);
+}
+
+JitStatus jit_execute(JitCode* jit, CallFrame* frame) {
+  uint32_t entry = jit->entries[frame->ip - frame->closure->function->bseq.code];
+  if (entry == 0) {
+    return JIT_INTERPRET;
+  }
+  JitFn fn;
+  memcpy(&fn, &jit->code, sizeof(fn));
+  return (JitStatus)fn(frame, jit->code + entry);
+}
+
+#endif
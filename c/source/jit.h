@@ -0,0 +1,59 @@
+#pragma once
+
+#include "common.h"
+
+#ifdef JIT
+
+#include "object.h"
+#include "vm.h"
+
+// Calls plus loop back-edges after which a function gets compiled
+#ifndef JIT_THRESHOLD
+#define JIT_THRESHOLD 1000
+#endif
+
+typedef enum {
+  JIT_CONTINUE,   // keep running native code
+  JIT_EXIT,       // a call pushed a new frame, resume with the top frame
+  JIT_INTERPRET,  // interpret from the frame's ip
+  JIT_ERROR,      // a runtime error was reported
+} JitStatus;
+
+struct JitCode {
+  uint8_t* code;
+  size_t size;
+  uint32_t* entries;  // bytecode offset -> native offset, 0 if none
+};
+
+void jit_compile(ObjFunction* function);
+void jit_free(JitCode* jit);
+JitStatus jit_execute(JitCode* jit, CallFrame* frame);
+
+// Runtime helpers called from native code, implemented in vm.c. Each runs
+// one instruction whose operands start at frame->ip, like its case in run().
+int jit_get_global(CallFrame* frame);
+int jit_define_global(CallFrame* frame);
+int jit_set_global(CallFrame* frame);
+int jit_get_upvalue(CallFrame* frame);
+int jit_set_upvalue(CallFrame* frame);
+int jit_get_property(CallFrame* frame);
+int jit_set_property(CallFrame* frame);
+int jit_equal(CallFrame* frame);
+int jit_binary(CallFrame* frame, int op);
+int jit_not(CallFrame* frame);
+int jit_negate(CallFrame* frame);
+int jit_print(CallFrame* frame);
+int jit_call(CallFrame* frame);
+int jit_intrinsic(CallFrame* frame);
+int jit_tail_call(CallFrame* frame);
+int jit_invoke(CallFrame* frame);
+int jit_super_invoke(CallFrame* frame);
+int jit_tail_invoke(CallFrame* frame);
+int jit_tail_super_invoke(CallFrame* frame);
+int jit_inline_call(CallFrame* frame);
+int jit_inline_invoke(CallFrame* frame);
+int jit_inline_return(CallFrame* frame);
+int jit_closure(CallFrame* frame);
+int jit_close_upvalue(CallFrame* frame);
+
+#endif
@@ -7,6 +7,8 @@
 /** A primitive REPL with a hardcoded line length limit */
 static void repl(void) {
   char line[1024];
+  // Lines are compiled one at a time, where optimizing gains little
+  vm.opt_level = 0;
   for (;;) {
     printf("> ");
 
@@ -48,7 +50,17 @@ static char* read_file(const char* path) {
 
 static void run_file(const char* path) {
   char* src = read_file(path);
+  // LANG_FUEL runs the program in slices of that many calls and iterations
+  const char* slice = getenv("LANG_FUEL");
+  int64_t fuel = slice != NULL ? strtoll(slice, NULL, 10) : 0;
+  if (fuel > 0) {
+    set_fuel(fuel);
+  }
   InterpretResult result = interpret(src);
+  while (result == INTERPRET_SUSPENDED) {
+    set_fuel(fuel);
+    result = resume();
+  }
   free(src);
 
   if (result == INTERPRET_COMPILE_ERROR) {
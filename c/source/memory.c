@@ -4,6 +4,7 @@
 
 #include "bytecode.h"
 #include "compile.h"
+#include "jit.h"
 #include "object.h"
 #include "table.h"
 #include "value.h"
@@ -99,7 +100,12 @@ static void blacken_object(Obj* object) {
       ObjClosure* closure = (ObjClosure*)object;
       mark_object((Obj*)closure->function);
       for (int i = 0; i < closure->upvalue_cnt; i++) {
-        mark_object((Obj*)closure->upvalues[i]);
+        if (!is_cell(closure, closure->upvalues[i])) {
+          mark_object((Obj*)closure->upvalues[i]);
+        }
+      }
+      for (int i = 0; i < closure->cell_cnt; i++) {
+        mark_value(closure->cells[i].closed);
       }
       break;
     }
@@ -107,12 +113,29 @@ static void blacken_object(Obj* object) {
       ObjFunction* function = (ObjFunction*)object;
       mark_object((Obj*)function->name);
       mark_arr(&function->bseq.consts);
+      for (int i = 0; i < function->bseq.invoke_cache_cnt; i++) {
+        InvokeCache* cache = &function->bseq.invoke_caches[i];
+        for (int j = 0; j < cache->cnt; j++) {
+          mark_object((Obj*)cache->entries[j].cls);
+          mark_object((Obj*)cache->entries[j].method);
+        }
+      }
       break;
     }
     case OBJ_INSTANCE: {
       ObjInstance* instance = (ObjInstance*)object;
       mark_object((Obj*)instance->cls);
-      mark_table(&instance->fields);
+      mark_object((Obj*)instance->shape);
+      for (int i = 0; i < instance->shape->field_cnt; i++) {
+        mark_value(instance->fields[i]);
+      }
+      break;
+    }
+    case OBJ_SHAPE: {
+      ObjShape* shape = (ObjShape*)object;
+      mark_object((Obj*)shape->parent);
+      mark_object((Obj*)shape->name);
+      mark_table(&shape->transitions);
       break;
     }
     case OBJ_UPVALUE:
@@ -141,13 +164,19 @@ static void free_object(Obj* object) {
     }
     case OBJ_CLOSURE: {
       ObjClosure* closure = (ObjClosure*)object;
-      FREE_ARR(ObjUpvalue*, closure->upvalues, closure->upvalue_cnt);
+      FREE_ARR(uint8_t, closure->upvalues,
+               UPVALUE_BLOCK_SIZE(closure->upvalue_cnt, closure->cell_cnt));
       FREE(ObjClosure, object);
       break;
     }
     case OBJ_FUNCTION: {
       ObjFunction* function = (ObjFunction*)object;
       free_bsequence(&function->bseq);
+#ifdef JIT
+      if (function->jit != NULL) {
+        jit_free(function->jit);
+      }
+#endif
       FREE(ObjFunction, object);
       break;
     }
@@ -159,10 +188,16 @@ static void free_object(Obj* object) {
     }
     case OBJ_INSTANCE: {
       ObjInstance* instance = (ObjInstance*)object;
-      free_table(&instance->fields);
+      FREE_ARR(Value, instance->fields, instance->field_capacity);
       FREE(ObjInstance, object);
       break;
     }
+    case OBJ_SHAPE: {
+      ObjShape* shape = (ObjShape*)object;
+      free_table(&shape->transitions);
+      FREE(ObjShape, object);
+      break;
+    }
     case OBJ_NATIVE:
       FREE(ObjNative, object);
       break;
@@ -178,13 +213,26 @@ static void mark_roots(void) {
   }
   for (int i = 0; i < vm.frame_count; i++) {
     mark_object((Obj*)vm.frames[i].closure);
+    for (ObjUpvalue* up = vm.frames[i].open_upvalues; up != NULL;
+         up = up->next) {
+      mark_object((Obj*)up);
+    }
   }
-  for (ObjUpvalue* up = vm.open_upvalues; up != NULL; up = up->next) {
-    mark_object((Obj*)up);
-  }
-  mark_table(&vm.globals);
+  mark_table(&vm.global_slots);
+  mark_table(&vm.global_consts);
+  mark_table(&vm.assigned_globals);
+  mark_table(&vm.inline_functions);
+  mark_table(&vm.inline_methods);
+  mark_arr(&vm.global_names);
+  mark_arr(&vm.global_vals);
   mark_compiler_roots();
   mark_object((Obj*)vm.init_str);
+  mark_object((Obj*)vm.empty_shape);
+  mark_value(vm.exception);
+  // Kept alive so that a new object can't take the address of a redefined one
+  for (int i = 0; i < INTRINSIC_CNT; i++) {
+    mark_object((Obj*)vm.intrinsics[i]);
+  }
 }
 
 static void trace_references() {
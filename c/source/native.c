@@ -0,0 +1,62 @@
+#include "native.h"
+
+#include <string.h>
+
+#include "object.h"
+#include "value.h"
+#include "vm.h"
+
+static bool math_native(uint8_t id, int arg_cnt, Value* args) {
+  for (int i = 0; i < arg_cnt; i++) {
+    if (!IS_NUMBER(args[i])) {
+      return native_error(args, "Arguments must be numbers");
+    }
+  }
+  double b = arg_cnt > 1 ? AS_NUMBER(args[1]) : 0;
+  args[-1] = NUMBER_VAL(apply_intrinsic(id, AS_NUMBER(args[0]), b));
+  return true;
+}
+
+#define MATH_NATIVE(fn, id)                  \
+  static bool fn(int arg_cnt, Value* args) { \
+    return math_native((id), arg_cnt, args); \
+  }
+
+MATH_NATIVE(abs_native, INTRINSIC_ABS)
+MATH_NATIVE(ceil_native, INTRINSIC_CEIL)
+MATH_NATIVE(cos_native, INTRINSIC_COS)
+MATH_NATIVE(exp_native, INTRINSIC_EXP)
+MATH_NATIVE(floor_native, INTRINSIC_FLOOR)
+MATH_NATIVE(log_native, INTRINSIC_LOG)
+MATH_NATIVE(max_native, INTRINSIC_MAX)
+MATH_NATIVE(min_native, INTRINSIC_MIN)
+MATH_NATIVE(pow_native, INTRINSIC_POW)
+MATH_NATIVE(sin_native, INTRINSIC_SIN)
+MATH_NATIVE(sqrt_native, INTRINSIC_SQRT)
+MATH_NATIVE(tan_native, INTRINSIC_TAN)
+
+#undef MATH_NATIVE
+
+const IntrinsicDef intrinsics[INTRINSIC_CNT] = {
+    [INTRINSIC_ABS] = {"abs", 1, abs_native},
+    [INTRINSIC_CEIL] = {"ceil", 1, ceil_native},
+    [INTRINSIC_COS] = {"cos", 1, cos_native},
+    [INTRINSIC_EXP] = {"exp", 1, exp_native},
+    [INTRINSIC_FLOOR] = {"floor", 1, floor_native},
+    [INTRINSIC_LOG] = {"log", 1, log_native},
+    [INTRINSIC_MAX] = {"max", 2, max_native},
+    [INTRINSIC_MIN] = {"min", 2, min_native},
+    [INTRINSIC_POW] = {"pow", 2, pow_native},
+    [INTRINSIC_SIN] = {"sin", 1, sin_native},
+    [INTRINSIC_SQRT] = {"sqrt", 1, sqrt_native},
+    [INTRINSIC_TAN] = {"tan", 1, tan_native},
+};
+
+int find_intrinsic(ObjStr* name) {
+  for (int i = 0; i < INTRINSIC_CNT; i++) {
+    if (strcmp(intrinsics[i].name, name->chars) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
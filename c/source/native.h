@@ -0,0 +1,68 @@
+#pragma once
+
+#include <math.h>
+
+#include "common.h"
+#include "object.h"
+
+/**
+ * Math functions defined as globals. A call to one of these globals compiles
+ * to OP_INTRINSIC, which computes the result inline as long as the global
+ * still holds the original native.
+ */
+typedef enum {
+  INTRINSIC_ABS,
+  INTRINSIC_CEIL,
+  INTRINSIC_COS,
+  INTRINSIC_EXP,
+  INTRINSIC_FLOOR,
+  INTRINSIC_LOG,
+  INTRINSIC_MAX,
+  INTRINSIC_MIN,
+  INTRINSIC_POW,
+  INTRINSIC_SIN,
+  INTRINSIC_SQRT,
+  INTRINSIC_TAN,
+  INTRINSIC_CNT
+} Intrinsic;
+
+typedef struct {
+  const char* name;
+  int arity;  // 1 or 2
+  NativeFn function;
+} IntrinsicDef;
+
+extern const IntrinsicDef intrinsics[INTRINSIC_CNT];
+
+/** Returns the intrinsic named `name`, or -1 if there is none. */
+int find_intrinsic(ObjStr* name);
+
+/** Computes intrinsic `id` of `a`, and of `b` for the binary ones. */
+static inline double apply_intrinsic(uint8_t id, double a, double b) {
+  switch (id) {
+    case INTRINSIC_ABS:
+      return fabs(a);
+    case INTRINSIC_CEIL:
+      return ceil(a);
+    case INTRINSIC_COS:
+      return cos(a);
+    case INTRINSIC_EXP:
+      return exp(a);
+    case INTRINSIC_FLOOR:
+      return floor(a);
+    case INTRINSIC_LOG:
+      return log(a);
+    case INTRINSIC_MAX:
+      return a > b ? a : b;
+    case INTRINSIC_MIN:
+      return a < b ? a : b;
+    case INTRINSIC_POW:
+      return pow(a, b);
+    case INTRINSIC_SIN:
+      return sin(a);
+    case INTRINSIC_SQRT:
+      return sqrt(a);
+    default:
+      return tan(a);
+  }
+}
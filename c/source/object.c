@@ -37,18 +37,32 @@ ObjClass* new_class(ObjStr* name) {
   ObjClass* cls = ALLOCATE_OBJ(ObjClass, OBJ_CLASS);
   cls->name = name;
   init_table(&cls->methods);
+  cls->version = 0;
   return cls;
 }
 
-ObjClosure* new_closure(ObjFunction* function) {
-  ObjUpvalue** upvalues = ALLOCATE(ObjUpvalue*, function->upvalue_cnt);
-  for (int i = 0; i < function->upvalue_cnt; i++) {
+ObjClosure* new_closure(ObjFunction* function, int cell_cnt) {
+  int upvalue_cnt = function->upvalue_cnt;
+  ObjUpvalue** upvalues = (ObjUpvalue**)ALLOCATE(
+      uint8_t, UPVALUE_BLOCK_SIZE(upvalue_cnt, cell_cnt));
+  for (int i = 0; i < upvalue_cnt; i++) {
     upvalues[i] = NULL;
   }
+  ObjUpvalue* cells = (ObjUpvalue*)(upvalues + upvalue_cnt);
+  for (int i = 0; i < cell_cnt; i++) {
+    cells[i].obj.type = OBJ_UPVALUE;
+    cells[i].obj.is_marked = false;
+    cells[i].obj.next = NULL;
+    cells[i].closed = NIL_VAL;
+    cells[i].location = &cells[i].closed;
+    cells[i].next = NULL;
+  }
   ObjClosure* closure = ALLOCATE_OBJ(ObjClosure, OBJ_CLOSURE);
   closure->function = function;
   closure->upvalues = upvalues;
-  closure->upvalue_cnt = function->upvalue_cnt;
+  closure->upvalue_cnt = upvalue_cnt;
+  closure->cells = cells;
+  closure->cell_cnt = cell_cnt;
   return closure;
 }
 
@@ -56,7 +70,12 @@ ObjFunction* new_function() {
   ObjFunction* function = ALLOCATE_OBJ(ObjFunction, OBJ_FUNCTION);
   function->arity = 0;
   function->upvalue_cnt = 0;
+  function->stack_size = 1;
   function->name = NULL;
+#ifdef JIT
+  function->hotness = 0;
+  function->jit = NULL;
+#endif
   init_bsequence(&function->bseq);
   return function;
 }
@@ -64,16 +83,28 @@ ObjFunction* new_function() {
 ObjInstance* new_instance(ObjClass* cls) {
   ObjInstance* instance = ALLOCATE_OBJ(ObjInstance, OBJ_INSTANCE);
   instance->cls = cls;
-  init_table(&instance->fields);
+  instance->shape = vm.empty_shape;
+  instance->fields = NULL;
+  instance->field_capacity = 0;
   return instance;
 }
 
-ObjNative* new_native(NativeFn function) {
+ObjNative* new_native(NativeFn function, int arity) {
   ObjNative* native = ALLOCATE_OBJ(ObjNative, OBJ_NATIVE);
+  native->arity = arity;
   native->function = function;
   return native;
 }
 
+ObjShape* new_shape(ObjShape* parent, ObjStr* name) {
+  ObjShape* shape = ALLOCATE_OBJ(ObjShape, OBJ_SHAPE);
+  shape->parent = parent;
+  shape->name = name;
+  shape->field_cnt = parent == NULL ? 0 : parent->field_cnt + 1;
+  init_table(&shape->transitions);
+  return shape;
+}
+
 static ObjStr* allocate_str(char* chars, int length, uint32_t hash) {
   ObjStr* string = ALLOCATE_OBJ(ObjStr, OBJ_STR);
   string->length = length;
@@ -124,6 +155,53 @@ ObjUpvalue* new_upvalue(Value* slot) {
   return upvalue;
 }
 
+int shape_find_slot(ObjShape* shape, ObjStr* name) {
+  for (; shape->name != NULL; shape = shape->parent) {
+    if (shape->name == name) {
+      return shape->field_cnt - 1;
+    }
+  }
+  return -1;
+}
+
+ObjShape* shape_add_field(ObjShape* shape, ObjStr* name) {
+  Value next;
+  if (table_get(&shape->transitions, name, &next)) {
+    return (ObjShape*)AS_OBJ(next);
+  }
+  ObjShape* child = new_shape(shape, name);
+  push(OBJ_VAL(child));
+  table_set(&shape->transitions, name, OBJ_VAL(child));
+  pop();
+  return child;
+}
+
+void set_instance_shape(ObjInstance* instance, ObjShape* shape) {
+  if (shape->field_cnt > instance->field_capacity) {
+    int capacity = instance->field_capacity;
+    int new_capacity = capacity < 4 ? 4 : capacity * 2;
+    while (new_capacity < shape->field_cnt) {
+      new_capacity *= 2;
+    }
+    instance->fields = GROW_ARR(Value, instance->fields, (size_t)capacity,
+                                (size_t)new_capacity);
+    for (int i = capacity; i < new_capacity; i++) {
+      instance->fields[i] = NIL_VAL;
+    }
+    instance->field_capacity = new_capacity;
+  }
+  instance->shape = shape;
+}
+
+bool instance_get_field(ObjInstance* instance, ObjStr* name, Value* value) {
+  int slot = shape_find_slot(instance->shape, name);
+  if (slot == -1) {
+    return false;
+  }
+  *value = instance->fields[slot];
+  return true;
+}
+
 static void print_function(ObjFunction* f) {
   if (f->name == NULL) {
     printf("<script>");
@@ -152,6 +230,9 @@ void print_obj(Value val) {
     case OBJ_NATIVE:
       printf("<native fn>");
       break;
+    case OBJ_SHAPE:
+      printf("shape");
+      break;
     case OBJ_STR:
       printf("%s", AS_CSTR(val));
       break;
@@ -19,7 +19,7 @@
 #define AS_CLOSURE(val) ((ObjClosure*)AS_OBJ(val))
 #define AS_FUNCTION(val) ((ObjFunction*)AS_OBJ(val))
 #define AS_INSTANCE(val) ((ObjInstance*)AS_OBJ(val))
-#define AS_NATIVE(val) (((ObjNative*)AS_OBJ(val))->function)
+#define AS_NATIVE(val) ((ObjNative*)AS_OBJ(val))
 #define AS_STR(val) ((ObjStr*)AS_OBJ(val))
 #define AS_CSTR(val) (((ObjStr*)AS_OBJ(val))->chars)
 
@@ -30,6 +30,7 @@ typedef enum {
   OBJ_FUNCTION,
   OBJ_INSTANCE,
   OBJ_NATIVE,
+  OBJ_SHAPE,
   OBJ_STR,
   OBJ_UPVALUE,
 } ObjType;
@@ -40,18 +41,34 @@ struct Obj {
   Obj* next;
 };
 
+#ifdef JIT
+typedef struct JitCode JitCode;
+#endif
+
 typedef struct {
   Obj obj;
   int arity;
   int upvalue_cnt;
+  int stack_size;  // slots a call needs, counting the callee and arguments
   ByteSequence bseq;
   ObjStr* name;
+#ifdef JIT
+  int hotness;   // calls and loop back-edges so far
+  JitCode* jit;  // native code once the function got hot, or NULL
+#endif
 } ObjFunction;
 
-typedef Value (*NativeFn)(int argCount, Value* args);
+/**
+ * C function callable from scripts. It reads its arguments from `args` and
+ * stores its result in args[-1], the callee's stack slot, which keeps the
+ * result reachable if it allocates again. Returns false after storing an
+ * error message string there instead, see native_error().
+ */
+typedef bool (*NativeFn)(int arg_cnt, Value* args);
 
 typedef struct {
   Obj obj;
+  int arity;  // checked before the call, -1 to accept any count
   NativeFn function;
 } ObjNative;
 
@@ -62,6 +79,20 @@ struct ObjStr {
   uint32_t hash;
 };
 
+/**
+ * A hidden class: the ordered list of field names an instance has acquired.
+ * Instances that got the same fields in the same order share one shape, and
+ * each field lives at a fixed slot in ObjInstance.fields. Shapes form a tree
+ * rooted at vm.empty_shape and are never freed while the VM runs.
+ */
+struct ObjShape {
+  Obj obj;
+  ObjShape* parent;
+  ObjStr* name;  // the field this shape adds to its parent, NULL for the root
+  int field_cnt;
+  Table transitions;  // field name -> child ObjShape
+};
+
 typedef struct ObjUpvalue {
   Obj obj;
   Value* location;
@@ -69,23 +100,42 @@ typedef struct ObjUpvalue {
   struct ObjUpvalue* next;
 } ObjUpvalue;
 
-typedef struct {
+/**
+ * A closure's upvalue pointers share one block with its cells: closed
+ * upvalues that belong to it alone, holding the values it captured by copy.
+ * Cells aren't objects of their own, the closure marks and frees them.
+ */
+struct ObjClosure {
   Obj obj;
   ObjFunction* function;
   ObjUpvalue** upvalues;
   int upvalue_cnt;
-} ObjClosure;
+  ObjUpvalue* cells;  // right after the pointers in the same block
+  int cell_cnt;
+};
 
-typedef struct {
+#define UPVALUE_BLOCK_SIZE(upvalue_cnt, cell_cnt)  \
+  (sizeof(ObjUpvalue*) * (size_t)(upvalue_cnt) + \
+   sizeof(ObjUpvalue) * (size_t)(cell_cnt))
+
+static inline bool is_cell(ObjClosure* closure, ObjUpvalue* upvalue) {
+  return upvalue >= closure->cells &&
+         upvalue < closure->cells + closure->cell_cnt;
+}
+
+struct ObjClass {
   Obj obj;
   ObjStr* name;
   Table methods;
-} ObjClass;
+  uint32_t version;  // bumped whenever its methods change
+};
 
 typedef struct {
   Obj obj;
   ObjClass* cls;
-  Table fields;
+  ObjShape* shape;
+  Value* fields;
+  int field_capacity;
 } ObjInstance;
 
 typedef struct {
@@ -96,14 +146,20 @@ typedef struct {
 
 ObjBoundMethod* new_bound_method(Value receiver, ObjClosure* method);
 ObjClass* new_class(ObjStr* name);
-ObjClosure* new_closure(ObjFunction* function);
+ObjClosure* new_closure(ObjFunction* function, int cell_cnt);
 ObjFunction* new_function();
 ObjInstance* new_instance(ObjClass* cls);
-ObjNative* new_native(NativeFn function);
+ObjNative* new_native(NativeFn function, int arity);
+ObjShape* new_shape(ObjShape* parent, ObjStr* name);
 ObjStr* take_str(char* chars, int length);
 ObjStr* copy_str(const char* chars, int length);
 ObjUpvalue* new_upvalue(Value* slot);
 
+int shape_find_slot(ObjShape* shape, ObjStr* name);
+ObjShape* shape_add_field(ObjShape* shape, ObjStr* name);
+void set_instance_shape(ObjInstance* instance, ObjShape* shape);
+bool instance_get_field(ObjInstance* instance, ObjStr* name, Value* value);
+
 void print_obj(Value val);
 
 static inline bool is_obj_type(Value val, ObjType type) {
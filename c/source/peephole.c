@@ -0,0 +1,370 @@
+#include "peephole.h"
+
+#include <stdbool.h>
+#include <string.h>
+
+#include "memory.h"
+
+// Jumps a threaded jump follows at most, which keeps the pass linear
+#define MAX_THREAD_HOPS 8
+
+// Per-offset flags
+#define REACHED 0x1  // an instruction starts here and some path runs it
+#define LANDED 0x2   // a jump, guard or handler lands here
+#define DEAD 0x4     // the instruction is dropped
+#define TO_POP 0x8   // a popping jump to the next instruction, kept as POP
+
+/**
+ * State of one pass. Offsets are those of the code as the compiler left it;
+ * `targets` holds where the branch at each offset lands, which threading
+ * moves, and only relocation rewrites the operands.
+ */
+typedef struct {
+  ByteSequence *seq;
+  uint8_t *flags;
+  int *targets;  // -1 where no branch starts
+} Pass;
+
+static bool is_forward_jump(uint8_t op) {
+  switch (op) {
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_JUMP_IF_FALSE_POP:
+    case OP_JUMP_IF_TRUE_POP:
+    case OP_JUMP_FAR:
+    case OP_JUMP_IF_FALSE_FAR:
+    case OP_JUMP_IF_FALSE_POP_FAR:
+      return true;
+    default:
+      return false;
+  }
+}
+
+static bool is_far_jump(uint8_t op) {
+  return op == OP_JUMP_FAR || op == OP_JUMP_IF_FALSE_FAR ||
+         op == OP_JUMP_IF_FALSE_POP_FAR;
+}
+
+/** Returns whether the instruction only pushes a value without effects. */
+static bool is_pure_push(uint8_t op) {
+  switch (op) {
+    case OP_CONSTANT:
+    case OP_CONSTANT_LONG:
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_GET_LOCAL:
+    case OP_GET_LOCAL_LONG:
+    case OP_GET_UPVALUE:
+    case OP_GET_UPVALUE_LONG:
+      return true;
+    default:
+      return false;
+  }
+}
+
+/** Returns the offset the branch at `offset` can land on, or -1. */
+static int branch_target(ByteSequence *seq, int offset) {
+  uint8_t op = seq->code[offset];
+  if (op == OP_INLINE_CALL || op == OP_INLINE_INVOKE) {
+    int targets[2];
+    successors(seq, offset, targets);
+    return targets[1];
+  }
+  int target = jump_target(seq, offset);
+  return target != -1 ? target : back_edge_target(seq, offset);
+}
+
+/**
+ * Records the target of each branch and marks the instructions reached from
+ * the entry or a handler.
+ */
+static void scan(Pass *pass) {
+  ByteSequence *seq = pass->seq;
+  for (int offset = 0; offset < seq->size;
+       offset += instr_size(seq, offset)) {
+    pass->targets[offset] = branch_target(seq, offset);
+  }
+
+  int *pending = ALLOCATE(int, (size_t)seq->size);
+  int pending_cnt = 0;
+  pass->flags[0] |= REACHED;
+  pending[pending_cnt++] = 0;
+  for (int i = 0; i < seq->handler_cnt; i++) {
+    int handler = seq->handlers[i].handler;
+    if (!(pass->flags[handler] & REACHED)) {
+      pass->flags[handler] |= REACHED;
+      pending[pending_cnt++] = handler;
+    }
+  }
+  while (pending_cnt > 0) {
+    int targets[2];
+    int target_cnt = successors(seq, pending[--pending_cnt], targets);
+    for (int i = 0; i < target_cnt; i++) {
+      int target = targets[i];
+      if (target < seq->size && !(pass->flags[target] & REACHED)) {
+        pass->flags[target] |= REACHED;
+        pending[pending_cnt++] = target;
+      }
+    }
+  }
+  FREE_ARR(int, pending, (size_t)seq->size);
+}
+
+/** Sets LANDED wherever a live branch or a handler lands. */
+static void mark_landings(Pass *pass) {
+  ByteSequence *seq = pass->seq;
+  for (int offset = 0; offset < seq->size; offset++) {
+    pass->flags[offset] &= (uint8_t)~LANDED;
+  }
+  for (int offset = 0; offset < seq->size; offset++) {
+    if ((pass->flags[offset] & (REACHED | DEAD)) == REACHED &&
+        pass->targets[offset] != -1) {
+      pass->flags[pass->targets[offset]] |= LANDED;
+    }
+  }
+  for (int i = 0; i < seq->handler_cnt; i++) {
+    pass->flags[seq->handlers[i].handler] |= LANDED;
+  }
+}
+
+/**
+ * Returns where a jump to `target` ends up after the unconditional jumps it
+ * runs into. A jump that keeps the tested value also passes through
+ * OP_JUMP_IF_FALSE, which tests the same false value again.
+ */
+static int follow_jumps(Pass *pass, int target, bool keeps_value) {
+  uint8_t *code = pass->seq->code;
+  for (int hops = 0; hops < MAX_THREAD_HOPS; hops++) {
+    uint8_t op = code[target];
+    bool retest =
+        keeps_value && (op == OP_JUMP_IF_FALSE || op == OP_JUMP_IF_FALSE_FAR);
+    if (op != OP_JUMP && op != OP_JUMP_FAR && !retest) {
+      break;
+    }
+    target = pass->targets[target];
+  }
+  return target;
+}
+
+/** Returns whether a jump at `offset` can be encoded to land on `target`. */
+static bool reaches(Pass *pass, int offset, int target) {
+  return is_far_jump(pass->seq->code[offset]) ||
+         target - (offset + 3) <= UINT16_MAX;
+}
+
+/**
+ * Points each jump at the end of the chain it starts. A value an `and` left
+ * for the next test after OP_JUMP_IF_FALSE and OP_POP skips straight past
+ * that test when it jumps to OP_JUMP_IF_FALSE_POP, popping it there.
+ */
+static void thread_jumps(Pass *pass) {
+  ByteSequence *seq = pass->seq;
+  for (int offset = 0; offset < seq->size; offset++) {
+    uint8_t *ip = &seq->code[offset];
+    if ((pass->flags[offset] & REACHED) == 0 || !is_forward_jump(*ip)) {
+      continue;
+    }
+    bool keeps_value = *ip == OP_JUMP_IF_FALSE || *ip == OP_JUMP_IF_FALSE_FAR;
+    int target = follow_jumps(pass, pass->targets[offset], keeps_value);
+    int pop = offset + 3;
+    uint8_t at = seq->code[target];
+    if (keeps_value && pop < seq->size && seq->code[pop] == OP_POP &&
+        !(pass->flags[pop] & LANDED) &&
+        (at == OP_JUMP_IF_FALSE_POP || at == OP_JUMP_IF_FALSE_POP_FAR)) {
+      int past = follow_jumps(pass, pass->targets[target], false);
+      if (reaches(pass, offset, past)) {
+        *ip = *ip == OP_JUMP_IF_FALSE ? OP_JUMP_IF_FALSE_POP
+                                      : OP_JUMP_IF_FALSE_POP_FAR;
+        pass->flags[pop] |= DEAD;
+        pass->targets[offset] = past;
+        continue;
+      }
+    }
+    if (reaches(pass, offset, target)) {
+      pass->targets[offset] = target;
+    }
+  }
+}
+
+/** Fuses and drops pairs of instructions no jump lands between. */
+static void rewrite_pairs(Pass *pass) {
+  ByteSequence *seq = pass->seq;
+  for (int offset = 0; offset < seq->size; offset++) {
+    if ((pass->flags[offset] & (REACHED | DEAD)) != REACHED) {
+      continue;
+    }
+    int next = offset + instr_size(seq, offset);
+    if (next >= seq->size ||
+        (pass->flags[next] & (LANDED | DEAD | REACHED)) != REACHED) {
+      continue;
+    }
+    uint8_t op = seq->code[offset];
+    if (op == OP_NOT && seq->code[next] == OP_JUMP_IF_FALSE_POP) {
+      seq->code[next] = OP_JUMP_IF_TRUE_POP;
+      pass->flags[offset] |= DEAD;
+    } else if (is_pure_push(op) && seq->code[next] == OP_POP) {
+      pass->flags[offset] |= DEAD;
+      pass->flags[next] |= DEAD;
+    }
+  }
+}
+
+/**
+ * Drops jumps to the next instruction left running, last first so that a
+ * jump over only such jumps goes too. A popping one still has to pop. Each
+ * jump finds the next instruction kept after it from `next_kept`, which is
+ * filled in along the way, so chains of jumps take one pass.
+ */
+static void drop_empty_jumps(Pass *pass) {
+  ByteSequence *seq = pass->seq;
+  int *starts = ALLOCATE(int, (size_t)seq->size);
+  int start_cnt = 0;
+  for (int offset = 0; offset < seq->size;
+       offset += instr_size(seq, offset)) {
+    starts[start_cnt++] = offset;
+  }
+  int *next_kept = ALLOCATE(int, (size_t)seq->size + 1);
+  next_kept[seq->size] = seq->size;
+  for (int i = start_cnt - 1; i >= 0; i--) {
+    int offset = starts[i];
+    int next = offset + instr_size(seq, offset);
+    uint8_t op = seq->code[offset];
+    if ((pass->flags[offset] & (REACHED | DEAD)) != REACHED) {
+      next_kept[offset] = next_kept[next];
+      continue;
+    }
+    next_kept[offset] = offset;
+    if (!is_forward_jump(op) || next_kept[next] < pass->targets[offset]) {
+      continue;
+    }
+    if (op == OP_JUMP || op == OP_JUMP_FAR || op == OP_JUMP_IF_FALSE ||
+        op == OP_JUMP_IF_FALSE_FAR) {
+      pass->flags[offset] |= DEAD;
+      next_kept[offset] = next_kept[next];
+    } else {
+      pass->flags[offset] |= TO_POP;
+    }
+  }
+  FREE_ARR(int, next_kept, (size_t)seq->size + 1);
+  FREE_ARR(int, starts, (size_t)seq->size);
+}
+
+static void write_short(uint8_t *at, int val) {
+  at[0] = (uint8_t)((val >> 8) & 0xff);
+  at[1] = (uint8_t)(val & 0xff);
+}
+
+/** Points the branch operand of the moved instruction at `to`. */
+static void relocate_branch(ByteSequence *seq, int to, int target) {
+  uint8_t *ip = &seq->code[to];
+  switch (*ip) {
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_JUMP_IF_FALSE_POP:
+    case OP_JUMP_IF_TRUE_POP:
+      write_short(&ip[1], target - (to + 3));
+      break;
+    case OP_JUMP_FAR:
+    case OP_JUMP_IF_FALSE_FAR:
+    case OP_JUMP_IF_FALSE_POP_FAR:
+    case OP_LOOP_FAR:
+      seq->far_jumps[(ip[1] << 8) | ip[2]] = target;
+      break;
+    case OP_LOOP:
+      write_short(&ip[1], to + 5 - target);
+      break;
+    case OP_FOR_PREP:
+      if (ip[3] & FOR_FAR_EXIT) {
+        seq->far_jumps[(ip[4] << 8) | ip[5]] = target;
+      } else {
+        write_short(&ip[4], target - (to + 6));
+      }
+      break;
+    case OP_FOR_LOOP:
+      write_short(&ip[5], to + 9 - target);
+      break;
+    case OP_INLINE_CALL:
+    case OP_INLINE_INVOKE: {
+      int size = instr_size(seq, to);
+      write_short(&ip[size - 2], target - (to + size));
+      break;
+    }
+    default:
+      break;
+  }
+}
+
+/**
+ * Slides the kept instructions down over the dropped ones and rewrites every
+ * offset into the code. An offset of a dropped instruction moves to the next
+ * kept one, which does what it and the instructions in between did.
+ */
+static void relocate(Pass *pass) {
+  ByteSequence *seq = pass->seq;
+  int *moved = ALLOCATE(int, (size_t)seq->size + 1);
+  int size = 0;
+  for (int offset = 0; offset < seq->size;) {
+    int length = instr_size(seq, offset);
+    for (int i = 0; i < length; i++) {
+      moved[offset + i] = size;
+    }
+    if ((pass->flags[offset] & (REACHED | DEAD)) == REACHED) {
+      size += (pass->flags[offset] & TO_POP) ? 1 : length;
+    }
+    offset += length;
+  }
+  moved[seq->size] = size;
+
+  // Instructions only move down, over bytes already read
+  for (int offset = 0; offset < seq->size;) {
+    int length = instr_size(seq, offset);
+    int to = moved[offset];
+    if ((pass->flags[offset] & (REACHED | DEAD)) != REACHED) {
+      // Dropped
+    } else if (pass->flags[offset] & TO_POP) {
+      seq->code[to] = OP_POP;
+      seq->lines[to] = seq->lines[offset];
+    } else {
+      memmove(&seq->code[to], &seq->code[offset], (size_t)length);
+      memmove(&seq->lines[to], &seq->lines[offset],
+              (size_t)length * sizeof(int));
+      if (pass->targets[offset] != -1) {
+        relocate_branch(seq, to, moved[pass->targets[offset]]);
+      }
+    }
+    offset += length;
+  }
+
+  for (int i = 0; i < seq->handler_cnt; i++) {
+    Handler *entry = &seq->handlers[i];
+    entry->start = moved[entry->start];
+    entry->end = moved[entry->end];
+    entry->handler = moved[entry->handler];
+  }
+  FREE_ARR(int, moved, (size_t)seq->size + 1);
+  seq->size = size;
+}
+
+void optimize_bsequence(ByteSequence *seq) {
+  if (seq->size == 0) {
+    return;
+  }
+  size_t size = (size_t)seq->size;
+  Pass pass;
+  pass.seq = seq;
+  pass.flags = ALLOCATE(uint8_t, size);
+  pass.targets = ALLOCATE(int, size);
+  memset(pass.flags, 0, size);
+
+  scan(&pass);
+  mark_landings(&pass);
+  thread_jumps(&pass);
+  mark_landings(&pass);
+  rewrite_pairs(&pass);
+  drop_empty_jumps(&pass);
+  relocate(&pass);
+
+  FREE_ARR(uint8_t, pass.flags, size);
+  FREE_ARR(int, pass.targets, size);
+}
@@ -0,0 +1,13 @@
+#pragma once
+
+#include "bytecode.h"
+
+/**
+ * Rewrites the finished, not yet frozen code of one function in place: drops
+ * code no path reaches, threads jumps that land on other jumps, fuses
+ * OP_NOT OP_JUMP_IF_FALSE_POP into OP_JUMP_IF_TRUE_POP and removes pushes
+ * that are popped right away and jumps to the next instruction. Jump
+ * operands, the far jump table, handlers and lines follow the code. Runs in
+ * time linear in the code size.
+ */
+void optimize_bsequence(ByteSequence *seq);
@@ -114,7 +114,17 @@ static TokenType identifier_type(void) {
     case 'a':
       return check_keyword(1, 2, "nd", TOKEN_AND);
     case 'c':
-      return check_keyword(1, 4, "lass", TOKEN_CLASS);
+      if (scanner.current - scanner.start > 1) {
+        switch (scanner.start[1]) {
+          case 'a':
+            return check_keyword(2, 3, "tch", TOKEN_CATCH);
+          case 'l':
+            return check_keyword(2, 3, "ass", TOKEN_CLASS);
+          case 'o':
+            return check_keyword(2, 3, "nst", TOKEN_CONST);
+        }
+      }
+      break;
     case 'e':
       return check_keyword(1, 3, "lse", TOKEN_ELSE);
     case 'f':
@@ -145,8 +155,16 @@ static TokenType identifier_type(void) {
       if (scanner.current - scanner.start > 1) {
         switch (scanner.start[1]) {
           case 'h':
+            if (scanner.current - scanner.start > 2 &&
+                scanner.start[2] == 'r') {
+              return check_keyword(3, 2, "ow", TOKEN_THROW);
+            }
             return check_keyword(2, 2, "is", TOKEN_THIS);
           case 'r':
+            if (scanner.current - scanner.start > 2 &&
+                scanner.start[2] == 'y') {
+              return check_keyword(3, 0, "", TOKEN_TRY);
+            }
             return check_keyword(2, 2, "ue", TOKEN_TRUE);
         }
       }
@@ -27,7 +27,9 @@ typedef enum {
   TOKEN_NUMBER,
   // Keywords
   TOKEN_AND,
+  TOKEN_CATCH,
   TOKEN_CLASS,
+  TOKEN_CONST,
   TOKEN_ELSE,
   TOKEN_FALSE,
   TOKEN_FOR,
@@ -39,7 +41,9 @@ typedef enum {
   TOKEN_RETURN,
   TOKEN_SUPER,
   TOKEN_THIS,
+  TOKEN_THROW,
   TOKEN_TRUE,
+  TOKEN_TRY,
   TOKEN_VAR,
   TOKEN_WHILE,
   // Special tokens
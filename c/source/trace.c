@@ -0,0 +1,1074 @@
+#include "trace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bytecode.h"
+#include "native.h"
+#include "object.h"
+#include "value.h"
+#include "vm.h"
+
+// A trace is one recorded iteration of a hot loop, flattened into register
+// code. Every value the iteration computes gets its own register, so the
+// operand stack disappears, and variables are kept in registers across
+// iterations: they are loaded and type-checked once when the trace starts
+// and only written back when it exits.
+
+#define MAX_RECORDED 512  // bytecode instructions per iteration
+#define MAX_PREAMBLE 128
+#define MAX_BODY 1024
+#define MAX_REGS 1024
+#define MAX_VARS 64
+#define MAX_STACK 64
+#define MAX_EXITS 128
+#define MAX_EXIT_REFS 1024
+
+// Variables are the frame's locals below the loop's stack base and globals
+#define GLOBAL_VAR(slot) (UINT8_COUNT + (slot))
+
+typedef enum {
+  IR_LOAD_LOCAL,    // dst = frame->slots[a]
+  IR_LOAD_GLOBAL,   // dst = vm.global_vals.vals[a]
+  IR_GET_UPVALUE,   // dst = upvalue a
+  IR_SET_UPVALUE,   // upvalue a = b
+  IR_GUARD_NUM,     // exit unless a is a number
+  IR_GUARD_BOOL,    // exit unless a is a boolean
+  IR_GUARD_NIL,     // exit unless a is nil
+  IR_GUARD_OBJ,     // exit unless a is an object
+  IR_GUARD_TRUTHY,  // exit if a is falsey
+  IR_GUARD_FALSEY,  // exit unless a is falsey
+  IR_GUARD_SAME,    // exit unless a is the object in b
+  IR_EQUAL,
+  IR_GREATER,
+  IR_LESS,
+  IR_ADD,
+  IR_SUBTRACT,
+  IR_MULTIPLY,
+  IR_DIVIDE,
+  IR_NOT,
+  IR_NEGATE,
+  IR_INTRINSIC,  // dst = the Intrinsic in `exit` applied to a and b
+  IR_PRINT,
+  IR_MOVE,  // dst = a
+  IR_LOOP,  // start the next iteration
+} IrOp;
+
+typedef enum {
+  TYPE_ANY,
+  TYPE_NUM,
+  TYPE_BOOL,
+  TYPE_NIL,
+  TYPE_OBJ,
+} IrType;
+
+typedef struct {
+  uint8_t op;
+  uint16_t dst;
+  uint16_t a;
+  uint16_t b;
+  uint16_t exit;  // index into Trace.exits for guards, see IR_INTRINSIC
+} IrIns;
+
+typedef struct {
+  int var;
+  uint16_t reg;
+} VarRef;
+
+typedef struct {
+  uint16_t reg;
+  Value val;
+} RegConst;
+
+/** The interpreter state to rebuild when a guard fails. */
+typedef struct {
+  uint8_t* ip;  // instruction the guard stood for
+  int stack_start;
+  int stack_cnt;  // registers to push above the loop's stack base
+  int var_start;
+  int var_cnt;  // variables assigned in the iteration so far
+} TraceExit;
+
+struct Trace {
+  int base;  // stack slots in use at the loop header
+  int reg_cnt;
+  Value* regs;
+  int const_cnt;
+  RegConst* consts;
+  int ins_cnt;
+  int loop_start;  // first instruction after the preamble
+  IrIns* code;
+  int carried_cnt;
+  VarRef* carried;  // assigned variables, written back on every exit
+  TraceExit* exits;
+  uint16_t* stack_refs;
+  VarRef* var_refs;
+};
+
+typedef struct {
+  int var;
+  uint16_t carried;  // value at the start of an iteration
+  uint16_t current;  // value at the instruction being recorded
+  IrType type;       // of `carried`, TYPE_ANY if never read before assigned
+  bool assigned;
+} VarState;
+
+typedef struct {
+  CallFrame* frame;
+  LoopCache* cache;
+  uint8_t* header;
+  uint8_t* end;  // last OP_LOOP of the loop being traced
+  int base;
+  int recorded;
+  bool failed;
+
+  IrIns preamble[MAX_PREAMBLE];
+  int preamble_cnt;
+  IrIns body[MAX_BODY];
+  int body_cnt;
+
+  IrType reg_types[MAX_REGS];
+  bool reg_is_const[MAX_REGS];
+  Value reg_consts[MAX_REGS];
+  int reg_cnt;
+
+  VarState vars[MAX_VARS];
+  int var_cnt;
+  uint16_t stack[MAX_STACK];
+  int stack_cnt;
+
+  TraceExit exits[MAX_EXITS];
+  int exit_cnt;
+  uint16_t stack_refs[MAX_EXIT_REFS];
+  int stack_ref_cnt;
+  VarRef var_refs[MAX_EXIT_REFS];
+  int var_ref_cnt;
+} Recorder;
+
+static Recorder rec;
+
+static bool is_falsey(Value value) {
+  return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+static IrType type_of(Value value) {
+  if (IS_NUMBER(value)) {
+    return TYPE_NUM;
+  }
+  if (IS_BOOL(value)) {
+    return TYPE_BOOL;
+  }
+  if (IS_NIL(value)) {
+    return TYPE_NIL;
+  }
+  if (IS_OBJ(value)) {
+    return TYPE_OBJ;
+  }
+  return TYPE_ANY;
+}
+
+static uint16_t new_reg(IrType type) {
+  if (rec.reg_cnt == MAX_REGS) {
+    rec.failed = true;
+    return 0;
+  }
+  rec.reg_types[rec.reg_cnt] = type;
+  rec.reg_is_const[rec.reg_cnt] = false;
+  return (uint16_t)rec.reg_cnt++;
+}
+
+static uint16_t const_reg(Value value) {
+  uint16_t reg = new_reg(type_of(value));
+  if (!rec.failed) {
+    rec.reg_is_const[reg] = true;
+    rec.reg_consts[reg] = value;
+  }
+  return reg;
+}
+
+static void emit_ir(IrIns* code, int* cnt, int max, IrOp op, uint16_t dst,
+                    uint16_t a, uint16_t b, uint16_t exit) {
+  if (*cnt == max) {
+    rec.failed = true;
+    return;
+  }
+  IrIns* ins = &code[(*cnt)++];
+  ins->op = (uint8_t)op;
+  ins->dst = dst;
+  ins->a = a;
+  ins->b = b;
+  ins->exit = exit;
+}
+
+static void emit_body(IrOp op, uint16_t dst, uint16_t a, uint16_t b) {
+  emit_ir(rec.body, &rec.body_cnt, MAX_BODY, op, dst, a, b, 0);
+}
+
+static void emit_guard(IrOp op, uint16_t reg, uint16_t exit) {
+  emit_ir(rec.body, &rec.body_cnt, MAX_BODY, op, 0, reg, 0, exit);
+}
+
+static IrOp type_guard(IrType type) {
+  switch (type) {
+    case TYPE_NUM:
+      return IR_GUARD_NUM;
+    case TYPE_BOOL:
+      return IR_GUARD_BOOL;
+    case TYPE_NIL:
+      return IR_GUARD_NIL;
+    default:
+      return IR_GUARD_OBJ;
+  }
+}
+
+static void push_ref(uint16_t reg) {
+  if (rec.stack_cnt == MAX_STACK) {
+    rec.failed = true;
+    return;
+  }
+  rec.stack[rec.stack_cnt++] = reg;
+}
+
+static uint16_t pop_ref(void) {
+  if (rec.stack_cnt == 0) {
+    rec.failed = true;
+    return 0;
+  }
+  return rec.stack[--rec.stack_cnt];
+}
+
+static uint16_t peek_ref(void) {
+  if (rec.stack_cnt == 0) {
+    rec.failed = true;
+    return 0;
+  }
+  return rec.stack[rec.stack_cnt - 1];
+}
+
+/** Records how to resume the interpreter at `ip` and returns the exit. */
+static uint16_t snapshot(uint8_t* ip) {
+  if (rec.exit_cnt == MAX_EXITS ||
+      rec.stack_ref_cnt + rec.stack_cnt > MAX_EXIT_REFS ||
+      rec.var_ref_cnt + rec.var_cnt > MAX_EXIT_REFS) {
+    rec.failed = true;
+    return 0;
+  }
+  TraceExit* exit = &rec.exits[rec.exit_cnt];
+  exit->ip = ip;
+  exit->stack_start = rec.stack_ref_cnt;
+  exit->stack_cnt = rec.stack_cnt;
+  for (int i = 0; i < rec.stack_cnt; i++) {
+    rec.stack_refs[rec.stack_ref_cnt++] = rec.stack[i];
+  }
+  exit->var_start = rec.var_ref_cnt;
+  exit->var_cnt = 0;
+  for (int i = 0; i < rec.var_cnt; i++) {
+    if (rec.vars[i].assigned) {
+      rec.var_refs[rec.var_ref_cnt].var = rec.vars[i].var;
+      rec.var_refs[rec.var_ref_cnt].reg = rec.vars[i].current;
+      rec.var_ref_cnt++;
+      exit->var_cnt++;
+    }
+  }
+  return (uint16_t)rec.exit_cnt++;
+}
+
+/** Adds a variable whose iteration-start value is loaded by the preamble. */
+static VarState* add_var(int var) {
+  if (rec.var_cnt == MAX_VARS) {
+    rec.failed = true;
+    return NULL;
+  }
+  VarState* state = &rec.vars[rec.var_cnt++];
+  state->var = var;
+  state->carried = new_reg(TYPE_ANY);
+  state->current = state->carried;
+  state->type = TYPE_ANY;
+  state->assigned = false;
+  IrOp load = var < UINT8_COUNT ? IR_LOAD_LOCAL : IR_LOAD_GLOBAL;
+  uint16_t index = (uint16_t)(var < UINT8_COUNT ? var : var - UINT8_COUNT);
+  emit_ir(rec.preamble, &rec.preamble_cnt, MAX_PREAMBLE, load, state->carried,
+          index, 0, 0);
+  return state;
+}
+
+static VarState* find_var(int var) {
+  for (int i = 0; i < rec.var_cnt; i++) {
+    if (rec.vars[i].var == var) {
+      return &rec.vars[i];
+    }
+  }
+  return NULL;
+}
+
+/** Returns the register holding `var`, whose value right now is `value`. */
+static uint16_t read_var(int var, Value value) {
+  VarState* state = find_var(var);
+  if (state != NULL) {
+    return state->current;
+  }
+  state = add_var(var);
+  IrType type = type_of(value);
+  if (state == NULL || type == TYPE_ANY) {
+    rec.failed = true;
+    return 0;
+  }
+  // Nothing in the trace can change a variable behind its back, so checking
+  // the type once on entry covers every iteration
+  state->type = type;
+  rec.reg_types[state->carried] = type;
+  emit_ir(rec.preamble, &rec.preamble_cnt, MAX_PREAMBLE, type_guard(type), 0,
+          state->carried, 0, 0);
+  return state->current;
+}
+
+static void write_var(int var, uint16_t reg) {
+  VarState* state = find_var(var);
+  if (state == NULL) {
+    state = add_var(var);
+    if (state == NULL) {
+      return;
+    }
+  }
+  state->current = reg;
+  state->assigned = true;
+}
+
+static uint16_t* local_ref(int slot) {
+  if (slot - rec.base >= rec.stack_cnt) {
+    rec.failed = true;
+    return NULL;
+  }
+  return &rec.stack[slot - rec.base];
+}
+
+static bool both_const(uint16_t a, uint16_t b) {
+  return rec.reg_is_const[a] && rec.reg_is_const[b];
+}
+
+static void record_arith(IrOp op, IrType result) {
+  uint16_t b = pop_ref();
+  uint16_t a = pop_ref();
+  if (rec.reg_types[a] != TYPE_NUM || rec.reg_types[b] != TYPE_NUM) {
+    rec.failed = true;
+    return;
+  }
+  if (both_const(a, b)) {
+    double x = AS_NUMBER(rec.reg_consts[a]);
+    double y = AS_NUMBER(rec.reg_consts[b]);
+    switch (op) {
+      case IR_GREATER:
+        push_ref(const_reg(BOOL_VAL(x > y)));
+        return;
+      case IR_LESS:
+        push_ref(const_reg(BOOL_VAL(x < y)));
+        return;
+      case IR_ADD:
+        push_ref(const_reg(NUMBER_VAL(x + y)));
+        return;
+      case IR_SUBTRACT:
+        push_ref(const_reg(NUMBER_VAL(x - y)));
+        return;
+      case IR_MULTIPLY:
+        push_ref(const_reg(NUMBER_VAL(x * y)));
+        return;
+      default:
+        push_ref(const_reg(NUMBER_VAL(x / y)));
+        return;
+    }
+  }
+  uint16_t dst = new_reg(result);
+  emit_body(op, dst, a, b);
+  push_ref(dst);
+}
+
+static void record_equal(void) {
+  uint16_t b = pop_ref();
+  uint16_t a = pop_ref();
+  if (both_const(a, b)) {
+    Value equal = BOOL_VAL(are_equal(rec.reg_consts[a], rec.reg_consts[b]));
+    push_ref(const_reg(equal));
+  } else if (rec.reg_types[a] != rec.reg_types[b]) {
+    push_ref(const_reg(BOOL_VAL(false)));
+  } else {
+    uint16_t dst = new_reg(TYPE_BOOL);
+    emit_body(IR_EQUAL, dst, a, b);
+    push_ref(dst);
+  }
+}
+
+static void record_not(void) {
+  uint16_t a = pop_ref();
+  if (rec.reg_is_const[a]) {
+    push_ref(const_reg(BOOL_VAL(is_falsey(rec.reg_consts[a]))));
+  } else if (rec.reg_types[a] != TYPE_BOOL) {
+    push_ref(const_reg(BOOL_VAL(rec.reg_types[a] == TYPE_NIL)));
+  } else {
+    uint16_t dst = new_reg(TYPE_BOOL);
+    emit_body(IR_NOT, dst, a, 0);
+    push_ref(dst);
+  }
+}
+
+static void record_negate(void) {
+  uint16_t a = pop_ref();
+  if (rec.reg_types[a] != TYPE_NUM) {
+    rec.failed = true;
+  } else if (rec.reg_is_const[a]) {
+    push_ref(const_reg(NUMBER_VAL(-AS_NUMBER(rec.reg_consts[a]))));
+  } else {
+    uint16_t dst = new_reg(TYPE_NUM);
+    emit_body(IR_NEGATE, dst, a, 0);
+    push_ref(dst);
+  }
+}
+
+/**
+ * Records OP_INTRINSIC as a guard that the callee still is the native and the
+ * math itself. Any other callee or argument type leaves the interpreter to
+ * do the call.
+ */
+static void record_intrinsic(uint8_t* ip) {
+  uint8_t id = ip[1];
+  int arg_cnt = intrinsics[id].arity;
+  Value callee = vm.top[-arg_cnt - 1];
+  if (rec.stack_cnt <= arg_cnt || !IS_OBJ(callee) ||
+      AS_OBJ(callee) != (Obj*)vm.intrinsics[id]) {
+    rec.failed = true;
+    return;
+  }
+  uint16_t callee_ref = rec.stack[rec.stack_cnt - 1 - arg_cnt];
+  if (!rec.reg_is_const[callee_ref]) {
+    emit_ir(rec.body, &rec.body_cnt, MAX_BODY, IR_GUARD_SAME, 0, callee_ref,
+            const_reg(callee), snapshot(ip));
+  }
+  uint16_t b = arg_cnt > 1 ? pop_ref() : 0;
+  uint16_t a = pop_ref();
+  pop_ref();
+  if (rec.reg_types[a] != TYPE_NUM ||
+      (arg_cnt > 1 && rec.reg_types[b] != TYPE_NUM)) {
+    rec.failed = true;
+    return;
+  }
+  if (rec.reg_is_const[a] && (arg_cnt == 1 || rec.reg_is_const[b])) {
+    double y = arg_cnt > 1 ? AS_NUMBER(rec.reg_consts[b]) : 0;
+    double x = apply_intrinsic(id, AS_NUMBER(rec.reg_consts[a]), y);
+    push_ref(const_reg(NUMBER_VAL(x)));
+    return;
+  }
+  uint16_t dst = new_reg(TYPE_NUM);
+  emit_ir(rec.body, &rec.body_cnt, MAX_BODY, IR_INTRINSIC, dst, a, b, id);
+  push_ref(dst);
+}
+
+static void record_branch(uint8_t* ip, Value cond) {
+  uint16_t reg = peek_ref();
+  // Only a boolean that isn't known yet can take the other way next time
+  if (rec.reg_is_const[reg] || rec.reg_types[reg] != TYPE_BOOL) {
+    return;
+  }
+  emit_guard(is_falsey(cond) ? IR_GUARD_FALSEY : IR_GUARD_TRUTHY, reg,
+             snapshot(ip));
+}
+
+static void record_get_local(CallFrame* frame, int slot) {
+  if (slot < rec.base) {
+    push_ref(read_var(slot, frame->slots[slot]));
+  } else {
+    uint16_t* ref = local_ref(slot);
+    if (ref != NULL) {
+      push_ref(*ref);
+    }
+  }
+}
+
+static void record_set_local(int slot) {
+  uint16_t value = peek_ref();
+  if (slot < rec.base) {
+    write_var(slot, value);
+  } else {
+    uint16_t* ref = local_ref(slot);
+    if (ref != NULL) {
+      *ref = value;
+    }
+  }
+}
+
+/** Records a register instruction as the stack instructions it replaces. */
+static void record_register_op(CallFrame* frame, uint8_t* ip, IrOp op,
+                               IrType result) {
+  // The _RK forms follow their _RR forms in OpCode
+  bool constant = (*ip - OP_ADD_RR) % 2 == 1;
+  record_get_local(frame, ip[2]);
+  if (constant) {
+    push_ref(const_reg(frame->closure->function->bseq.consts.vals[ip[3]]));
+  } else {
+    record_get_local(frame, ip[3]);
+  }
+  record_arith(op, result);
+  if (ip[1] != REG_PUSH) {
+    record_set_local(ip[1]);
+    pop_ref();
+  }
+}
+
+/**
+ * Records the test of the counted loop instruction at `ip` on the counter
+ * on top of the stack, replacing it with the outcome.
+ */
+static void record_for_test(CallFrame* frame, uint8_t* ip) {
+  uint8_t mode = ip[3];
+  if (mode & FOR_CONST_LIMIT) {
+    push_ref(const_reg(frame->closure->function->bseq.consts.vals[ip[2]]));
+  } else {
+    record_get_local(frame, ip[2]);
+  }
+  switch (mode & FOR_CMP_MASK) {
+    case FOR_LESS:
+      record_arith(IR_LESS, TYPE_BOOL);
+      break;
+    case FOR_LESS_EQUAL:
+      record_arith(IR_GREATER, TYPE_BOOL);
+      record_not();
+      break;
+    case FOR_GREATER:
+      record_arith(IR_GREATER, TYPE_BOOL);
+      break;
+    default:
+      record_arith(IR_LESS, TYPE_BOOL);
+      record_not();
+      break;
+  }
+}
+
+/**
+ * Pops the outcome of a counted loop test and guards that it is `holds`.
+ * Otherwise the interpreter resumes at `resume`.
+ */
+static void record_for_guard(uint8_t* resume, bool holds) {
+  uint16_t cond = pop_ref();
+  if (rec.failed || rec.reg_is_const[cond]) {
+    return;
+  }
+  emit_guard(holds ? IR_GUARD_TRUTHY : IR_GUARD_FALSEY, cond,
+             snapshot(resume));
+}
+
+static void record_get_upvalue(CallFrame* frame, uint8_t* ip) {
+  uint8_t slot = ip[1];
+  IrType type = type_of(*frame->closure->upvalues[slot]->location);
+  if (type == TYPE_ANY) {
+    rec.failed = true;
+    return;
+  }
+  uint16_t exit = snapshot(ip);
+  uint16_t dst = new_reg(type);
+  emit_body(IR_GET_UPVALUE, dst, slot, 0);
+  emit_guard(type_guard(type), dst, exit);
+  push_ref(dst);
+}
+
+static bool abort_trace(void) {
+  rec.frame = NULL;
+  if (++rec.cache->aborts >= TRACE_MAX_ABORTS) {
+    rec.cache->hotness = -1;
+  } else {
+    rec.cache->hotness = 0;
+  }
+  return false;
+}
+
+/** Copies every assigned variable's final value to its carried register. */
+static void emit_carried_moves(void) {
+  for (int i = 0; i < rec.var_cnt; i++) {
+    VarState* state = &rec.vars[i];
+    if (!state->assigned || state->current == state->carried) {
+      continue;
+    }
+    // A value carried by another variable may be overwritten first
+    for (int j = 0; j < rec.var_cnt; j++) {
+      if (rec.vars[j].carried == state->current) {
+        uint16_t tmp = new_reg(rec.reg_types[state->current]);
+        emit_body(IR_MOVE, tmp, state->current, 0);
+        state->current = tmp;
+        break;
+      }
+    }
+  }
+  for (int i = 0; i < rec.var_cnt; i++) {
+    VarState* state = &rec.vars[i];
+    if (state->assigned && state->current != state->carried) {
+      emit_body(IR_MOVE, state->carried, state->current, 0);
+    }
+  }
+}
+
+static void* copy_arr(const void* src, size_t size) {
+  void* dst = malloc(size > 0 ? size : 1);
+  if (dst != NULL && size > 0) {
+    memcpy(dst, src, size);
+  }
+  return dst;
+}
+
+static bool finish_trace(void) {
+  if (rec.stack_cnt != 0) {
+    return abort_trace();
+  }
+  // Types checked on entry must still hold when the next iteration starts
+  for (int i = 0; i < rec.var_cnt; i++) {
+    VarState* state = &rec.vars[i];
+    if (state->assigned && state->type != TYPE_ANY &&
+        rec.reg_types[state->current] != state->type) {
+      return abort_trace();
+    }
+  }
+  emit_carried_moves();
+  emit_body(IR_LOOP, 0, 0, 0);
+  if (rec.failed) {
+    return abort_trace();
+  }
+
+  Trace* trace = malloc(sizeof(Trace));
+  if (trace == NULL) {
+    return abort_trace();
+  }
+  trace->base = rec.base;
+  trace->reg_cnt = rec.reg_cnt;
+  trace->regs = malloc(sizeof(Value) * (size_t)(rec.reg_cnt + 1));
+  trace->const_cnt = 0;
+  trace->consts = malloc(sizeof(RegConst) * (size_t)(rec.reg_cnt + 1));
+  for (int i = 0; trace->consts != NULL && i < rec.reg_cnt; i++) {
+    if (rec.reg_is_const[i]) {
+      trace->consts[trace->const_cnt].reg = (uint16_t)i;
+      trace->consts[trace->const_cnt].val = rec.reg_consts[i];
+      trace->const_cnt++;
+    }
+  }
+  trace->ins_cnt = rec.preamble_cnt + rec.body_cnt;
+  trace->loop_start = rec.preamble_cnt;
+  trace->code = malloc(sizeof(IrIns) * (size_t)trace->ins_cnt);
+  if (trace->code != NULL) {
+    memcpy(trace->code, rec.preamble,
+           sizeof(IrIns) * (size_t)rec.preamble_cnt);
+    memcpy(trace->code + rec.preamble_cnt, rec.body,
+           sizeof(IrIns) * (size_t)rec.body_cnt);
+  }
+  trace->carried_cnt = 0;
+  trace->carried = malloc(sizeof(VarRef) * (size_t)(rec.var_cnt + 1));
+  for (int i = 0; trace->carried != NULL && i < rec.var_cnt; i++) {
+    if (rec.vars[i].assigned) {
+      trace->carried[trace->carried_cnt].var = rec.vars[i].var;
+      trace->carried[trace->carried_cnt].reg = rec.vars[i].carried;
+      trace->carried_cnt++;
+    }
+  }
+  trace->exits =
+      copy_arr(rec.exits, sizeof(TraceExit) * (size_t)rec.exit_cnt);
+  trace->stack_refs =
+      copy_arr(rec.stack_refs, sizeof(uint16_t) * (size_t)rec.stack_ref_cnt);
+  trace->var_refs =
+      copy_arr(rec.var_refs, sizeof(VarRef) * (size_t)rec.var_ref_cnt);
+  if (trace->regs == NULL || trace->consts == NULL || trace->code == NULL ||
+      trace->carried == NULL || trace->exits == NULL ||
+      trace->stack_refs == NULL || trace->var_refs == NULL) {
+    free_trace(trace);
+    return abort_trace();
+  }
+
+  rec.cache->trace = trace;
+  rec.frame = NULL;
+  return false;
+}
+
+/**
+ * Finds the end of the loop that `loop` jumps back into. A for loop has a
+ * second OP_LOOP after its body, which jumps back to the increment clause.
+ */
+static uint8_t* find_loop_end(ByteSequence* bseq, uint8_t* header,
+                              uint8_t* loop) {
+  uint8_t* end = loop;
+  for (int offset = (int)(loop - bseq->code); offset < bseq->size;
+       offset += instr_size(bseq, offset)) {
+    int target = back_edge_target(bseq, offset);
+    if (target != -1 && bseq->code + target >= header &&
+        bseq->code + target <= end) {
+      end = bseq->code + offset;
+    }
+  }
+  return end;
+}
+
+bool trace_start(CallFrame* frame, uint8_t* loop, LoopCache* cache) {
+  rec.frame = frame;
+  rec.cache = cache;
+  rec.header = frame->ip;
+  rec.end = find_loop_end(&frame->closure->function->bseq, frame->ip, loop);
+  rec.base = (int)(vm.top - frame->slots);
+  rec.recorded = 0;
+  rec.failed = false;
+  rec.preamble_cnt = 0;
+  rec.body_cnt = 0;
+  rec.reg_cnt = 0;
+  rec.var_cnt = 0;
+  rec.stack_cnt = 0;
+  rec.exit_cnt = 0;
+  rec.stack_ref_cnt = 0;
+  rec.var_ref_cnt = 0;
+  // Exit 0 leaves from the loop header before anything was done
+  snapshot(rec.header);
+  return true;
+}
+
+bool trace_record(CallFrame* frame) {
+  uint8_t* ip = frame->ip;
+  if (frame != rec.frame) {
+    return abort_trace();
+  }
+  if (ip > rec.end) {
+    // The recorded iteration left the loop, try again with a later one
+    rec.frame = NULL;
+    rec.cache->hotness = 0;
+    return false;
+  }
+  if (ip == rec.header && rec.recorded > 0) {
+    return finish_trace();
+  }
+  if (++rec.recorded > MAX_RECORDED) {
+    return abort_trace();
+  }
+
+  switch (*ip) {
+    case OP_CONSTANT:
+      push_ref(const_reg(frame->closure->function->bseq.consts.vals[ip[1]]));
+      break;
+    case OP_NIL:
+      push_ref(const_reg(NIL_VAL));
+      break;
+    case OP_TRUE:
+      push_ref(const_reg(BOOL_VAL(true)));
+      break;
+    case OP_FALSE:
+      push_ref(const_reg(BOOL_VAL(false)));
+      break;
+    case OP_POP:
+      pop_ref();
+      break;
+    case OP_GET_LOCAL:
+      record_get_local(frame, ip[1]);
+      break;
+    case OP_SET_LOCAL:
+      record_set_local(ip[1]);
+      break;
+    case OP_GET_LOCAL_LOCAL:
+      record_get_local(frame, ip[1]);
+      record_get_local(frame, ip[2]);
+      break;
+    case OP_GET_LOCAL_CONSTANT:
+      record_get_local(frame, ip[1]);
+      push_ref(const_reg(frame->closure->function->bseq.consts.vals[ip[2]]));
+      break;
+    case OP_SET_LOCAL_POP:
+      record_set_local(ip[1]);
+      pop_ref();
+      break;
+    case OP_ADD_RR:
+    case OP_ADD_RK:
+      record_register_op(frame, ip, IR_ADD, TYPE_NUM);
+      break;
+    case OP_SUBTRACT_RR:
+    case OP_SUBTRACT_RK:
+      record_register_op(frame, ip, IR_SUBTRACT, TYPE_NUM);
+      break;
+    case OP_MULTIPLY_RR:
+    case OP_MULTIPLY_RK:
+      record_register_op(frame, ip, IR_MULTIPLY, TYPE_NUM);
+      break;
+    case OP_DIVIDE_RR:
+    case OP_DIVIDE_RK:
+      record_register_op(frame, ip, IR_DIVIDE, TYPE_NUM);
+      break;
+    case OP_LESS_RR:
+    case OP_LESS_RK:
+      record_register_op(frame, ip, IR_LESS, TYPE_BOOL);
+      break;
+    case OP_GREATER_RR:
+    case OP_GREATER_RK:
+      record_register_op(frame, ip, IR_GREATER, TYPE_BOOL);
+      break;
+    case OP_GET_GLOBAL: {
+      int slot = (ip[1] << 8) | ip[2];
+      push_ref(read_var(GLOBAL_VAR(slot), vm.global_vals.vals[slot]));
+      break;
+    }
+    case OP_SET_GLOBAL: {
+      int slot = (ip[1] << 8) | ip[2];
+      if (IS_EMPTY(vm.global_vals.vals[slot])) {
+        return abort_trace();
+      }
+      write_var(GLOBAL_VAR(slot), peek_ref());
+      break;
+    }
+    case OP_GET_UPVALUE:
+      record_get_upvalue(frame, ip);
+      break;
+    case OP_SET_UPVALUE:
+      emit_body(IR_SET_UPVALUE, 0, ip[1], peek_ref());
+      break;
+    case OP_EQUAL:
+      record_equal();
+      break;
+    case OP_GREATER:
+    case OP_GREATER_NUM:
+      record_arith(IR_GREATER, TYPE_BOOL);
+      break;
+    case OP_LESS:
+    case OP_LESS_NUM:
+      record_arith(IR_LESS, TYPE_BOOL);
+      break;
+    case OP_ADD:
+    case OP_ADD_NUM:
+      record_arith(IR_ADD, TYPE_NUM);
+      break;
+    case OP_SUBTRACT:
+    case OP_SUBTRACT_NUM:
+      record_arith(IR_SUBTRACT, TYPE_NUM);
+      break;
+    case OP_MULTIPLY:
+    case OP_MULTIPLY_NUM:
+      record_arith(IR_MULTIPLY, TYPE_NUM);
+      break;
+    case OP_DIVIDE:
+    case OP_DIVIDE_NUM:
+      record_arith(IR_DIVIDE, TYPE_NUM);
+      break;
+    case OP_NOT:
+      record_not();
+      break;
+    case OP_NEGATE:
+      record_negate();
+      break;
+    case OP_PRINT:
+      emit_body(IR_PRINT, 0, pop_ref(), 0);
+      break;
+    case OP_JUMP:
+    case OP_JUMP_FAR:
+      break;
+    case OP_JUMP_IF_FALSE:
+    case OP_JUMP_IF_FALSE_FAR:
+      record_branch(ip, vm.top[-1]);
+      break;
+    case OP_JUMP_IF_FALSE_POP:
+    case OP_JUMP_IF_TRUE_POP:
+    case OP_JUMP_IF_FALSE_POP_FAR:
+      record_branch(ip, vm.top[-1]);
+      pop_ref();
+      break;
+    case OP_LOOP:
+    case OP_LOOP_FAR: {
+      ByteSequence* bseq = &frame->closure->function->bseq;
+      LoopCache* cache = &bseq->loop_caches[(ip[3] << 8) | ip[4]];
+      if (cache != rec.cache && cache->trace != NULL) {
+        return abort_trace();
+      }
+      break;
+    }
+    case OP_FOR_PREP: {
+      Value counter = frame->slots[ip[1]];
+      Value limit = (ip[3] & FOR_CONST_LIMIT)
+                        ? frame->closure->function->bseq.consts.vals[ip[2]]
+                        : frame->slots[ip[2]];
+      if (!IS_NUMBER(counter) || !IS_NUMBER(limit)) {
+        return abort_trace();
+      }
+      record_get_local(frame, ip[1]);
+      record_for_test(frame, ip);
+      // The test has no side effects, so a failing guard can rerun it
+      record_for_guard(ip, for_test(ip[3], AS_NUMBER(counter),
+                                    AS_NUMBER(limit)));
+      break;
+    }
+    case OP_FOR_LOOP: {
+      ByteSequence* bseq = &frame->closure->function->bseq;
+      LoopCache* cache = &bseq->loop_caches[(ip[7] << 8) | ip[8]];
+      if (cache != rec.cache && cache->trace != NULL) {
+        return abort_trace();
+      }
+      Value step = bseq->consts.vals[ip[4]];
+      double counter = AS_NUMBER(frame->slots[ip[1]]) + AS_NUMBER(step);
+      Value limit = (ip[3] & FOR_CONST_LIMIT) ? bseq->consts.vals[ip[2]]
+                                              : frame->slots[ip[2]];
+      record_get_local(frame, ip[1]);
+      push_ref(const_reg(step));
+      record_arith(IR_ADD, TYPE_NUM);
+      record_set_local(ip[1]);
+      record_for_test(frame, ip);
+      // A failing guard resumes with the counter already stepped
+      bool holds = for_test(ip[3], counter, AS_NUMBER(limit));
+      int target = back_edge_target(bseq, (int)(ip - bseq->code));
+      record_for_guard(holds ? ip + 9 : bseq->code + target, holds);
+      break;
+    }
+    case OP_INTRINSIC:
+      record_intrinsic(ip);
+      break;
+    default:
+      // Calls, returns, objects and strings stay in the interpreter
+      return abort_trace();
+  }
+  if (rec.failed) {
+    return abort_trace();
+  }
+  return true;
+}
+
+static void write_var_back(CallFrame* frame, int var, Value value) {
+  if (var < UINT8_COUNT) {
+    frame->slots[var] = value;
+  } else {
+    vm.global_vals.vals[var - UINT8_COUNT] = value;
+  }
+}
+
+static void exit_trace(Trace* trace, CallFrame* frame, int index) {
+  TraceExit* exit = &trace->exits[index];
+  // Exit 0 is taken by the preamble, before any variable was loaded
+  if (index != 0) {
+    for (int i = 0; i < trace->carried_cnt; i++) {
+      VarRef* ref = &trace->carried[i];
+      write_var_back(frame, ref->var, trace->regs[ref->reg]);
+    }
+  }
+  for (int i = 0; i < exit->var_cnt; i++) {
+    VarRef* ref = &trace->var_refs[exit->var_start + i];
+    write_var_back(frame, ref->var, trace->regs[ref->reg]);
+  }
+  vm.top = frame->slots + trace->base;
+  for (int i = 0; i < exit->stack_cnt; i++) {
+    push(trace->regs[trace->stack_refs[exit->stack_start + i]]);
+  }
+  frame->ip = exit->ip;
+}
+
+/**
+ * Leaves at the loop header once the fuel is used up. Every variable the
+ * iteration assigned has been moved to its carried register by now.
+ */
+static void suspend_trace(Trace* trace, CallFrame* frame) {
+  for (int i = 0; i < trace->carried_cnt; i++) {
+    VarRef* ref = &trace->carried[i];
+    write_var_back(frame, ref->var, trace->regs[ref->reg]);
+  }
+  exit_trace(trace, frame, 0);
+}
+
+#define GUARD(cond)                      \
+  if (!(cond)) {                         \
+    exit_trace(trace, frame, ins->exit); \
+    return;                              \
+  }                                      \
+  break
+#define NUM(reg) AS_NUMBER(regs[ins->reg])
+
+void run_trace(Trace* trace, CallFrame* frame) {
+  Value* regs = trace->regs;
+  for (int i = 0; i < trace->const_cnt; i++) {
+    regs[trace->consts[i].reg] = trace->consts[i].val;
+  }
+
+  IrIns* ins = trace->code;
+  for (;;) {
+    switch (ins->op) {
+      case IR_LOAD_LOCAL:
+        regs[ins->dst] = frame->slots[ins->a];
+        break;
+      case IR_LOAD_GLOBAL:
+        regs[ins->dst] = vm.global_vals.vals[ins->a];
+        break;
+      case IR_GET_UPVALUE:
+        regs[ins->dst] = *frame->closure->upvalues[ins->a]->location;
+        break;
+      case IR_SET_UPVALUE:
+        *frame->closure->upvalues[ins->a]->location = regs[ins->b];
+        break;
+      case IR_GUARD_NUM:
+        GUARD(IS_NUMBER(regs[ins->a]));
+      case IR_GUARD_BOOL:
+        GUARD(IS_BOOL(regs[ins->a]));
+      case IR_GUARD_NIL:
+        GUARD(IS_NIL(regs[ins->a]));
+      case IR_GUARD_OBJ:
+        GUARD(IS_OBJ(regs[ins->a]));
+      case IR_GUARD_TRUTHY:
+        GUARD(AS_BOOL(regs[ins->a]));
+      case IR_GUARD_FALSEY:
+        GUARD(!AS_BOOL(regs[ins->a]));
+      case IR_GUARD_SAME:
+        GUARD(IS_OBJ(regs[ins->a]) &&
+              AS_OBJ(regs[ins->a]) == AS_OBJ(regs[ins->b]));
+      case IR_EQUAL:
+        regs[ins->dst] = BOOL_VAL(are_equal(regs[ins->a], regs[ins->b]));
+        break;
+      case IR_GREATER:
+        regs[ins->dst] = BOOL_VAL(NUM(a) > NUM(b));
+        break;
+      case IR_LESS:
+        regs[ins->dst] = BOOL_VAL(NUM(a) < NUM(b));
+        break;
+      case IR_ADD:
+        regs[ins->dst] = NUMBER_VAL(NUM(a) + NUM(b));
+        break;
+      case IR_SUBTRACT:
+        regs[ins->dst] = NUMBER_VAL(NUM(a) - NUM(b));
+        break;
+      case IR_MULTIPLY:
+        regs[ins->dst] = NUMBER_VAL(NUM(a) * NUM(b));
+        break;
+      case IR_DIVIDE:
+        regs[ins->dst] = NUMBER_VAL(NUM(a) / NUM(b));
+        break;
+      case IR_NOT:
+        regs[ins->dst] = BOOL_VAL(!AS_BOOL(regs[ins->a]));
+        break;
+      case IR_NEGATE:
+        regs[ins->dst] = NUMBER_VAL(-NUM(a));
+        break;
+      case IR_INTRINSIC: {
+        // record_intrinsic() stores the byte-sized id of an Intrinsic here
+        uint8_t id = (uint8_t)ins->exit;
+        regs[ins->dst] = NUMBER_VAL(apply_intrinsic(id, NUM(a), NUM(b)));
+        break;
+      }
+      case IR_PRINT:
+        print_val(regs[ins->a]);
+        printf("\n");
+        break;
+      case IR_MOVE:
+        regs[ins->dst] = regs[ins->a];
+        break;
+      case IR_LOOP:
+        if (--vm.fuel <= 0) {
+          suspend_trace(trace, frame);
+          return;
+        }
+        ins = trace->code + trace->loop_start;
+        continue;
+    }
+    ins++;
+  }
+}
+
+#undef GUARD
+#undef NUM
+
+void free_trace(Trace* trace) {
+  free(trace->regs);
+  free(trace->consts);
+  free(trace->code);
+  free(trace->carried);
+  free(trace->exits);
+  free(trace->stack_refs);
+  free(trace->var_refs);
+  free(trace);
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include "bytecode.h"
+#include "common.h"
+#include "vm.h"
+
+// Back-edges a loop takes before one of its iterations gets recorded
+#ifndef TRACE_THRESHOLD
+#define TRACE_THRESHOLD 64
+#endif
+// Failed recordings after which a loop is left to the interpreter
+#define TRACE_MAX_ABORTS 4
+
+/**
+ * Starts recording the loop iteration that begins at frame->ip, where the
+ * OP_LOOP at `loop` just jumped back to. Returns false if the loop can't be
+ * traced.
+ */
+bool trace_start(CallFrame* frame, uint8_t* loop, LoopCache* cache);
+/**
+ * Records the instruction at frame->ip before the interpreter runs it.
+ * Returns false once the iteration was compiled or recording gave up.
+ */
+bool trace_record(CallFrame* frame);
+/**
+ * Runs `trace` from the loop header at frame->ip until one of its guards
+ * fails, then writes back the stack and variables so that the interpreter
+ * resumes at the instruction that guard stood for.
+ */
+void run_trace(Trace* trace, CallFrame* frame);
+void free_trace(Trace* trace);
@@ -82,6 +82,8 @@ void print_val(Value val) {
     case VAL_OBJ:
       print_obj(val);
       break;
+    case VAL_EMPTY:
+      break;
   }
 #endif
 }
@@ -6,12 +6,16 @@
 
 typedef struct Obj Obj;
 typedef struct ObjStr ObjStr;
+typedef struct ObjShape ObjShape;
+typedef struct ObjClass ObjClass;
+typedef struct ObjClosure ObjClosure;
 
 #ifdef NAN_BOXING
 
 #define SIGN_BIT ((uint64_t)0x8000000000000000)
 #define QNAN ((uint64_t)0x7ffc000000000000)
 
+#define TAG_EMPTY 0  // 00.
 #define TAG_NIL 1    // 01.
 #define TAG_FALSE 2  // 10.
 #define TAG_TRUE 3   // 11.
@@ -20,6 +24,7 @@ typedef uint64_t Value;
 
 #define IS_BOOL(val) (((val) | 1) == TRUE_VAL)
 #define IS_NIL(val) ((val) == NIL_VAL)
+#define IS_EMPTY(val) ((val) == EMPTY_VAL)
 #define IS_NUMBER(val) (((val) & QNAN) != QNAN)
 #define IS_OBJ(val) (((val) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
 
@@ -31,6 +36,7 @@ typedef uint64_t Value;
 #define FALSE_VAL ((Value)(uint64_t)(QNAN | TAG_FALSE))
 #define TRUE_VAL ((Value)(uint64_t)(QNAN | TAG_TRUE))
 #define NIL_VAL ((Value)(uint64_t)(QNAN | TAG_NIL))
+#define EMPTY_VAL ((Value)(uint64_t)(QNAN | TAG_EMPTY))
 #define NUMBER_VAL(val) num_to_val(val)
 #define OBJ_VAL(obj) (Value)(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(obj))
 
@@ -53,6 +59,7 @@ typedef enum {
   VAL_NIL,
   VAL_NUMBER,
   VAL_OBJ,
+  VAL_EMPTY,
 } ValueType;
 
 typedef struct {
@@ -68,6 +75,7 @@ typedef struct {
 #define IS_NIL(val) ((val).type == VAL_NIL)
 #define IS_NUMBER(val) ((val).type == VAL_NUMBER)
 #define IS_OBJ(val) ((val).type == VAL_OBJ)
+#define IS_EMPTY(val) ((val).type == VAL_EMPTY)
 
 #define AS_BOOL(val) ((val).as.boolean)
 #define AS_NUMBER(val) ((val).as.number)
@@ -77,6 +85,7 @@ typedef struct {
 #define NIL_VAL ((Value){VAL_NIL, {.number = 0}})
 #define NUMBER_VAL(val) ((Value){VAL_NUMBER, {.number = (val)}})
 #define OBJ_VAL(object) ((Value){VAL_OBJ, {.obj = (Obj*)(object)}})
+#define EMPTY_VAL ((Value){VAL_EMPTY, {.number = 0}})
 
 #endif
 
@@ -3,6 +3,7 @@
 #include <stdarg.h>
 #include <stddef.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
@@ -10,70 +11,246 @@
 #include "common.h"
 #include "compile.h"
 #include "debug.h"
+#include "jit.h"
 #include "memory.h"
+#include "native.h"
 #include "object.h"
 #include "table.h"
+#include "trace.h"
 #include "value.h"
 
 VM vm;
 
-static Value clock_native(int argc, Value* args) {
-  return NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
+// Frames an uncaught exception's stack trace shows at each end
+#define TRACE_FRAMES_SHOWN 16
+
+static bool clock_native(int arg_cnt, Value* args) {
+  (void)arg_cnt;
+  args[-1] = NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
+  return true;
 }
 
-static void reset_stack(void) {
-  vm.top = vm.stack;
-  vm.frame_count = 0;
-  vm.open_upvalues = NULL;
+static void print_trace_line(int line, ObjFunction* function) {
+  (void)fprintf(stderr, "[line %d] in ", line);
+  if (function->name == NULL) {
+    (void)fprintf(stderr, "script\n");
+  } else {
+    (void)fprintf(stderr, "%s()\n", function->name->chars);
+  }
 }
 
-static void runtime_error(const char* format, ...) {
-  va_list args;
-  va_start(args, format);
-  (void)vfprintf(stderr, format, args);
-  va_end(args);
-  (void)fputs("\n", stderr);
+/** Returns the function whose body the inline guard at `site` inlined. */
+static ObjFunction* inlined_function(CallFrame* frame, uint8_t* site) {
+  int operand = *site == OP_INLINE_CALL ? site[1] : site[4];
+  return AS_FUNCTION(frame->closure->function->bseq.consts.vals[operand]);
+}
 
+static void print_stack_trace(void) {
   for (int i = vm.frame_count - 1; i >= 0; i--) {
+    // Deep recursion would print thousands of identical lines
+    if (i == vm.frame_count - 1 - TRACE_FRAMES_SHOWN &&
+        i >= TRACE_FRAMES_SHOWN) {
+      (void)fprintf(stderr, "... %d more frames\n",
+                    i + 1 - TRACE_FRAMES_SHOWN);
+      i = TRACE_FRAMES_SHOWN;
+      continue;
+    }
     CallFrame* frame = &vm.frames[i];
     ObjFunction* function = frame->closure->function;
     size_t instruction = frame->ip - function->bseq.code - 1;
-    (void)fprintf(stderr, "[line %d] in ", function->bseq.lines[instruction]);
-    if (function->name == NULL) {
-      (void)fprintf(stderr, "script\n");
-    } else {
-      (void)fprintf(stderr, "%s()\n", function->name->chars);
+    if (frame->inline_site != NULL) {
+      // An inlined body reports the line in its function, then the call
+      print_trace_line(get_line(&function->bseq, (int)instruction),
+                       inlined_function(frame, frame->inline_site));
+      instruction = (size_t)(frame->inline_site - function->bseq.code);
     }
+    print_trace_line(get_line(&function->bseq, (int)instruction), function);
+  }
+}
+
+/**
+ * Throws the formatted message as a string. The instruction that raised it
+ * then returns INTERPRET_RUNTIME_ERROR from run(), and interpret() unwinds
+ * to a handler or reports the error.
+ */
+static void runtime_error(const char* format, ...) {
+  va_list args;
+  va_start(args, format);
+  va_list measure;
+  va_copy(measure, args);
+  int length = vsnprintf(NULL, 0, format, measure);
+  va_end(measure);
+  char* chars = ALLOCATE(char, length + 1);
+  (void)vsnprintf(chars, (size_t)length + 1, format, args);
+  va_end(args);
+  vm.exception = OBJ_VAL(take_str(chars, length));
+}
+
+int global_slot(ObjStr* name) {
+  Value slot;
+  if (table_get(&vm.global_slots, name, &slot)) {
+    return (int)AS_NUMBER(slot);
   }
+  push(OBJ_VAL(name));
+  write_valarr(&vm.global_names, OBJ_VAL(name));
+  write_valarr(&vm.global_vals, EMPTY_VAL);
+  table_set(&vm.global_slots, name,
+            NUMBER_VAL((double)(vm.global_vals.size - 1)));
+  pop();
+  return vm.global_vals.size - 1;
+}
 
-  reset_stack();
+bool native_error(Value* args, const char* message) {
+  args[-1] = OBJ_VAL(copy_str(message, (int)strlen(message)));
+  return false;
 }
 
-static void define_native(const char* name, NativeFn function) {
+static ObjNative* define_native(const char* name, NativeFn function,
+                                int arity) {
   push(OBJ_VAL(copy_str(name, (int)strlen(name))));
-  push(OBJ_VAL(new_native(function)));
-  table_set(&vm.globals, AS_STR(vm.stack[0]), vm.stack[1]);
+  push(OBJ_VAL(new_native(function, arity)));
+  int slot = global_slot(AS_STR(vm.stack[0]));
+  vm.global_vals.vals[slot] = vm.stack[1];
+  ObjNative* native = AS_NATIVE(vm.stack[1]);
   pop();
   pop();
+  return native;
+}
+
+/**
+ * Runs OP_INTRINSIC `id` inline if the callee below its arguments is still
+ * the native it names and the arguments are numbers. Returns false if the
+ * call has to go through call_value() instead.
+ */
+static inline bool run_intrinsic(uint8_t id) {
+  int arg_cnt = intrinsics[id].arity;
+  Value* args = vm.top - arg_cnt;
+  if (!IS_OBJ(args[-1]) || AS_OBJ(args[-1]) != (Obj*)vm.intrinsics[id] ||
+      !IS_NUMBER(args[0]) || (arg_cnt > 1 && !IS_NUMBER(args[1]))) {
+    return false;
+  }
+  double b = arg_cnt > 1 ? AS_NUMBER(args[1]) : 0;
+  args[-1] = NUMBER_VAL(apply_intrinsic(id, AS_NUMBER(args[0]), b));
+  vm.top = args;
+  return true;
 }
 
 static Value peek(int distance) { return vm.top[-1 - distance]; }
 
+#ifdef JIT
+static void count_hotness(ObjFunction* function) {
+  if (vm.jit_enabled && function->jit == NULL &&
+      ++function->hotness == JIT_THRESHOLD) {
+    jit_compile(function);
+  }
+}
+#endif
+
+static bool grow_frames(void) {
+  if (vm.frame_capacity == FRAMES_MAX) {
+    return false;
+  }
+  int capacity = vm.frame_capacity;
+  vm.frame_capacity = capacity * 2 < FRAMES_MAX ? capacity * 2 : FRAMES_MAX;
+  vm.frames = GROW_ARR(CallFrame, vm.frames, (size_t)capacity,
+                       (size_t)vm.frame_capacity);
+  return true;
+}
+
+/**
+ * Makes room for `needed` more values above vm.top. The stack moves, so
+ * every pointer into it is rebased: vm.top, the frames' slots and the
+ * locations of open upvalues. vm.open_slots grows along with it.
+ */
+static bool grow_stack(int needed) {
+  int depth = (int)(vm.top - vm.stack);
+  if (needed > STACK_MAX - depth) {
+    return false;
+  }
+  int capacity = vm.stack_capacity;
+  int new_capacity = capacity;
+  while (new_capacity - depth < needed) {
+    new_capacity = new_capacity * 2 < STACK_MAX ? new_capacity * 2 : STACK_MAX;
+  }
+  vm.open_slots = GROW_ARR(ObjUpvalue*, vm.open_slots, (size_t)capacity,
+                           (size_t)new_capacity);
+  for (int i = capacity; i < new_capacity; i++) {
+    vm.open_slots[i] = NULL;
+  }
+  Value* old = vm.stack;
+  vm.stack = GROW_ARR(Value, vm.stack, (size_t)capacity, (size_t)new_capacity);
+  vm.stack_capacity = new_capacity;
+  vm.top = vm.stack + depth;
+  for (int i = 0; i < vm.frame_count; i++) {
+    CallFrame* frame = &vm.frames[i];
+    frame->slots = vm.stack + (frame->slots - old);
+    if (frame->inline_site != NULL) {
+      frame->caller_slots = vm.stack + (frame->caller_slots - old);
+    }
+    for (ObjUpvalue* up = frame->open_upvalues; up != NULL; up = up->next) {
+      up->location = vm.stack + (up->location - old);
+    }
+  }
+  // So do the cells of closures that stay in their frame, and those are on
+  // the stack for as long as they can run
+  for (Value* slot = vm.stack; slot < vm.top; slot++) {
+    if (!IS_CLOSURE(*slot)) {
+      continue;
+    }
+    ObjClosure* closure = AS_CLOSURE(*slot);
+    for (int i = 0; i < closure->cell_cnt; i++) {
+      ObjUpvalue* cell = &closure->cells[i];
+      if (cell->location >= old && cell->location < old + capacity) {
+        cell->location = vm.stack + (cell->location - old);
+      }
+    }
+  }
+  return true;
+}
+
 static bool call(ObjClosure* closure, int arg_cnt) {
   if (arg_cnt != closure->function->arity) {
     runtime_error("Expected %d arguments but got %d", closure->function->arity,
                   arg_cnt);
     return false;
   }
-  if (vm.frame_count == FRAMES_MAX) {
+  if (vm.frame_count == vm.frame_capacity && !grow_frames()) {
     runtime_error("Stack overflow");
     return false;
   }
+  int needed = closure->function->stack_size - arg_cnt - 1 + STACK_RESERVE;
+  if (vm.stack + vm.stack_capacity - vm.top < needed && !grow_stack(needed)) {
+    runtime_error("Stack overflow");
+    return false;
+  }
+
+#ifdef JIT
+  count_hotness(closure->function);
+#endif
+  vm.fuel--;
 
   CallFrame* frame = &vm.frames[vm.frame_count++];
   frame->closure = closure;
   frame->ip = closure->function->bseq.code;
   frame->slots = vm.top - arg_cnt - 1;
+  frame->inline_site = NULL;
+  frame->open_upvalues = NULL;
+  return true;
+}
+
+static bool call_native(ObjNative* native, int arg_cnt) {
+  if (native->arity != arg_cnt && native->arity != -1) {
+    runtime_error("Expected %d arguments but got %d", native->arity, arg_cnt);
+    return false;
+  }
+  vm.fuel--;
+  Value* args = vm.top - arg_cnt;
+  if (!native->function(arg_cnt, args)) {
+    runtime_error("%s", AS_CSTR(args[-1]));
+    return false;
+  }
+  // The result is already in the callee's slot
+  vm.top = args;
   return true;
 }
 
@@ -101,13 +278,8 @@ static bool call_value(Value callee, int arg_cnt) {
       case OBJ_CLOSURE: {
         return call(AS_CLOSURE(callee), arg_cnt);
       }
-      case OBJ_NATIVE: {
-        NativeFn native = AS_NATIVE(callee);
-        Value result = native(arg_cnt, vm.top - arg_cnt);
-        vm.top -= arg_cnt + 1;
-        push(result);
-        return true;
-      }
+      case OBJ_NATIVE:
+        return call_native(AS_NATIVE(callee), arg_cnt);
       default:
         break;
     }
@@ -116,16 +288,177 @@ static bool call_value(Value callee, int arg_cnt) {
   return false;
 }
 
-static bool invoke_from_class(ObjClass* klass, ObjStr* name, int argCount) {
+static ObjClosure* find_cached_method(InvokeCache* cache, ObjClass* cls,
+                                      ObjShape* shape) {
+  for (int i = 0; i < cache->cnt; i++) {
+    InvokeCacheEntry* entry = &cache->entries[i];
+    if (entry->cls == cls && entry->shape == shape &&
+        entry->version == cls->version) {
+      return entry->method;
+    }
+  }
+  return NULL;
+}
+
+static void add_cached_method(InvokeCache* cache, ObjClass* cls,
+                              ObjShape* shape, ObjClosure* method) {
+  if (cache->cnt == -1) {
+    return;
+  }
+  // An entry the class's new methods made stale is reused
+  InvokeCacheEntry* entry = NULL;
+  for (int i = 0; i < cache->cnt; i++) {
+    if (cache->entries[i].cls == cls && cache->entries[i].shape == shape) {
+      entry = &cache->entries[i];
+      break;
+    }
+  }
+  if (entry == NULL) {
+    if (cache->cnt == INVOKE_CACHE_SIZE) {
+      cache->cnt = -1;
+      return;
+    }
+    entry = &cache->entries[cache->cnt++];
+  }
+  entry->shape = shape;
+  entry->cls = cls;
+  entry->version = cls->version;
+  entry->method = method;
+}
+
+static bool bind_method(ObjClass* cls, ObjStr* name) {
+  Value method;
+  if (!table_get(&cls->methods, name, &method)) {
+    runtime_error("Undefined property '%s'.", name->chars);
+    return false;
+  }
+  ObjBoundMethod* bound = new_bound_method(peek(0), AS_CLOSURE(method));
+  pop();
+  push(OBJ_VAL(bound));
+  return true;
+}
+
+/**
+ * Returns the open upvalue for `local`, a slot of `frame`, creating it if
+ * there is none yet. An existing one is found through vm.open_slots; only a
+ * new one is sorted into the frame's list, past its higher slots.
+ */
+static ObjUpvalue* capture_upvalue(CallFrame* frame, Value* local) {
+  ObjUpvalue* upvalue = vm.open_slots[local - vm.stack];
+  if (upvalue != NULL) {
+    return upvalue;
+  }
+
+  upvalue = new_upvalue(local);
+  ObjUpvalue** link = &frame->open_upvalues;
+  while (*link != NULL && (*link)->location > local) {
+    link = &(*link)->next;
+  }
+  upvalue->next = *link;
+  *link = upvalue;
+  vm.open_slots[local - vm.stack] = upvalue;
+  return upvalue;
+}
+
+/**
+ * Closes the open upvalues of `frame` from slot `last` up. A frame that
+ * captured nothing returns at the first test.
+ */
+static void close_upvalues(CallFrame* frame, Value* last) {
+  while (frame->open_upvalues != NULL &&
+         frame->open_upvalues->location >= last) {
+    ObjUpvalue* upvalue = frame->open_upvalues;
+    vm.open_slots[upvalue->location - vm.stack] = NULL;
+    upvalue->closed = *upvalue->location;
+    upvalue->location = &upvalue->closed;
+    frame->open_upvalues = upvalue->next;
+  }
+}
+
+static void reset_stack(void) {
+  // Closures that outlive the frames keep what their slots held
+  for (int i = vm.frame_count - 1; i >= 0; i--) {
+    close_upvalues(&vm.frames[i], vm.stack);
+  }
+  vm.top = vm.stack;
+  vm.frame_count = 0;
+}
+
+/**
+ * Calls `closure` by reusing `frame`: its receiver or callee and the
+ * `arg_cnt` arguments on top of the stack slide down over the caller's slots.
+ */
+static bool reuse_frame(CallFrame* frame, ObjClosure* closure, int arg_cnt) {
+  if (arg_cnt != closure->function->arity) {
+    runtime_error("Expected %d arguments but got %d", closure->function->arity,
+                  arg_cnt);
+    return false;
+  }
+  int needed = closure->function->stack_size + STACK_RESERVE -
+               (int)(vm.top - frame->slots);
+  if (vm.stack + vm.stack_capacity - vm.top < needed && !grow_stack(needed)) {
+    runtime_error("Stack overflow");
+    return false;
+  }
+#ifdef JIT
+  count_hotness(closure->function);
+#endif
+  vm.fuel--;
+
+  close_upvalues(frame, frame->slots);
+  memmove(frame->slots, vm.top - arg_cnt - 1,
+          sizeof(Value) * (size_t)(arg_cnt + 1));
+  vm.top = frame->slots + arg_cnt + 1;
+  frame->closure = closure;
+  frame->ip = closure->function->bseq.code;
+  return true;
+}
+
+/**
+ * Runs the call in tail position whose callee sits below the `arg_cnt`
+ * arguments on top of the stack by reusing `frame`. Callees that aren't
+ * closures are called normally, and the OP_RETURN after the call returns
+ * their result.
+ */
+static bool tail_call(CallFrame* frame, int arg_cnt) {
+  Value callee = peek(arg_cnt);
+  ObjClosure* closure;
+  if (IS_CLOSURE(callee)) {
+    closure = AS_CLOSURE(callee);
+  } else if (IS_BOUND_METHOD(callee)) {
+    ObjBoundMethod* bound = AS_BOUND_METHOD(callee);
+    vm.top[-arg_cnt - 1] = bound->receiver;
+    closure = bound->method;
+  } else {
+    return call_value(callee, arg_cnt);
+  }
+  return reuse_frame(frame, closure, arg_cnt);
+}
+
+static bool call_method(ObjClosure* method, int arg_cnt, CallFrame* tail) {
+  return tail != NULL ? reuse_frame(tail, method, arg_cnt)
+                      : call(method, arg_cnt);
+}
+
+static bool invoke_from_class(ObjClass* cls, ObjStr* name, int arg_cnt,
+                              InvokeCache* cache, ObjShape* shape,
+                              CallFrame* tail) {
   Value method;
-  if (!table_get(&klass->methods, name, &method)) {
+  if (!table_get(&cls->methods, name, &method)) {
     runtime_error("Undefined property '%s'", name->chars);
     return false;
   }
-  return call(AS_CLOSURE(method), argCount);
+  add_cached_method(cache, cls, shape, AS_CLOSURE(method));
+  return call_method(AS_CLOSURE(method), arg_cnt, tail);
 }
 
-static bool invoke(ObjStr* name, int arg_cnt) {
+/**
+ * Calls method `name` of the receiver below the `arg_cnt` arguments on top of
+ * the stack. A call in tail position passes the frame it reuses as `tail`,
+ * other calls pass NULL.
+ */
+static bool invoke(ObjStr* name, int arg_cnt, InvokeCache* cache,
+                   CallFrame* tail) {
   Value receiver = peek(arg_cnt);
 
   if (!IS_INSTANCE(receiver)) {
@@ -134,61 +467,142 @@ static bool invoke(ObjStr* name, int arg_cnt) {
   }
 
   ObjInstance* instance = AS_INSTANCE(receiver);
+  ObjClosure* cached =
+      find_cached_method(cache, instance->cls, instance->shape);
+  if (cached != NULL) {
+    return call_method(cached, arg_cnt, tail);
+  }
   Value value;
-  if (table_get(&instance->fields, name, &value)) {
+  if (instance_get_field(instance, name, &value)) {
     vm.top[-arg_cnt - 1] = value;
-    return call_value(value, arg_cnt);
+    return tail != NULL ? tail_call(tail, arg_cnt) : call_value(value, arg_cnt);
   }
-  return invoke_from_class(instance->cls, name, arg_cnt);
+  return invoke_from_class(instance->cls, name, arg_cnt, cache,
+                           instance->shape, tail);
 }
 
-static bool bind_method(ObjClass* cls, ObjStr* name) {
-  Value method;
-  if (!table_get(&cls->methods, name, &method)) {
-    runtime_error("Undefined property '%s'.", name->chars);
+/**
+ * Tests the guard of OP_INLINE_INVOKE: whether the receiver below the
+ * arguments is an instance whose method, as cached at the call site, is the
+ * closure of the inlined `function`.
+ */
+static inline bool invokes_inlined(InvokeCache* cache, ObjFunction* function) {
+  Value receiver = peek(function->arity);
+  if (!IS_INSTANCE(receiver)) {
     return false;
   }
-  ObjBoundMethod* bound = new_bound_method(peek(0), AS_CLOSURE(method));
-  pop();
-  push(OBJ_VAL(bound));
-  return true;
+  ObjInstance* instance = AS_INSTANCE(receiver);
+  ObjClosure* method =
+      find_cached_method(cache, instance->cls, instance->shape);
+  return method != NULL && method->function == function;
 }
 
-static ObjUpvalue* capture_upvalue(Value* local) {
-  ObjUpvalue* prev_upvalue = NULL;
-  ObjUpvalue* upvalue = vm.open_upvalues;
-  while (upvalue != NULL && upvalue->location > local) {
-    prev_upvalue = upvalue;
-    upvalue = upvalue->next;
+/**
+ * Starts the body that the guard at `site` inlined, for the callee below the
+ * `arg_cnt` arguments on top of the stack. The body addresses its locals
+ * from the callee's slot, as it would in its own frame.
+ */
+static inline void enter_inlined(CallFrame* frame, uint8_t* site,
+                                 int arg_cnt) {
+  frame->inline_site = site;
+  frame->caller_slots = frame->slots;
+  frame->slots = vm.top - arg_cnt - 1;
+}
+
+/** Leaves an inlined body, its result taking the callee's slot. */
+static inline void leave_inlined(CallFrame* frame) {
+  Value result = pop();
+  vm.top = frame->slots;
+  push(result);
+  frame->slots = frame->caller_slots;
+  frame->inline_site = NULL;
+}
+
+static void update_store_cache(PropertyCache* cache, ObjShape* shape,
+                               ObjStr* name) {
+  int slot = shape_find_slot(shape, name);
+  if (slot != -1) {
+    cache->transition = NULL;
+    cache->slot = slot;
+  } else {
+    cache->transition = shape_add_field(shape, name);
+    cache->slot = cache->transition->field_cnt - 1;
   }
+  cache->shape = shape;
+}
 
-  if (upvalue != NULL && upvalue->location == local) {
-    return upvalue;
+/**
+ * Replaces the instance on top of the stack by its property `name`: the
+ * field `cache` locates, or a method bound to it. Sets `field` if it read a
+ * field, which lets the site be quickened. Returns false on a runtime error.
+ */
+static bool get_property(ObjStr* name, PropertyCache* cache, bool* field) {
+  *field = false;
+  if (!IS_INSTANCE(peek(0))) {
+    runtime_error("Only instances have properties");
+    return false;
   }
+  ObjInstance* instance = AS_INSTANCE(peek(0));
+  if (instance->shape != cache->shape) {
+    int slot = shape_find_slot(instance->shape, name);
+    if (slot == -1) {
+      return bind_method(instance->cls, name);
+    }
+    cache->shape = instance->shape;
+    cache->transition = NULL;
+    cache->slot = slot;
+  }
+  *field = true;
+  vm.top[-1] = instance->fields[cache->slot];
+  return true;
+}
 
-  ObjUpvalue* created_upvalue = new_upvalue(local);
-  created_upvalue->next = upvalue;
-  if (prev_upvalue == NULL) {
-    vm.open_upvalues = created_upvalue;
+/**
+ * Stores the value on top of the stack into field `name` of the instance
+ * below it, leaving the value. Sets `field` if the store added no field,
+ * which lets the site be quickened. Returns false on a runtime error.
+ */
+static bool set_property(ObjStr* name, PropertyCache* cache, bool* field) {
+  *field = false;
+  if (!IS_INSTANCE(peek(1))) {
+    runtime_error("Only instances have fields");
+    return false;
+  }
+  ObjInstance* instance = AS_INSTANCE(peek(1));
+  if (instance->shape != cache->shape) {
+    update_store_cache(cache, instance->shape, name);
+  }
+  if (cache->transition != NULL) {
+    set_instance_shape(instance, cache->transition);
   } else {
-    prev_upvalue->next = created_upvalue;
+    *field = true;
   }
-  return created_upvalue;
+  instance->fields[cache->slot] = peek(0);
+  Value value = pop();
+  pop();
+  push(value);
+  return true;
 }
 
-static void close_upvalues(Value* last) {
-  while (vm.open_upvalues != NULL && vm.open_upvalues->location >= last) {
-    ObjUpvalue* upvalue = vm.open_upvalues;
-    upvalue->closed = *upvalue->location;
-    upvalue->location = &upvalue->closed;
-    vm.open_upvalues = upvalue->next;
+/**
+ * Calls method `name` of the superclass on top of the stack, reusing `tail`
+ * like invoke().
+ */
+static bool super_invoke(ObjStr* name, int arg_cnt, InvokeCache* cache,
+                         CallFrame* tail) {
+  ObjClass* superclass = AS_CLASS(pop());
+  ObjClosure* cached = find_cached_method(cache, superclass, NULL);
+  if (cached != NULL) {
+    return call_method(cached, arg_cnt, tail);
   }
+  return invoke_from_class(superclass, name, arg_cnt, cache, NULL, tail);
 }
 
 static void define_method(ObjStr* name) {
   Value method = peek(0);
   ObjClass* cls = AS_CLASS(peek(1));
   table_set(&cls->methods, name, method);
+  cls->version++;
   pop();
 }
 
@@ -212,7 +626,51 @@ static void concat_str(void) {
   push(OBJ_VAL(result));
 }
 
+/**
+ * Runs the arithmetic or comparison `op` on the two topmost values when they
+ * aren't both numbers, the slow path of the inline forms.
+ */
+static bool binary_slow(int op) {
+  if (op == OP_ADD && IS_STR(peek(0)) && IS_STR(peek(1))) {
+    concat_str();
+    return true;
+  }
+  if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) {
+    runtime_error(op == OP_ADD ? "Operands must be two numbers or strings"
+                               : "Operands must be numbers");
+    return false;
+  }
+  double b = AS_NUMBER(pop());
+  double a = AS_NUMBER(pop());
+  switch (op) {
+    case OP_GREATER:
+      push(BOOL_VAL(a > b));
+      break;
+    case OP_LESS:
+      push(BOOL_VAL(a < b));
+      break;
+    case OP_ADD:
+      push(NUMBER_VAL(a + b));
+      break;
+    case OP_SUBTRACT:
+      push(NUMBER_VAL(a - b));
+      break;
+    case OP_MULTIPLY:
+      push(NUMBER_VAL(a * b));
+      break;
+    default:
+      push(NUMBER_VAL(a / b));
+      break;
+  }
+  return true;
+}
+
 void init_vm(void) {
+  vm.frames = NULL;
+  vm.frame_capacity = 0;
+  vm.stack = NULL;
+  vm.stack_capacity = 0;
+  vm.open_slots = NULL;
   reset_stack();
   vm.objects = NULL;
   vm.bytes_allocated = 0;
@@ -222,19 +680,69 @@ void init_vm(void) {
   vm.gray_capacity = 0;
   vm.gray_stack = NULL;
 
-  init_table(&vm.globals);
+  init_table(&vm.global_slots);
+  init_table(&vm.global_consts);
+  init_table(&vm.assigned_globals);
+  init_table(&vm.inline_functions);
+  init_table(&vm.inline_methods);
+  init_valarr(&vm.global_names);
+  init_valarr(&vm.global_vals);
   init_table(&vm.strings);
 
   vm.init_str = NULL;
+  vm.empty_shape = NULL;
+  vm.exception = NIL_VAL;
+  vm.fuel = INT64_MAX;
+  for (int i = 0; i < INTRINSIC_CNT; i++) {
+    vm.intrinsics[i] = NULL;
+  }
+  vm.frames = ALLOCATE(CallFrame, FRAMES_INIT);
+  vm.frame_capacity = FRAMES_INIT;
+  vm.stack = ALLOCATE(Value, STACK_INIT);
+  vm.open_slots = ALLOCATE(ObjUpvalue*, STACK_INIT);
+  for (int i = 0; i < STACK_INIT; i++) {
+    vm.open_slots[i] = NULL;
+  }
+  vm.stack_capacity = STACK_INIT;
+  reset_stack();
   vm.init_str = copy_str("init", 4);
+  vm.empty_shape = new_shape(NULL, NULL);
+#ifdef JIT
+  vm.jit_enabled = getenv("LANG_NO_JIT") == NULL;
+#endif
+#ifdef REGISTER_OPS
+  vm.register_ops = getenv("LANG_NO_REGISTERS") == NULL;
+#else
+  vm.register_ops = false;
+#endif
+  vm.debug_output = getenv("LANG_NO_TRACE") == NULL;
+  const char* opt_level = getenv("LANG_OPT_LEVEL");
+  vm.opt_level = opt_level != NULL ? atoi(opt_level) : 1;
 
-  define_native("clock", clock_native);
+  define_native("clock", clock_native, 0);
+  for (int i = 0; i < INTRINSIC_CNT; i++) {
+    vm.intrinsics[i] = define_native(intrinsics[i].name, intrinsics[i].function,
+                                     intrinsics[i].arity);
+  }
 }
 
 void free_vm(void) {
-  free_table(&vm.globals);
+  free_table(&vm.global_slots);
+  free_table(&vm.global_consts);
+  free_table(&vm.assigned_globals);
+  free_table(&vm.inline_functions);
+  free_table(&vm.inline_methods);
+  free_valarr(&vm.global_names);
+  free_valarr(&vm.global_vals);
   free_table(&vm.strings);
   vm.init_str = NULL;
+  vm.empty_shape = NULL;
+  reset_stack();
+  FREE_ARR(CallFrame, vm.frames, (size_t)vm.frame_capacity);
+  FREE_ARR(Value, vm.stack, (size_t)vm.stack_capacity);
+  FREE_ARR(ObjUpvalue*, vm.open_slots, (size_t)vm.stack_capacity);
+  vm.frame_capacity = 0;
+  vm.stack_capacity = 0;
   free_objects();
 }
 
@@ -244,298 +752,1357 @@ void free_vm(void) {
 #define READ_SHORT() \
   (frame->ip += 2, (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
 #define READ_STR() AS_STR(READ_CONSTANT())
-#define BINARY_OP(value_type, op)                     \
+#define READ_PROP_CACHE() \
+  (&frame->closure->function->bseq.prop_caches[READ_SHORT()])
+#define READ_INVOKE_CACHE() \
+  (&frame->closure->function->bseq.invoke_caches[READ_SHORT()])
+#define READ_LOOP_CACHE() \
+  (&frame->closure->function->bseq.loop_caches[READ_SHORT()])
+#define READ_INDEX_LONG()  \
+  (frame->ip += 3,         \
+   (frame->ip[-3] << 16) | (frame->ip[-2] << 8) | frame->ip[-1])
+#define READ_CONSTANT_LONG() \
+  (frame->closure->function->bseq.consts.vals[READ_INDEX_LONG()])
+#define READ_STR_LONG() AS_STR(READ_CONSTANT_LONG())
+#define READ_FAR_JUMP()                  \
+  (frame->closure->function->bseq.code + \
+   frame->closure->function->bseq.far_jumps[READ_SHORT()])
+#define FOR_LIMIT(mode, operand)                               \
+  (((mode) & FOR_CONST_LIMIT)                                  \
+       ? frame->closure->function->bseq.consts.vals[(operand)] \
+       : frame->slots[(operand)])
+#define QUICKEN(instr, op) (*(instr) = (uint8_t)(op))
+#define DEQUICKEN(instr, op)    \
+  do {                          \
+    frame->ip = (instr);        \
+    *frame->ip = (uint8_t)(op); \
+    DISPATCH();                 \
+  } while (false)
+#define BINARY_OP(value_type, op, quick_op)           \
   do {                                                \
     if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
       runtime_error("Operands must be numbers");      \
       return INTERPRET_RUNTIME_ERROR;                 \
     }                                                 \
+    QUICKEN(frame->ip - 1, quick_op);                 \
     double b = AS_NUMBER(pop());                      \
     double a = AS_NUMBER(pop());                      \
     push(value_type(a op b));                         \
   } while (false)
+// Numbers are computed inline, everything else goes through binary_slow()
+#define REGISTER_OP(value_type, op, generic_op, right)   \
+  do {                                                   \
+    uint8_t dst = READ_BYTE();                           \
+    Value a = frame->slots[READ_BYTE()];                 \
+    Value b = (right);                                   \
+    Value result;                                        \
+    if (IS_NUMBER(a) && IS_NUMBER(b)) {                  \
+      result = value_type(AS_NUMBER(a) op AS_NUMBER(b)); \
+    } else {                                             \
+      push(a);                                           \
+      push(b);                                           \
+      if (!binary_slow(generic_op)) {                    \
+        return INTERPRET_RUNTIME_ERROR;                  \
+      }                                                  \
+      result = pop();                                    \
+    }                                                    \
+    if (dst == REG_PUSH) {                               \
+      push(result);                                      \
+    } else {                                             \
+      frame->slots[dst] = result;                        \
+    }                                                    \
+  } while (false)
+#define BINARY_NUM_OP(value_type, op, generic_op)     \
+  do {                                                \
+    if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
+      DEQUICKEN(frame->ip - 1, generic_op);           \
+    }                                                 \
+    double b = AS_NUMBER(pop());                      \
+    double a = AS_NUMBER(pop());                      \
+    push(value_type(a op b));                         \
+  } while (false)
+
+/** Returns whether the capture with `flags` and `index` takes a cell. */
+static bool captures_cell(CallFrame* frame, uint8_t flags, int index) {
+  if (flags & CAPTURE_LOCAL) {
+    return (flags & (CAPTURE_VALUE | CAPTURE_FRAME)) != 0;
+  }
+  return is_cell(frame->closure, frame->closure->upvalues[index]);
+}
+
+/**
+ * Creates the closure of `function` for OP_CLOSURE, pushes it and fills in
+ * its upvalues from the captures that follow.
+ */
+static void make_closure(CallFrame* frame, ObjFunction* function) {
+  int cell_cnt = 0;
+  uint8_t* ip = frame->ip;
+  for (int i = 0; i < function->upvalue_cnt; i++) {
+    uint8_t flags = *ip++;
+    int index = *ip++;
+    if (flags & CAPTURE_WIDE) {
+      index = (index << 8) | *ip++;
+    }
+    cell_cnt += captures_cell(frame, flags, index);
+  }
+
+  ObjClosure* closure = new_closure(function, cell_cnt);
+  push(OBJ_VAL(closure));
+  ObjUpvalue* cell = closure->cells;
+  for (int i = 0; i < closure->upvalue_cnt; i++) {
+    uint8_t flags = READ_BYTE();
+    int index = (flags & CAPTURE_WIDE) ? READ_SHORT() : READ_BYTE();
+    if ((flags & CAPTURE_FRAME) && (flags & CAPTURE_LOCAL)) {
+      cell->location = frame->slots + index;
+      closure->upvalues[i] = cell++;
+    } else if (captures_cell(frame, flags, index)) {
+      cell->closed = (flags & CAPTURE_LOCAL)
+                         ? frame->slots[index]
+                         : frame->closure->upvalues[index]->closed;
+      closure->upvalues[i] = cell++;
+    } else if (flags & CAPTURE_LOCAL) {
+      closure->upvalues[i] = capture_upvalue(frame, frame->slots + index);
+    } else {
+      closure->upvalues[i] = frame->closure->upvalues[index];
+    }
+  }
+}
+
+#ifdef JIT
+// Runtime helpers for jit.c. Each one runs a single instruction like its case
+// in run(), except that it never quickens: native code does not read opcodes.
+
+int jit_get_global(CallFrame* frame) {
+  uint16_t slot = READ_SHORT();
+  Value value = vm.global_vals.vals[slot];
+  if (IS_EMPTY(value)) {
+    runtime_error("Undefined variable '%s'",
+                  AS_CSTR(vm.global_names.vals[slot]));
+    return JIT_ERROR;
+  }
+  push(value);
+  return JIT_CONTINUE;
+}
+
+int jit_define_global(CallFrame* frame) {
+  uint16_t slot = READ_SHORT();
+  vm.global_vals.vals[slot] = peek(0);
+  pop();
+  return JIT_CONTINUE;
+}
+
+int jit_set_global(CallFrame* frame) {
+  uint16_t slot = READ_SHORT();
+  if (IS_EMPTY(vm.global_vals.vals[slot])) {
+    runtime_error("Undefined variable '%s'",
+                  AS_CSTR(vm.global_names.vals[slot]));
+    return JIT_ERROR;
+  }
+  vm.global_vals.vals[slot] = peek(0);
+  return JIT_CONTINUE;
+}
+
+int jit_get_upvalue(CallFrame* frame) {
+  uint8_t slot = READ_BYTE();
+  push(*frame->closure->upvalues[slot]->location);
+  return JIT_CONTINUE;
+}
+
+int jit_set_upvalue(CallFrame* frame) {
+  uint8_t slot = READ_BYTE();
+  *frame->closure->upvalues[slot]->location = peek(0);
+  return JIT_CONTINUE;
+}
+
+int jit_get_property(CallFrame* frame) {
+  ObjStr* name = READ_STR();
+  bool field;
+  return get_property(name, READ_PROP_CACHE(), &field) ? JIT_CONTINUE
+                                                       : JIT_ERROR;
+}
+
+int jit_set_property(CallFrame* frame) {
+  ObjStr* name = READ_STR();
+  bool field;
+  return set_property(name, READ_PROP_CACHE(), &field) ? JIT_CONTINUE
+                                                       : JIT_ERROR;
+}
+
+int jit_equal(CallFrame* frame) {
+  (void)frame;
+  Value b = pop();
+  Value a = pop();
+  push(BOOL_VAL(are_equal(a, b)));
+  return JIT_CONTINUE;
+}
+
+/** The slow path of the inline arithmetic in jit.c, reached on non-numbers. */
+int jit_binary(CallFrame* frame, int op) {
+  (void)frame;
+  return binary_slow(op) ? JIT_CONTINUE : JIT_ERROR;
+}
+
+int jit_not(CallFrame* frame) {
+  (void)frame;
+  push(BOOL_VAL(is_falsey(pop())));
+  return JIT_CONTINUE;
+}
+
+int jit_negate(CallFrame* frame) {
+  (void)frame;
+  if (!IS_NUMBER(peek(0))) {
+    runtime_error("Operand must be a number");
+    return JIT_ERROR;
+  }
+  push(NUMBER_VAL(-AS_NUMBER(pop())));
+  return JIT_CONTINUE;
+}
+
+int jit_print(CallFrame* frame) {
+  (void)frame;
+  print_val(pop());
+  printf("\n");
+  return JIT_CONTINUE;
+}
+
+// Calls leave native code once they pushed a frame, so that run_jit() or the
+// interpreter picks up the callee. frame->ip already points past the call.
+
+int jit_call(CallFrame* frame) {
+  int frame_cnt = vm.frame_count;
+  int arg_cnt = READ_BYTE();
+  if (!call_value(peek(arg_cnt), arg_cnt)) {
+    return JIT_ERROR;
+  }
+  return vm.frame_count == frame_cnt ? JIT_CONTINUE : JIT_EXIT;
+}
+
+int jit_intrinsic(CallFrame* frame) {
+  int frame_cnt = vm.frame_count;
+  uint8_t id = READ_BYTE();
+  if (run_intrinsic(id)) {
+    return JIT_CONTINUE;
+  }
+  int arg_cnt = intrinsics[id].arity;
+  if (!call_value(peek(arg_cnt), arg_cnt)) {
+    return JIT_ERROR;
+  }
+  return vm.frame_count == frame_cnt ? JIT_CONTINUE : JIT_EXIT;
+}
+
+int jit_tail_call(CallFrame* frame) {
+  int arg_cnt = READ_BYTE();
+  return tail_call(frame, arg_cnt) ? JIT_EXIT : JIT_ERROR;
+}
+
+int jit_invoke(CallFrame* frame) {
+  int frame_cnt = vm.frame_count;
+  ObjStr* method = READ_STR();
+  int arg_cnt = READ_BYTE();
+  InvokeCache* cache = READ_INVOKE_CACHE();
+  if (!invoke(method, arg_cnt, cache, NULL)) {
+    return JIT_ERROR;
+  }
+  return vm.frame_count == frame_cnt ? JIT_CONTINUE : JIT_EXIT;
+}
+
+int jit_super_invoke(CallFrame* frame) {
+  int frame_cnt = vm.frame_count;
+  ObjStr* method = READ_STR();
+  int arg_cnt = READ_BYTE();
+  InvokeCache* cache = READ_INVOKE_CACHE();
+  if (!super_invoke(method, arg_cnt, cache, NULL)) {
+    return JIT_ERROR;
+  }
+  return vm.frame_count == frame_cnt ? JIT_CONTINUE : JIT_EXIT;
+}
+
+int jit_tail_invoke(CallFrame* frame) {
+  ObjStr* method = READ_STR();
+  int arg_cnt = READ_BYTE();
+  InvokeCache* cache = READ_INVOKE_CACHE();
+  return invoke(method, arg_cnt, cache, frame) ? JIT_EXIT : JIT_ERROR;
+}
+
+int jit_tail_super_invoke(CallFrame* frame) {
+  ObjStr* method = READ_STR();
+  int arg_cnt = READ_BYTE();
+  InvokeCache* cache = READ_INVOKE_CACHE();
+  return super_invoke(method, arg_cnt, cache, frame) ? JIT_EXIT : JIT_ERROR;
+}
+
+// A failed inline guard leaves native code even when the call pushed no
+// frame, so that execution resumes past the inlined body.
+
+int jit_inline_call(CallFrame* frame) {
+  uint8_t* site = frame->ip - 1;
+  ObjFunction* function = AS_FUNCTION(READ_CONSTANT());
+  uint16_t skip = READ_SHORT();
+  Value callee = peek(function->arity);
+  if (IS_CLOSURE(callee) && AS_CLOSURE(callee)->function == function) {
+    enter_inlined(frame, site, function->arity);
+    return JIT_CONTINUE;
+  }
+  frame->ip += skip;
+  return call_value(callee, function->arity) ? JIT_EXIT : JIT_ERROR;
+}
+
+int jit_inline_invoke(CallFrame* frame) {
+  uint8_t* site = frame->ip - 1;
+  ObjStr* method = READ_STR();
+  InvokeCache* cache = READ_INVOKE_CACHE();
+  ObjFunction* function = AS_FUNCTION(READ_CONSTANT());
+  uint16_t skip = READ_SHORT();
+  if (invokes_inlined(cache, function)) {
+    enter_inlined(frame, site, function->arity);
+    return JIT_CONTINUE;
+  }
+  frame->ip += skip;
+  return invoke(method, function->arity, cache, NULL) ? JIT_EXIT : JIT_ERROR;
+}
+
+int jit_inline_return(CallFrame* frame) {
+  leave_inlined(frame);
+  return JIT_CONTINUE;
+}
+
+int jit_closure(CallFrame* frame) {
+  Value constant = frame->ip[-1] == OP_CLOSURE_LONG ? READ_CONSTANT_LONG()
+                                                    : READ_CONSTANT();
+  make_closure(frame, AS_FUNCTION(constant));
+  return JIT_CONTINUE;
+}
+
+int jit_close_upvalue(CallFrame* frame) {
+  close_upvalues(frame, vm.top - 1);
+  pop();
+  return JIT_CONTINUE;
+}
+
+/**
+ * Runs native code for the top frame, and for every compiled callee it
+ * enters, until an instruction needs the interpreter or the fuel runs out.
+ * Returns false after a runtime error.
+ */
+static bool run_jit(void) {
+  for (;;) {
+    CallFrame* frame = &vm.frames[vm.frame_count - 1];
+    JitCode* jit = frame->closure->function->jit;
+    if (jit == NULL) {
+      return true;
+    }
+    switch (jit_execute(jit, frame)) {
+      case JIT_EXIT:
+        if (vm.fuel <= 0) {
+          return true;
+        }
+        break;
+      case JIT_ERROR:
+        return false;
+      default:
+        return true;
+    }
+  }
+}
+
+#define JIT_ENTER()                              \
+  do {                                           \
+    if (frame->closure->function->jit != NULL) { \
+      if (!run_jit()) {                          \
+        return INTERPRET_RUNTIME_ERROR;          \
+      }                                          \
+      frame = &vm.frames[vm.frame_count - 1];    \
+    }                                            \
+    CHECK_FUEL();                                \
+  } while (false)
+#define JIT_HOT_LOOP()                       \
+  do {                                       \
+    count_hotness(frame->closure->function); \
+    JIT_ENTER();                             \
+  } while (false)
+#else
+#define JIT_ENTER() CHECK_FUEL()
+#define JIT_HOT_LOOP() ((void)0)
+#endif
+
+#ifdef DEBUG_TRACE_EXECUTION
+static void trace_instr(CallFrame* frame) {
+  if (!vm.debug_output) {
+    return;
+  }
+  printf("          ");
+  for (Value* val = vm.stack; val < vm.top; val++) {
+    printf("[ ");
+    print_val(*val);
+    printf(" ]");
+  }
+  printf("\n");
+  disassemble_instr(&frame->closure->function->bseq,
+                    (int)(frame->ip - frame->closure->function->bseq.code));
+}
+#define TRACE_INSTR() trace_instr(frame)
+#else
+#define TRACE_INSTR() ((void)0)
+#endif
+
+// With COMPUTED_GOTO every handler ends in its own indirect jump through
+// dispatch_table, so the branch predictor sees one dispatch site per opcode.
+// Otherwise all handlers jump back to a single switch. While a loop is being
+// traced, every instruction first goes to trace_record(): the threaded loop
+// swaps in record_table for that, the switch loop checks a flag.
+#ifdef COMPUTED_GOTO
+#define INTERPRET_LOOP DISPATCH();
+#define CASE(op) label_##op
+#define DISPATCH()               \
+  do {                           \
+    TRACE_INSTR();               \
+    goto *dispatch[READ_BYTE()]; \
+  } while (false)
+#define IS_RECORDING() (dispatch != dispatch_table)
+#define START_RECORDING() (dispatch = record_table)
+#else
+#define INTERPRET_LOOP                     \
+  loop:                                    \
+  TRACE_INSTR();                           \
+  if (recording && !trace_record(frame)) { \
+    recording = false;                     \
+  }                                        \
+  switch (READ_BYTE())
+#define CASE(op) case op
+#define DISPATCH() goto loop
+#define IS_RECORDING() (recording)
+#define START_RECORDING() (recording = true)
+#endif
+
+// Suspends once calls and back-edges have used up the fuel. Every frame keeps
+// its ip in memory, so resume() only has to start the loop again. A recording
+// is left to finish its iteration first.
+#define CHECK_FUEL()                             \
+  do {                                           \
+    if (vm.fuel <= 0 && !IS_RECORDING()) {       \
+      return INTERPRET_SUSPENDED;                \
+    }                                            \
+  } while (false)
+
+// Counts a taken back-edge of the loop whose instruction is at `loop`, and
+// runs its trace or starts recording one once it is hot
+#define BACK_EDGE(loop, cache)                            \
+  do {                                                    \
+    vm.fuel--;                                            \
+    if (!IS_RECORDING()) {                                \
+      if ((cache)->trace != NULL) {                       \
+        run_trace((cache)->trace, frame);                 \
+      } else if ((cache)->hotness >= 0 &&                 \
+                 ++(cache)->hotness == TRACE_THRESHOLD && \
+                 trace_start(frame, (loop), (cache))) {   \
+        START_RECORDING();                                \
+      }                                                   \
+    }                                                     \
+    JIT_HOT_LOOP();                                       \
+    CHECK_FUEL();                                         \
+  } while (false)
+
+#if defined(COMPUTED_GOTO) && defined(__GNUC__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#endif
 
 static InterpretResult run(void) {
   CallFrame* frame = &vm.frames[vm.frame_count - 1];
-#ifdef DEBUG_TRACE_EXECUTION
-  printf("--- execution ---");
+#ifdef COMPUTED_GOTO
+  static void* dispatch_table[] = {
+      [OP_CONSTANT] = &&label_OP_CONSTANT,
+      [OP_NIL] = &&label_OP_NIL,
+      [OP_TRUE] = &&label_OP_TRUE,
+      [OP_FALSE] = &&label_OP_FALSE,
+      [OP_POP] = &&label_OP_POP,
+      [OP_GET_LOCAL] = &&label_OP_GET_LOCAL,
+      [OP_SET_LOCAL] = &&label_OP_SET_LOCAL,
+      [OP_GET_GLOBAL] = &&label_OP_GET_GLOBAL,
+      [OP_DEFINE_GLOBAL] = &&label_OP_DEFINE_GLOBAL,
+      [OP_SET_GLOBAL] = &&label_OP_SET_GLOBAL,
+      [OP_GET_UPVALUE] = &&label_OP_GET_UPVALUE,
+      [OP_SET_UPVALUE] = &&label_OP_SET_UPVALUE,
+      [OP_GET_PROPERTY] = &&label_OP_GET_PROPERTY,
+      [OP_SET_PROPERTY] = &&label_OP_SET_PROPERTY,
+      [OP_GET_SUPER] = &&label_OP_GET_SUPER,
+      [OP_EQUAL] = &&label_OP_EQUAL,
+      [OP_GREATER] = &&label_OP_GREATER,
+      [OP_LESS] = &&label_OP_LESS,
+      [OP_ADD] = &&label_OP_ADD,
+      [OP_SUBTRACT] = &&label_OP_SUBTRACT,
+      [OP_MULTIPLY] = &&label_OP_MULTIPLY,
+      [OP_DIVIDE] = &&label_OP_DIVIDE,
+      [OP_NOT] = &&label_OP_NOT,
+      [OP_NEGATE] = &&label_OP_NEGATE,
+      [OP_PRINT] = &&label_OP_PRINT,
+      [OP_JUMP] = &&label_OP_JUMP,
+      [OP_JUMP_IF_FALSE] = &&label_OP_JUMP_IF_FALSE,
+      [OP_LOOP] = &&label_OP_LOOP,
+      [OP_FOR_PREP] = &&label_OP_FOR_PREP,
+      [OP_FOR_LOOP] = &&label_OP_FOR_LOOP,
+      [OP_CALL] = &&label_OP_CALL,
+      [OP_TAIL_CALL] = &&label_OP_TAIL_CALL,
+      [OP_INTRINSIC] = &&label_OP_INTRINSIC,
+      [OP_INVOKE] = &&label_OP_INVOKE,
+      [OP_SUPER_INVOKE] = &&label_OP_SUPER_INVOKE,
+      [OP_TAIL_INVOKE] = &&label_OP_TAIL_INVOKE,
+      [OP_TAIL_SUPER_INVOKE] = &&label_OP_TAIL_SUPER_INVOKE,
+      [OP_INLINE_CALL] = &&label_OP_INLINE_CALL,
+      [OP_INLINE_INVOKE] = &&label_OP_INLINE_INVOKE,
+      [OP_INLINE_RETURN] = &&label_OP_INLINE_RETURN,
+      [OP_CLOSURE] = &&label_OP_CLOSURE,
+      [OP_CLOSE_UPVALUE] = &&label_OP_CLOSE_UPVALUE,
+      [OP_RETURN] = &&label_OP_RETURN,
+      [OP_THROW] = &&label_OP_THROW,
+      [OP_CLASS] = &&label_OP_CLASS,
+      [OP_METHOD] = &&label_OP_METHOD,
+      [OP_INHERIT] = &&label_OP_INHERIT,
+      [OP_CONSTANT_LONG] = &&label_OP_CONSTANT_LONG,
+      [OP_GET_LOCAL_LONG] = &&label_OP_GET_LOCAL_LONG,
+      [OP_SET_LOCAL_LONG] = &&label_OP_SET_LOCAL_LONG,
+      [OP_GET_UPVALUE_LONG] = &&label_OP_GET_UPVALUE_LONG,
+      [OP_SET_UPVALUE_LONG] = &&label_OP_SET_UPVALUE_LONG,
+      [OP_JUMP_FAR] = &&label_OP_JUMP_FAR,
+      [OP_JUMP_IF_FALSE_FAR] = &&label_OP_JUMP_IF_FALSE_FAR,
+      [OP_JUMP_IF_FALSE_POP_FAR] = &&label_OP_JUMP_IF_FALSE_POP_FAR,
+      [OP_LOOP_FAR] = &&label_OP_LOOP_FAR,
+      [OP_CLOSURE_LONG] = &&label_OP_CLOSURE_LONG,
+      [OP_GET_PROPERTY_LONG] = &&label_OP_GET_PROPERTY_LONG,
+      [OP_SET_PROPERTY_LONG] = &&label_OP_SET_PROPERTY_LONG,
+      [OP_GET_SUPER_LONG] = &&label_OP_GET_SUPER_LONG,
+      [OP_INVOKE_LONG] = &&label_OP_INVOKE_LONG,
+      [OP_SUPER_INVOKE_LONG] = &&label_OP_SUPER_INVOKE_LONG,
+      [OP_TAIL_INVOKE_LONG] = &&label_OP_TAIL_INVOKE_LONG,
+      [OP_TAIL_SUPER_INVOKE_LONG] = &&label_OP_TAIL_SUPER_INVOKE_LONG,
+      [OP_CLASS_LONG] = &&label_OP_CLASS_LONG,
+      [OP_METHOD_LONG] = &&label_OP_METHOD_LONG,
+      [OP_GET_LOCAL_LOCAL] = &&label_OP_GET_LOCAL_LOCAL,
+      [OP_GET_LOCAL_CONSTANT] = &&label_OP_GET_LOCAL_CONSTANT,
+      [OP_GET_LOCAL_PROPERTY] = &&label_OP_GET_LOCAL_PROPERTY,
+      [OP_SET_LOCAL_POP] = &&label_OP_SET_LOCAL_POP,
+      [OP_JUMP_IF_FALSE_POP] = &&label_OP_JUMP_IF_FALSE_POP,
+      [OP_JUMP_IF_TRUE_POP] = &&label_OP_JUMP_IF_TRUE_POP,
+      [OP_ADD_RR] = &&label_OP_ADD_RR,
+      [OP_ADD_RK] = &&label_OP_ADD_RK,
+      [OP_SUBTRACT_RR] = &&label_OP_SUBTRACT_RR,
+      [OP_SUBTRACT_RK] = &&label_OP_SUBTRACT_RK,
+      [OP_MULTIPLY_RR] = &&label_OP_MULTIPLY_RR,
+      [OP_MULTIPLY_RK] = &&label_OP_MULTIPLY_RK,
+      [OP_DIVIDE_RR] = &&label_OP_DIVIDE_RR,
+      [OP_DIVIDE_RK] = &&label_OP_DIVIDE_RK,
+      [OP_LESS_RR] = &&label_OP_LESS_RR,
+      [OP_LESS_RK] = &&label_OP_LESS_RK,
+      [OP_GREATER_RR] = &&label_OP_GREATER_RR,
+      [OP_GREATER_RK] = &&label_OP_GREATER_RK,
+      [OP_GET_FIELD] = &&label_OP_GET_FIELD,
+      [OP_SET_FIELD] = &&label_OP_SET_FIELD,
+      [OP_GET_LOCAL_FIELD] = &&label_OP_GET_LOCAL_FIELD,
+      [OP_GET_FIELD_LONG] = &&label_OP_GET_FIELD_LONG,
+      [OP_SET_FIELD_LONG] = &&label_OP_SET_FIELD_LONG,
+      [OP_GREATER_NUM] = &&label_OP_GREATER_NUM,
+      [OP_LESS_NUM] = &&label_OP_LESS_NUM,
+      [OP_ADD_NUM] = &&label_OP_ADD_NUM,
+      [OP_ADD_STR] = &&label_OP_ADD_STR,
+      [OP_SUBTRACT_NUM] = &&label_OP_SUBTRACT_NUM,
+      [OP_MULTIPLY_NUM] = &&label_OP_MULTIPLY_NUM,
+      [OP_DIVIDE_NUM] = &&label_OP_DIVIDE_NUM,
+  };
+  static void* record_table[] = {
+      [0 ... UINT8_MAX] = &&record,
+  };
+  void** dispatch = dispatch_table;
+#else
+  bool recording = false;
 #endif
-  for (;;) {
 #ifdef DEBUG_TRACE_EXECUTION
-    printf("          ");
-    for (Value* val = vm.stack; val < vm.top; val++) {
-      printf("[ ");
-      print_val(*val);
-      printf(" ]");
-    }
-    printf("\n");
-    disassemble_instr(&frame->closure->function->bseq,
-                      (int)(frame->ip - frame->closure->function->bseq.code));
+  if (vm.debug_output) {
+    printf("--- execution ---");
+  }
 #endif
-    uint8_t instr;
-    switch (instr = READ_BYTE()) {
-      case OP_CONSTANT: {
-        Value constant = READ_CONSTANT();
-        push(constant);
-        break;
+  JIT_ENTER();
+  INTERPRET_LOOP {
+    CASE(OP_CONSTANT): {
+      Value constant = READ_CONSTANT();
+      push(constant);
+      DISPATCH();
+    }
+    CASE(OP_NIL):
+      push(NIL_VAL);
+      DISPATCH();
+    CASE(OP_TRUE):
+      push(BOOL_VAL(true));
+      DISPATCH();
+    CASE(OP_FALSE):
+      push(BOOL_VAL(false));
+      DISPATCH();
+    CASE(OP_POP):
+      pop();
+      DISPATCH();
+    CASE(OP_GET_LOCAL): {
+      uint8_t slot = READ_BYTE();
+      push(frame->slots[slot]);
+      DISPATCH();
+    }
+    CASE(OP_GET_LOCAL_LOCAL): {
+      uint8_t first = READ_BYTE();
+      uint8_t second = READ_BYTE();
+      vm.top[0] = frame->slots[first];
+      vm.top[1] = frame->slots[second];
+      vm.top += 2;
+      DISPATCH();
+    }
+    CASE(OP_GET_LOCAL_CONSTANT): {
+      uint8_t slot = READ_BYTE();
+      vm.top[0] = frame->slots[slot];
+      vm.top[1] = READ_CONSTANT();
+      vm.top += 2;
+      DISPATCH();
+    }
+    CASE(OP_SET_LOCAL): {
+      uint8_t slot = READ_BYTE();
+      frame->slots[slot] = peek(0);
+      DISPATCH();
+    }
+    CASE(OP_SET_LOCAL_POP): {
+      uint8_t slot = READ_BYTE();
+      frame->slots[slot] = pop();
+      DISPATCH();
+    }
+    CASE(OP_GET_GLOBAL): {
+      uint16_t slot = READ_SHORT();
+      Value value = vm.global_vals.vals[slot];
+      if (IS_EMPTY(value)) {
+        runtime_error("Undefined variable '%s'",
+                      AS_CSTR(vm.global_names.vals[slot]));
+        return INTERPRET_RUNTIME_ERROR;
       }
-      case OP_NIL:
-        push(NIL_VAL);
-        break;
-      case OP_TRUE:
-        push(BOOL_VAL(true));
-        break;
-      case OP_FALSE:
-        push(BOOL_VAL(false));
-        break;
-      case OP_POP:
-        pop();
-        break;
-      case OP_GET_LOCAL: {
-        uint8_t slot = READ_BYTE();
-        push(frame->slots[slot]);
-        break;
+      push(value);
+      DISPATCH();
+    }
+    CASE(OP_DEFINE_GLOBAL): {
+      uint16_t slot = READ_SHORT();
+      vm.global_vals.vals[slot] = peek(0);
+      pop();
+      DISPATCH();
+    }
+    CASE(OP_SET_GLOBAL): {
+      uint16_t slot = READ_SHORT();
+      if (IS_EMPTY(vm.global_vals.vals[slot])) {
+        runtime_error("Undefined variable '%s'",
+                      AS_CSTR(vm.global_names.vals[slot]));
+        return INTERPRET_RUNTIME_ERROR;
       }
-      case OP_SET_LOCAL: {
-        uint8_t slot = READ_BYTE();
-        frame->slots[slot] = peek(0);
-        break;
+      vm.global_vals.vals[slot] = peek(0);
+      DISPATCH();
+    }
+    CASE(OP_GET_UPVALUE): {
+      uint8_t slot = READ_BYTE();
+      push(*frame->closure->upvalues[slot]->location);
+      DISPATCH();
+    }
+    CASE(OP_SET_UPVALUE): {
+      uint8_t slot = READ_BYTE();
+      *frame->closure->upvalues[slot]->location = peek(0);
+      DISPATCH();
+    }
+    CASE(OP_GET_PROPERTY): {
+      uint8_t* instr = frame->ip - 1;
+      ObjStr* name = READ_STR();
+      bool field;
+      if (!get_property(name, READ_PROP_CACHE(), &field)) {
+        return INTERPRET_RUNTIME_ERROR;
       }
-      case OP_GET_GLOBAL: {
-        ObjStr* name = READ_STR();
-        Value value;
-        if (!table_get(&vm.globals, name, &value)) {
-          runtime_error("Undefined variable '%s'", name->chars);
-          return INTERPRET_RUNTIME_ERROR;
-        }
-        push(value);
-        break;
+      if (field) {
+        QUICKEN(instr, OP_GET_FIELD);
       }
-      case OP_DEFINE_GLOBAL: {
-        ObjStr* name = READ_STR();
-        table_set(&vm.globals, name, peek(0));
-        pop();
-        break;
+      DISPATCH();
+    }
+    CASE(OP_GET_FIELD): {
+      uint8_t* instr = frame->ip - 1;
+      frame->ip++;
+      PropertyCache* cache = READ_PROP_CACHE();
+      Value receiver = peek(0);
+      if (!IS_INSTANCE(receiver) ||
+          AS_INSTANCE(receiver)->shape != cache->shape) {
+        DEQUICKEN(instr, OP_GET_PROPERTY);
       }
-      case OP_SET_GLOBAL: {
-        ObjStr* name = READ_STR();
-        if (table_set(&vm.globals, name, peek(0))) {
-          table_delete(&vm.globals, name);
-          runtime_error("Undefined variable '%s'", name->chars);
-          return INTERPRET_RUNTIME_ERROR;
-        }
-        break;
+      vm.top[-1] = AS_INSTANCE(receiver)->fields[cache->slot];
+      DISPATCH();
+    }
+    CASE(OP_GET_LOCAL_PROPERTY): {
+      uint8_t* instr = frame->ip - 1;
+      push(frame->slots[READ_BYTE()]);
+      ObjStr* name = READ_STR();
+      bool field;
+      if (!get_property(name, READ_PROP_CACHE(), &field)) {
+        return INTERPRET_RUNTIME_ERROR;
       }
-      case OP_GET_UPVALUE: {
-        uint8_t slot = READ_BYTE();
-        push(*frame->closure->upvalues[slot]->location);
-        break;
+      if (field) {
+        QUICKEN(instr, OP_GET_LOCAL_FIELD);
       }
-      case OP_SET_UPVALUE: {
-        uint8_t slot = READ_BYTE();
-        *frame->closure->upvalues[slot]->location = peek(0);
-        break;
+      DISPATCH();
+    }
+    CASE(OP_GET_LOCAL_FIELD): {
+      uint8_t* instr = frame->ip - 1;
+      Value receiver = frame->slots[READ_BYTE()];
+      frame->ip++;
+      PropertyCache* cache = READ_PROP_CACHE();
+      if (!IS_INSTANCE(receiver) ||
+          AS_INSTANCE(receiver)->shape != cache->shape) {
+        DEQUICKEN(instr, OP_GET_LOCAL_PROPERTY);
       }
-      case OP_GET_PROPERTY: {
-        if (!IS_INSTANCE(peek(0))) {
-          runtime_error("Only instances have properties");
-          return INTERPRET_RUNTIME_ERROR;
-        }
-        ObjInstance* instance = AS_INSTANCE(peek(0));
-        ObjStr* name = READ_STR();
-        Value val;
-        if (table_get(&instance->fields, name, &val)) {
-          pop();
-          push(val);
-          break;
-        }
-        if (!bind_method(instance->cls, name)) {
-          return INTERPRET_RUNTIME_ERROR;
-        }
-        break;
+      push(AS_INSTANCE(receiver)->fields[cache->slot]);
+      DISPATCH();
+    }
+    CASE(OP_GET_FIELD_LONG): {
+      uint8_t* instr = frame->ip - 1;
+      frame->ip += 3;
+      PropertyCache* cache = READ_PROP_CACHE();
+      Value receiver = peek(0);
+      if (!IS_INSTANCE(receiver) ||
+          AS_INSTANCE(receiver)->shape != cache->shape) {
+        DEQUICKEN(instr, OP_GET_PROPERTY_LONG);
       }
-      case OP_SET_PROPERTY: {
-        if (!IS_INSTANCE(peek(1))) {
-          runtime_error("Only instances have fields");
-          return INTERPRET_RUNTIME_ERROR;
-        }
-        ObjInstance* instance = AS_INSTANCE(peek(1));
-        table_set(&instance->fields, READ_STR(), peek(0));
-        Value value = pop();
-        pop();
-        push(value);
-        break;
+      vm.top[-1] = AS_INSTANCE(receiver)->fields[cache->slot];
+      DISPATCH();
+    }
+    CASE(OP_SET_PROPERTY): {
+      uint8_t* instr = frame->ip - 1;
+      ObjStr* name = READ_STR();
+      bool field;
+      if (!set_property(name, READ_PROP_CACHE(), &field)) {
+        return INTERPRET_RUNTIME_ERROR;
       }
-      case OP_GET_SUPER: {
-        ObjStr* name = READ_STR();
-        ObjClass* superclass = AS_CLASS(pop());
-        if (!bind_method(superclass, name)) {
-          return INTERPRET_RUNTIME_ERROR;
-        }
-        break;
+      if (field) {
+        QUICKEN(instr, OP_SET_FIELD);
       }
-      case OP_EQUAL: {
-        Value b = pop();
-        Value a = pop();
-        push(BOOL_VAL(are_equal(a, b)));
-        break;
+      DISPATCH();
+    }
+    CASE(OP_SET_FIELD): {
+      uint8_t* instr = frame->ip - 1;
+      frame->ip++;
+      PropertyCache* cache = READ_PROP_CACHE();
+      Value receiver = peek(1);
+      if (!IS_INSTANCE(receiver) ||
+          AS_INSTANCE(receiver)->shape != cache->shape) {
+        DEQUICKEN(instr, OP_SET_PROPERTY);
       }
-      case OP_GREATER:
-        BINARY_OP(BOOL_VAL, >);
-        break;
-      case OP_LESS:
-        BINARY_OP(BOOL_VAL, <);
-        break;
-      case OP_ADD: {
-        if (IS_STR(peek(0)) && IS_STR(peek(1))) {
-          concat_str();
-        } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
-          double b = AS_NUMBER(pop());
-          double a = AS_NUMBER(pop());
-          push(NUMBER_VAL(a + b));
-        } else {
-          runtime_error("Operands must be two numbers or strings");
-          return INTERPRET_RUNTIME_ERROR;
-        }
-        break;
+      AS_INSTANCE(receiver)->fields[cache->slot] = peek(0);
+      vm.top[-2] = vm.top[-1];
+      vm.top--;
+      DISPATCH();
+    }
+    CASE(OP_SET_FIELD_LONG): {
+      uint8_t* instr = frame->ip - 1;
+      frame->ip += 3;
+      PropertyCache* cache = READ_PROP_CACHE();
+      Value receiver = peek(1);
+      if (!IS_INSTANCE(receiver) ||
+          AS_INSTANCE(receiver)->shape != cache->shape) {
+        DEQUICKEN(instr, OP_SET_PROPERTY_LONG);
       }
-      case OP_SUBTRACT:
-        BINARY_OP(NUMBER_VAL, -);
-        break;
-      case OP_MULTIPLY:
-        BINARY_OP(NUMBER_VAL, *);
-        break;
-      case OP_DIVIDE:
-        BINARY_OP(NUMBER_VAL, /);
-        break;
-      case OP_NOT:
-        push(BOOL_VAL(is_falsey(pop())));
-        break;
-      case OP_NEGATE:
-        if (!IS_NUMBER(peek(0))) {
-          runtime_error("Operand must be a number");
-          return INTERPRET_RUNTIME_ERROR;
-        }
-        push(NUMBER_VAL(-AS_NUMBER(pop())));
-        break;
-      case OP_PRINT: {
-        print_val(pop());
-        printf("\n");
-        break;
+      AS_INSTANCE(receiver)->fields[cache->slot] = peek(0);
+      vm.top[-2] = vm.top[-1];
+      vm.top--;
+      DISPATCH();
+    }
+    CASE(OP_GET_SUPER): {
+      ObjStr* name = READ_STR();
+      ObjClass* superclass = AS_CLASS(pop());
+      if (!bind_method(superclass, name)) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      DISPATCH();
+    }
+    CASE(OP_EQUAL): {
+      Value b = pop();
+      Value a = pop();
+      push(BOOL_VAL(are_equal(a, b)));
+      DISPATCH();
+    }
+    CASE(OP_GREATER):
+      BINARY_OP(BOOL_VAL, >, OP_GREATER_NUM);
+      DISPATCH();
+    CASE(OP_GREATER_NUM):
+      BINARY_NUM_OP(BOOL_VAL, >, OP_GREATER);
+      DISPATCH();
+    CASE(OP_LESS):
+      BINARY_OP(BOOL_VAL, <, OP_LESS_NUM);
+      DISPATCH();
+    CASE(OP_LESS_NUM):
+      BINARY_NUM_OP(BOOL_VAL, <, OP_LESS);
+      DISPATCH();
+    CASE(OP_ADD): {
+      if (IS_STR(peek(0)) && IS_STR(peek(1))) {
+        QUICKEN(frame->ip - 1, OP_ADD_STR);
+        concat_str();
+      } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
+        QUICKEN(frame->ip - 1, OP_ADD_NUM);
+        double b = AS_NUMBER(pop());
+        double a = AS_NUMBER(pop());
+        push(NUMBER_VAL(a + b));
+      } else {
+        runtime_error("Operands must be two numbers or strings");
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      DISPATCH();
+    }
+    CASE(OP_ADD_NUM):
+      BINARY_NUM_OP(NUMBER_VAL, +, OP_ADD);
+      DISPATCH();
+    CASE(OP_ADD_STR):
+      if (!IS_STR(peek(0)) || !IS_STR(peek(1))) {
+        DEQUICKEN(frame->ip - 1, OP_ADD);
+      }
+      concat_str();
+      DISPATCH();
+    CASE(OP_SUBTRACT):
+      BINARY_OP(NUMBER_VAL, -, OP_SUBTRACT_NUM);
+      DISPATCH();
+    CASE(OP_SUBTRACT_NUM):
+      BINARY_NUM_OP(NUMBER_VAL, -, OP_SUBTRACT);
+      DISPATCH();
+    CASE(OP_MULTIPLY):
+      BINARY_OP(NUMBER_VAL, *, OP_MULTIPLY_NUM);
+      DISPATCH();
+    CASE(OP_MULTIPLY_NUM):
+      BINARY_NUM_OP(NUMBER_VAL, *, OP_MULTIPLY);
+      DISPATCH();
+    CASE(OP_DIVIDE):
+      BINARY_OP(NUMBER_VAL, /, OP_DIVIDE_NUM);
+      DISPATCH();
+    CASE(OP_DIVIDE_NUM):
+      BINARY_NUM_OP(NUMBER_VAL, /, OP_DIVIDE);
+      DISPATCH();
+    CASE(OP_ADD_RR):
+      REGISTER_OP(NUMBER_VAL, +, OP_ADD, frame->slots[READ_BYTE()]);
+      DISPATCH();
+    CASE(OP_ADD_RK):
+      REGISTER_OP(NUMBER_VAL, +, OP_ADD, READ_CONSTANT());
+      DISPATCH();
+    CASE(OP_SUBTRACT_RR):
+      REGISTER_OP(NUMBER_VAL, -, OP_SUBTRACT, frame->slots[READ_BYTE()]);
+      DISPATCH();
+    CASE(OP_SUBTRACT_RK):
+      REGISTER_OP(NUMBER_VAL, -, OP_SUBTRACT, READ_CONSTANT());
+      DISPATCH();
+    CASE(OP_MULTIPLY_RR):
+      REGISTER_OP(NUMBER_VAL, *, OP_MULTIPLY, frame->slots[READ_BYTE()]);
+      DISPATCH();
+    CASE(OP_MULTIPLY_RK):
+      REGISTER_OP(NUMBER_VAL, *, OP_MULTIPLY, READ_CONSTANT());
+      DISPATCH();
+    CASE(OP_DIVIDE_RR):
+      REGISTER_OP(NUMBER_VAL, /, OP_DIVIDE, frame->slots[READ_BYTE()]);
+      DISPATCH();
+    CASE(OP_DIVIDE_RK):
+      REGISTER_OP(NUMBER_VAL, /, OP_DIVIDE, READ_CONSTANT());
+      DISPATCH();
+    CASE(OP_LESS_RR):
+      REGISTER_OP(BOOL_VAL, <, OP_LESS, frame->slots[READ_BYTE()]);
+      DISPATCH();
+    CASE(OP_LESS_RK):
+      REGISTER_OP(BOOL_VAL, <, OP_LESS, READ_CONSTANT());
+      DISPATCH();
+    CASE(OP_GREATER_RR):
+      REGISTER_OP(BOOL_VAL, >, OP_GREATER, frame->slots[READ_BYTE()]);
+      DISPATCH();
+    CASE(OP_GREATER_RK):
+      REGISTER_OP(BOOL_VAL, >, OP_GREATER, READ_CONSTANT());
+      DISPATCH();
+    CASE(OP_NOT):
+      push(BOOL_VAL(is_falsey(pop())));
+      DISPATCH();
+    CASE(OP_NEGATE):
+      if (!IS_NUMBER(peek(0))) {
+        runtime_error("Operand must be a number");
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      push(NUMBER_VAL(-AS_NUMBER(pop())));
+      DISPATCH();
+    CASE(OP_PRINT): {
+      print_val(pop());
+      printf("\n");
+      DISPATCH();
+    }
+    CASE(OP_JUMP): {
+      uint16_t offset = READ_SHORT();
+      frame->ip += offset;
+      DISPATCH();
+    }
+    CASE(OP_JUMP_IF_FALSE): {
+      uint16_t offset = READ_SHORT();
+      if (is_falsey(peek(0))) {
+        frame->ip += offset;
       }
-      case OP_JUMP: {
-        uint16_t offset = READ_SHORT();
+      DISPATCH();
+    }
+    CASE(OP_JUMP_IF_FALSE_POP): {
+      uint16_t offset = READ_SHORT();
+      if (is_falsey(pop())) {
         frame->ip += offset;
-        break;
       }
-      case OP_JUMP_IF_FALSE: {
-        uint16_t offset = READ_SHORT();
-        if (is_falsey(peek(0))) {
-          frame->ip += offset;
-        }
-        break;
+      DISPATCH();
+    }
+    CASE(OP_JUMP_IF_TRUE_POP): {
+      uint16_t offset = READ_SHORT();
+      if (!is_falsey(pop())) {
+        frame->ip += offset;
+      }
+      DISPATCH();
+    }
+    CASE(OP_LOOP): {
+      uint8_t* loop = frame->ip - 1;
+      uint16_t offset = READ_SHORT();
+      LoopCache* cache = READ_LOOP_CACHE();
+      frame->ip -= offset;
+      BACK_EDGE(loop, cache);
+      DISPATCH();
+    }
+    CASE(OP_FOR_PREP): {
+      uint8_t counter = READ_BYTE();
+      uint8_t limit_operand = READ_BYTE();
+      uint8_t mode = READ_BYTE();
+      uint16_t offset = READ_SHORT();
+      Value limit = FOR_LIMIT(mode, limit_operand);
+      if (!IS_NUMBER(frame->slots[counter]) || !IS_NUMBER(limit)) {
+        runtime_error("Operands must be numbers");
+        return INTERPRET_RUNTIME_ERROR;
       }
-      case OP_LOOP: {
-        uint16_t offset = READ_SHORT();
+      if (!for_test(mode, AS_NUMBER(frame->slots[counter]),
+                    AS_NUMBER(limit))) {
+        ByteSequence* bseq = &frame->closure->function->bseq;
+        frame->ip = (mode & FOR_FAR_EXIT) ? bseq->code + bseq->far_jumps[offset]
+                                          : frame->ip + offset;
+      }
+      DISPATCH();
+    }
+    CASE(OP_FOR_LOOP): {
+      // OP_FOR_PREP checked the types, and nothing in the body can change them
+      uint8_t* loop = frame->ip - 1;
+      uint8_t counter = READ_BYTE();
+      uint8_t limit_operand = READ_BYTE();
+      uint8_t mode = READ_BYTE();
+      double step = AS_NUMBER(READ_CONSTANT());
+      uint16_t offset = READ_SHORT();
+      LoopCache* cache = READ_LOOP_CACHE();
+      double value = AS_NUMBER(frame->slots[counter]) + step;
+      frame->slots[counter] = NUMBER_VAL(value);
+      Value limit = FOR_LIMIT(mode, limit_operand);
+      if (for_test(mode, value, AS_NUMBER(limit))) {
         frame->ip -= offset;
-        break;
+        BACK_EDGE(loop, cache);
       }
-      case OP_CALL: {
-        int arg_count = READ_BYTE();
-        if (!call_value(peek(arg_count), arg_count)) {
+      DISPATCH();
+    }
+    CASE(OP_CALL): {
+      int arg_count = READ_BYTE();
+      Value callee = peek(arg_count);
+      // Natives push no frame, so there is nothing to reload or compile
+      if (IS_NATIVE(callee)) {
+        if (!call_native(AS_NATIVE(callee), arg_count)) {
           return INTERPRET_RUNTIME_ERROR;
         }
-        frame = &vm.frames[vm.frame_count - 1];
-        break;
+        CHECK_FUEL();
+        DISPATCH();
       }
-      case OP_INVOKE: {
-        ObjStr* method = READ_STR();
-        int arg_cnt = READ_BYTE();
-        if (!invoke(method, arg_cnt)) {
-          return INTERPRET_RUNTIME_ERROR;
-        }
-        frame = &vm.frames[vm.frame_count - 1];
-        break;
+      if (!call_value(callee, arg_count)) {
+        return INTERPRET_RUNTIME_ERROR;
       }
-      case OP_SUPER_INVOKE: {
-        ObjStr* method = READ_STR();
-        int arg_cnt = READ_BYTE();
-        ObjClass* superclass = AS_CLASS(pop());
-        if (!invoke_from_class(superclass, method, arg_cnt)) {
-          return INTERPRET_RUNTIME_ERROR;
-        }
-        frame = &vm.frames[vm.frame_count - 1];
-        break;
+      frame = &vm.frames[vm.frame_count - 1];
+      JIT_ENTER();
+      DISPATCH();
+    }
+    CASE(OP_INTRINSIC): {
+      uint8_t id = READ_BYTE();
+      if (run_intrinsic(id)) {
+        DISPATCH();
       }
-      case OP_CLOSURE: {
-        ObjFunction* function = AS_FUNCTION(READ_CONSTANT());
-        ObjClosure* closure = new_closure(function);
-        push(OBJ_VAL(closure));
-        for (int i = 0; i < closure->upvalue_cnt; i++) {
-          uint8_t is_local = READ_BYTE();
-          uint8_t index = READ_BYTE();
-          if (is_local) {
-            closure->upvalues[i] = capture_upvalue(frame->slots + index);
-          } else {
-            closure->upvalues[i] = frame->closure->upvalues[index];
-          }
-        }
-        break;
+      // The global was redefined, or the native reports the argument error
+      int arg_cnt = intrinsics[id].arity;
+      if (!call_value(peek(arg_cnt), arg_cnt)) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      frame = &vm.frames[vm.frame_count - 1];
+      JIT_ENTER();
+      DISPATCH();
+    }
+    CASE(OP_TAIL_CALL): {
+      int arg_cnt = READ_BYTE();
+      if (!tail_call(frame, arg_cnt)) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      frame = &vm.frames[vm.frame_count - 1];
+      JIT_ENTER();
+      DISPATCH();
+    }
+    CASE(OP_INVOKE): {
+      ObjStr* method = READ_STR();
+      int arg_cnt = READ_BYTE();
+      InvokeCache* cache = READ_INVOKE_CACHE();
+      if (!invoke(method, arg_cnt, cache, NULL)) {
+        return INTERPRET_RUNTIME_ERROR;
       }
-      case OP_CLOSE_UPVALUE:
-        close_upvalues(vm.top - 1);
+      frame = &vm.frames[vm.frame_count - 1];
+      JIT_ENTER();
+      DISPATCH();
+    }
+    CASE(OP_SUPER_INVOKE): {
+      ObjStr* method = READ_STR();
+      int arg_cnt = READ_BYTE();
+      InvokeCache* cache = READ_INVOKE_CACHE();
+      if (!super_invoke(method, arg_cnt, cache, NULL)) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      frame = &vm.frames[vm.frame_count - 1];
+      JIT_ENTER();
+      DISPATCH();
+    }
+    CASE(OP_TAIL_INVOKE): {
+      ObjStr* method = READ_STR();
+      int arg_cnt = READ_BYTE();
+      InvokeCache* cache = READ_INVOKE_CACHE();
+      if (!invoke(method, arg_cnt, cache, frame)) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      frame = &vm.frames[vm.frame_count - 1];
+      JIT_ENTER();
+      DISPATCH();
+    }
+    CASE(OP_TAIL_SUPER_INVOKE): {
+      ObjStr* method = READ_STR();
+      int arg_cnt = READ_BYTE();
+      InvokeCache* cache = READ_INVOKE_CACHE();
+      if (!super_invoke(method, arg_cnt, cache, frame)) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      frame = &vm.frames[vm.frame_count - 1];
+      JIT_ENTER();
+      DISPATCH();
+    }
+    CASE(OP_INLINE_CALL): {
+      uint8_t* site = frame->ip - 1;
+      ObjFunction* function = AS_FUNCTION(READ_CONSTANT());
+      uint16_t skip = READ_SHORT();
+      Value callee = peek(function->arity);
+      if (IS_CLOSURE(callee) && AS_CLOSURE(callee)->function == function) {
+        enter_inlined(frame, site, function->arity);
+        DISPATCH();
+      }
+      // The global was redefined: make the call the body stands for
+      frame->ip += skip;
+      if (!call_value(callee, function->arity)) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      frame = &vm.frames[vm.frame_count - 1];
+      JIT_ENTER();
+      DISPATCH();
+    }
+    CASE(OP_INLINE_INVOKE): {
+      uint8_t* site = frame->ip - 1;
+      ObjStr* method = READ_STR();
+      InvokeCache* cache = READ_INVOKE_CACHE();
+      ObjFunction* function = AS_FUNCTION(READ_CONSTANT());
+      uint16_t skip = READ_SHORT();
+      if (invokes_inlined(cache, function)) {
+        enter_inlined(frame, site, function->arity);
+        DISPATCH();
+      }
+      // Also taken until the call site has cached the receiver's class
+      frame->ip += skip;
+      if (!invoke(method, function->arity, cache, NULL)) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      frame = &vm.frames[vm.frame_count - 1];
+      JIT_ENTER();
+      DISPATCH();
+    }
+    CASE(OP_INLINE_RETURN):
+      leave_inlined(frame);
+      DISPATCH();
+    CASE(OP_CLOSURE):
+      make_closure(frame, AS_FUNCTION(READ_CONSTANT()));
+      DISPATCH();
+    CASE(OP_CLOSURE_LONG):
+      make_closure(frame, AS_FUNCTION(READ_CONSTANT_LONG()));
+      DISPATCH();
+    CASE(OP_CLOSE_UPVALUE):
+      close_upvalues(frame, vm.top - 1);
+      pop();
+      DISPATCH();
+    CASE(OP_RETURN): {
+      Value result = pop();
+      close_upvalues(frame, frame->slots);
+      vm.frame_count--;
+      if (vm.frame_count == 0) {
         pop();
-        break;
-      case OP_RETURN: {
-        Value result = pop();
-        close_upvalues(frame->slots);
-        vm.frame_count--;
-        if (vm.frame_count == 0) {
-          pop();
-          return INTERPRET_OK;
-        }
-        vm.top = frame->slots;
-        push(result);
-        frame = &vm.frames[vm.frame_count - 1];
-        break;
+        return INTERPRET_OK;
       }
-      case OP_CLASS: {
-        push(OBJ_VAL(new_class(READ_STR())));
-        break;
+      vm.top = frame->slots;
+      push(result);
+      frame = &vm.frames[vm.frame_count - 1];
+      JIT_ENTER();
+      DISPATCH();
+    }
+    CASE(OP_THROW):
+      vm.exception = pop();
+      return INTERPRET_RUNTIME_ERROR;
+    CASE(OP_CLASS): {
+      push(OBJ_VAL(new_class(READ_STR())));
+      DISPATCH();
+    }
+    CASE(OP_INHERIT): {
+      Value superclass = peek(1);
+      if (!IS_CLASS(superclass)) {
+        runtime_error("Superclass must be a class");
+        return INTERPRET_RUNTIME_ERROR;
       }
-      case OP_INHERIT: {
-        Value superclass = peek(1);
-        if (!IS_CLASS(superclass)) {
-          runtime_error("Superclass must be a class");
-          return INTERPRET_RUNTIME_ERROR;
-        }
 
-        ObjClass* subclass = AS_CLASS(peek(0));
-        table_add_all(&AS_CLASS(superclass)->methods, &subclass->methods);
-        pop();  // pop the subclass
-        break;
+      ObjClass* subclass = AS_CLASS(peek(0));
+      table_add_all(&AS_CLASS(superclass)->methods, &subclass->methods);
+      subclass->version++;
+      pop();  // pop the subclass
+      DISPATCH();
+    }
+    CASE(OP_METHOD): {
+      define_method(READ_STR());
+      DISPATCH();
+    }
+    CASE(OP_CONSTANT_LONG): {
+      Value constant = READ_CONSTANT_LONG();
+      push(constant);
+      DISPATCH();
+    }
+    CASE(OP_GET_LOCAL_LONG): {
+      uint16_t slot = READ_SHORT();
+      push(frame->slots[slot]);
+      DISPATCH();
+    }
+    CASE(OP_SET_LOCAL_LONG): {
+      uint16_t slot = READ_SHORT();
+      frame->slots[slot] = peek(0);
+      DISPATCH();
+    }
+    CASE(OP_GET_UPVALUE_LONG): {
+      uint16_t slot = READ_SHORT();
+      push(*frame->closure->upvalues[slot]->location);
+      DISPATCH();
+    }
+    CASE(OP_SET_UPVALUE_LONG): {
+      uint16_t slot = READ_SHORT();
+      *frame->closure->upvalues[slot]->location = peek(0);
+      DISPATCH();
+    }
+    CASE(OP_GET_PROPERTY_LONG): {
+      uint8_t* instr = frame->ip - 1;
+      ObjStr* name = READ_STR_LONG();
+      bool field;
+      if (!get_property(name, READ_PROP_CACHE(), &field)) {
+        return INTERPRET_RUNTIME_ERROR;
       }
-      case OP_METHOD: {
-        define_method(READ_STR());
-        break;
+      if (field) {
+        QUICKEN(instr, OP_GET_FIELD_LONG);
+      }
+      DISPATCH();
+    }
+    CASE(OP_SET_PROPERTY_LONG): {
+      uint8_t* instr = frame->ip - 1;
+      ObjStr* name = READ_STR_LONG();
+      bool field;
+      if (!set_property(name, READ_PROP_CACHE(), &field)) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      if (field) {
+        QUICKEN(instr, OP_SET_FIELD_LONG);
+      }
+      DISPATCH();
+    }
+    CASE(OP_GET_SUPER_LONG): {
+      ObjStr* name = READ_STR_LONG();
+      ObjClass* superclass = AS_CLASS(pop());
+      if (!bind_method(superclass, name)) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      DISPATCH();
+    }
+    CASE(OP_INVOKE_LONG): {
+      ObjStr* method = READ_STR_LONG();
+      int arg_cnt = READ_BYTE();
+      InvokeCache* cache = READ_INVOKE_CACHE();
+      if (!invoke(method, arg_cnt, cache, NULL)) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      frame = &vm.frames[vm.frame_count - 1];
+      JIT_ENTER();
+      DISPATCH();
+    }
+    CASE(OP_SUPER_INVOKE_LONG): {
+      ObjStr* method = READ_STR_LONG();
+      int arg_cnt = READ_BYTE();
+      InvokeCache* cache = READ_INVOKE_CACHE();
+      if (!super_invoke(method, arg_cnt, cache, NULL)) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      frame = &vm.frames[vm.frame_count - 1];
+      JIT_ENTER();
+      DISPATCH();
+    }
+    CASE(OP_TAIL_INVOKE_LONG): {
+      ObjStr* method = READ_STR_LONG();
+      int arg_cnt = READ_BYTE();
+      InvokeCache* cache = READ_INVOKE_CACHE();
+      if (!invoke(method, arg_cnt, cache, frame)) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      frame = &vm.frames[vm.frame_count - 1];
+      JIT_ENTER();
+      DISPATCH();
+    }
+    CASE(OP_TAIL_SUPER_INVOKE_LONG): {
+      ObjStr* method = READ_STR_LONG();
+      int arg_cnt = READ_BYTE();
+      InvokeCache* cache = READ_INVOKE_CACHE();
+      if (!super_invoke(method, arg_cnt, cache, frame)) {
+        return INTERPRET_RUNTIME_ERROR;
       }
+      frame = &vm.frames[vm.frame_count - 1];
+      JIT_ENTER();
+      DISPATCH();
     }
+    CASE(OP_CLASS_LONG):
+      push(OBJ_VAL(new_class(READ_STR_LONG())));
+      DISPATCH();
+    CASE(OP_METHOD_LONG):
+      define_method(READ_STR_LONG());
+      DISPATCH();
+    CASE(OP_JUMP_FAR): {
+      uint8_t* target = READ_FAR_JUMP();
+      frame->ip = target;
+      DISPATCH();
+    }
+    CASE(OP_JUMP_IF_FALSE_FAR): {
+      uint8_t* target = READ_FAR_JUMP();
+      if (is_falsey(peek(0))) {
+        frame->ip = target;
+      }
+      DISPATCH();
+    }
+    CASE(OP_JUMP_IF_FALSE_POP_FAR): {
+      uint8_t* target = READ_FAR_JUMP();
+      if (is_falsey(pop())) {
+        frame->ip = target;
+      }
+      DISPATCH();
+    }
+    CASE(OP_LOOP_FAR): {
+      uint8_t* loop = frame->ip - 1;
+      uint8_t* target = READ_FAR_JUMP();
+      LoopCache* cache = READ_LOOP_CACHE();
+      frame->ip = target;
+      BACK_EDGE(loop, cache);
+      DISPATCH();
+    }
+#ifdef COMPUTED_GOTO
+  record:
+    frame->ip--;
+    if (!trace_record(frame)) {
+      dispatch = dispatch_table;
+    }
+    goto *dispatch_table[READ_BYTE()];
+#endif
   }
+  // Handlers leave through DISPATCH() or a return, so only an unknown opcode
+  // falls out of the switch loop
+  return INTERPRET_RUNTIME_ERROR;
+}
+
+#if defined(COMPUTED_GOTO) && defined(__GNUC__)
+#pragma GCC diagnostic pop
+#endif
+
+/**
+ * Unwinds to the innermost try block around the instruction that threw
+ * vm.exception, in the top frame or the callers below it, and pushes the
+ * exception for its catch block. Returns false, after printing the error
+ * and a stack trace, if no try block encloses it.
+ */
+static bool catch_exception(void) {
+  for (int i = vm.frame_count - 1; i >= 0; i--) {
+    CallFrame* frame = &vm.frames[i];
+    ByteSequence* bseq = &frame->closure->function->bseq;
+    Handler* handler = find_handler(bseq, (int)(frame->ip - bseq->code - 1));
+    if (handler == NULL) {
+      continue;
+    }
+    // A try block encloses the whole of a body inlined into it
+    if (frame->inline_site != NULL) {
+      frame->slots = frame->caller_slots;
+      frame->inline_site = NULL;
+    }
+    // Closures made by the frames unwound keep what their slots held
+    for (int j = vm.frame_count - 1; j > i; j--) {
+      close_upvalues(&vm.frames[j], vm.stack);
+    }
+    close_upvalues(frame, frame->slots + handler->depth);
+    vm.frame_count = i + 1;
+    vm.top = frame->slots + handler->depth;
+    push(vm.exception);
+    vm.exception = NIL_VAL;
+    frame->ip = bseq->code + handler->handler;
+    return true;
+  }
+
+  // Runtime errors throw their message
+  if (IS_STR(vm.exception)) {
+    (void)fprintf(stderr, "%s\n", AS_CSTR(vm.exception));
+  } else if (IS_NUMBER(vm.exception)) {
+    (void)fprintf(stderr, "Uncaught exception %g\n",
+                  AS_NUMBER(vm.exception));
+  } else if (IS_INSTANCE(vm.exception)) {
+    (void)fprintf(stderr, "Uncaught %s instance\n",
+                  AS_INSTANCE(vm.exception)->cls->name->chars);
+  } else {
+    (void)fprintf(stderr, "Uncaught exception\n");
+  }
+  print_stack_trace();
+  vm.exception = NIL_VAL;
+  reset_stack();
+  return false;
 }
 
 InterpretResult interpret(const char* src) {
+  if (vm.frame_count != 0) {
+    return INTERPRET_BUSY;
+  }
   ObjFunction* function = compile(src);
   if (function == NULL) {
     return INTERPRET_COMPILE_ERROR;
   }
 
   push(OBJ_VAL(function));
-  ObjClosure* closure = new_closure(function);
+  ObjClosure* closure = new_closure(function, 0);
   pop();
   push(OBJ_VAL(closure));
-  call(closure, 0);
+  if (!call(closure, 0)) {
+    // No handler can be running yet, so this reports the error
+    (void)catch_exception();
+    return INTERPRET_RUNTIME_ERROR;
+  }
+  return resume();
+}
 
-  return run();
+void set_fuel(int64_t fuel) { vm.fuel = fuel; }
+
+InterpretResult resume(void) {
+  if (vm.frame_count == 0) {
+    return INTERPRET_NOT_SUSPENDED;
+  }
+  InterpretResult result = run();
+  while (result == INTERPRET_RUNTIME_ERROR && catch_exception()) {
+    result = run();
+  }
+  return result;
 }
 
 void push(Value val) {
@@ -1,45 +1,98 @@
 #pragma once
 
+#include "native.h"
 #include "object.h"
 #include "table.h"
 #include "value.h"
 
-#define FRAMES_MAX 64
-#define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
+// Both stacks start small and grow on demand up to these limits
+#ifndef FRAMES_MAX
+#define FRAMES_MAX 65536
+#endif
+#ifndef STACK_MAX
+#define STACK_MAX (1024 * 1024)
+#endif
+#define FRAMES_INIT 16
+#define STACK_INIT 256
+// Values the runtime pushes within one instruction to keep them from the GC
+#define STACK_RESERVE 8
 
 typedef struct {
   ObjClosure* closure;
   uint8_t* ip;
   Value* slots;
+  // While the frame runs a body inlined by the guard at `inline_site`, its
+  // own slots are kept in `caller_slots`. inline_site is NULL otherwise.
+  uint8_t* inline_site;
+  Value* caller_slots;
+  ObjUpvalue* open_upvalues;  // for the frame's slots, highest first
 } CallFrame;
 
 typedef struct {
-  CallFrame frames[FRAMES_MAX];
+  CallFrame* frames;
   int frame_count;
-  ObjUpvalue* open_upvalues;
-  Value stack[STACK_MAX];
+  int frame_capacity;
+  Value* stack;
   Value* top;
-  Table globals;
+  int stack_capacity;
+  ObjUpvalue** open_slots;  // open upvalue of each stack slot, or NULL
+  Table global_slots;  // name -> index into global_vals
+  ValueArray global_names;
+  ValueArray global_vals;  // EMPTY_VAL until the global is defined
+  Table global_consts;     // name -> value of each top-level const
+  Table assigned_globals;  // name -> true once compiled code stores to it
+  Table inline_functions;  // name -> function of each top-level fun
+  Table inline_methods;    // name -> function of the only method so named
   Table strings;
   ObjStr* init_str;
+  ObjShape* empty_shape;
+  Value exception;  // thrown and not yet caught, else nil
+  ObjNative* intrinsics[INTRINSIC_CNT];  // what OP_INTRINSIC expects to call
   Obj* objects;
   int gray_cnt;
   int gray_capacity;
   Obj** gray_stack;
   size_t bytes_allocated;
   size_t next_gc;
+  bool register_ops;  // compile to register instructions where possible
+  int opt_level;      // 0 compiles code as written, see compile.c
+  int64_t fuel;       // calls and loop iterations left before suspending
+  bool debug_output;  // cleared by the LANG_NO_TRACE environment variable
+#ifdef JIT
+  bool jit_enabled;  // cleared by the LANG_NO_JIT environment variable
+#endif
 } VM;
 
 typedef enum {
   INTERPRET_OK,
   INTERPRET_COMPILE_ERROR,
-  INTERPRET_RUNTIME_ERROR
+  INTERPRET_RUNTIME_ERROR,
+  INTERPRET_SUSPENDED,     // out of fuel, resume() continues where it stopped
+  INTERPRET_NOT_SUSPENDED,  // resume() found no program to continue
+  INTERPRET_BUSY            // interpret() found a program still suspended
 } InterpretResult;
 
 extern VM vm;
 
 void init_vm(void);
 void free_vm(void);
+/**
+ * Compiles and runs `src`. Returns INTERPRET_BUSY without compiling it while
+ * another program is suspended, which has to be resumed to the end first.
+ */
 InterpretResult interpret(const char* src);
+/**
+ * Sets how many calls and loop back-edges may run before interpret() or
+ * resume() returns INTERPRET_SUSPENDED. Unlimited by default.
+ */
+void set_fuel(int64_t fuel);
+/**
+ * Continues a program suspended by running out of fuel. Returns
+ * INTERPRET_NOT_SUSPENDED if no program is suspended.
+ */
+InterpretResult resume(void);
+int global_slot(ObjStr* name);
+/** Stores `message` as the error of a failing native call and returns false. */
+bool native_error(Value* args, const char* message);
 void push(Value val);
 Value pop(void);
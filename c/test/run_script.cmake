@@ -0,0 +1,52 @@
+# Runs the interpreter LANG on SCRIPT and checks what it prints against the
+# script's comments:
+#   // expect: LINE        the next line of standard output
+#   // expect error: TEXT  standard error contains TEXT
+#   // expect exit: CODE   the exit code, 0 by default
+#   // env: NAME=VALUE     set for the run, on top of EXTRA_ENV
+# Expectations can't contain ';', which CMake reads as a list separator.
+
+file(STRINGS "${SCRIPT}" directives REGEX "// (expect|env)")
+
+set(expected_out "")
+set(expected_errors "")
+set(expected_exit 0)
+set(env LANG_NO_TRACE=1 ${EXTRA_ENV})
+foreach(line IN LISTS directives)
+  if(line MATCHES "// expect: (.*)$")
+    string(APPEND expected_out "${CMAKE_MATCH_1}\n")
+  elseif(line MATCHES "// expect error: (.*)$")
+    list(APPEND expected_errors "${CMAKE_MATCH_1}")
+  elseif(line MATCHES "// expect exit: ([0-9]+)")
+    set(expected_exit "${CMAKE_MATCH_1}")
+  elseif(line MATCHES "// env: (.*)$")
+    list(APPEND env "${CMAKE_MATCH_1}")
+  endif()
+endforeach()
+
+execute_process(
+    COMMAND "${CMAKE_COMMAND}" -E env ${env} "${LANG}" "${SCRIPT}"
+    OUTPUT_VARIABLE out
+    ERROR_VARIABLE err
+    RESULT_VARIABLE code
+)
+
+set(failed FALSE)
+if(NOT out STREQUAL expected_out)
+  message("Expected output:\n${expected_out}\nGot:\n${out}")
+  set(failed TRUE)
+endif()
+foreach(error IN LISTS expected_errors)
+  string(FIND "${err}" "${error}" at)
+  if(at EQUAL -1)
+    message("Expected error: ${error}")
+    set(failed TRUE)
+  endif()
+endforeach()
+if(NOT code STREQUAL expected_exit)
+  message("Expected exit code ${expected_exit}, got ${code}")
+  set(failed TRUE)
+endif()
+if(failed)
+  message(FATAL_ERROR "Standard error:\n${err}")
+endif()
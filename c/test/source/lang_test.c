@@ -1,6 +1,63 @@
+#include <stdio.h>
+
+#include "vm.h"
+
+static int failures = 0;
+
+static void check(bool holds, const char* what) {
+  if (!holds) {
+    (void)fprintf(stderr, "FAILED: %s\n", what);
+    failures++;
+  }
+}
+
+/** Native calls use fuel like any other call. */
+static void test_native_calls_use_fuel(void) {
+  init_vm();
+  vm.debug_output = false;
+  set_fuel(2);
+  InterpretResult result = interpret("clock(); clock(); clock(); clock();");
+  check(result == INTERPRET_SUSPENDED, "native calls suspend the program");
+  set_fuel(INT64_MAX);
+  check(resume() == INTERPRET_OK, "a suspended program runs to the end");
+  free_vm();
+}
+
+/** resume() has nothing to continue once a program finished. */
+static void test_resume_without_suspension(void) {
+  init_vm();
+  vm.debug_output = false;
+  check(resume() == INTERPRET_NOT_SUSPENDED, "resume() before interpret()");
+  check(interpret("var a = 1;") == INTERPRET_OK, "the program runs");
+  check(resume() == INTERPRET_NOT_SUSPENDED, "resume() after it finished");
+  check(interpret("nil + 1;") == INTERPRET_RUNTIME_ERROR, "the program fails");
+  check(resume() == INTERPRET_NOT_SUSPENDED, "resume() after a runtime error");
+  free_vm();
+}
+
+/** interpret() doesn't run a program on top of a suspended one. */
+static void test_interpret_while_suspended(void) {
+  init_vm();
+  vm.debug_output = false;
+  set_fuel(1);
+  check(interpret("var a = 0; clock(); clock(); a = 1;") ==
+            INTERPRET_SUSPENDED,
+        "the first program suspends");
+  set_fuel(INT64_MAX);
+  check(interpret("a = 2;") == INTERPRET_BUSY,
+        "interpret() while a program is suspended");
+  check(resume() == INTERPRET_OK, "the suspended program runs to the end");
+  check(interpret("if (a != 1) clock(1);") == INTERPRET_OK,
+        "the rejected program didn't run");
+  free_vm();
+}
+
 int main(int argc, char const* argv[]) {
   (void)argc;
   (void)argv;
 
-  return (0 == 0) ? 0 : 1;
+  test_native_calls_use_fuel();
+  test_resume_without_suspension();
+  test_interpret_while_suspended();
+  return failures == 0 ? 0 : 1;
 }